@@ -1,158 +1,40 @@
 #include "aes.h"
+#include "threadpool.h"
+#include "mappedfile.h"
+#include "randomgenerator.h"
 #include <cassert>
 #include <algorithm>
 #include <fstream>
 #include <stdexcept>
-#include <random>
-
-const std::array<uint8_t, 256> AES::SBOX =
- {0x63 ,0x7c ,0x77 ,0x7b ,0xf2 ,0x6b ,0x6f ,0xc5 ,0x30 ,0x01 ,0x67 ,0x2b ,0xfe ,0xd7 ,0xab ,0x76
- ,0xca ,0x82 ,0xc9 ,0x7d ,0xfa ,0x59 ,0x47 ,0xf0 ,0xad ,0xd4 ,0xa2 ,0xaf ,0x9c ,0xa4 ,0x72 ,0xc0
- ,0xb7 ,0xfd ,0x93 ,0x26 ,0x36 ,0x3f ,0xf7 ,0xcc ,0x34 ,0xa5 ,0xe5 ,0xf1 ,0x71 ,0xd8 ,0x31 ,0x15
- ,0x04 ,0xc7 ,0x23 ,0xc3 ,0x18 ,0x96 ,0x05 ,0x9a ,0x07 ,0x12 ,0x80 ,0xe2 ,0xeb ,0x27 ,0xb2 ,0x75
- ,0x09 ,0x83 ,0x2c ,0x1a ,0x1b ,0x6e ,0x5a ,0xa0 ,0x52 ,0x3b ,0xd6 ,0xb3 ,0x29 ,0xe3 ,0x2f ,0x84
- ,0x53 ,0xd1 ,0x00 ,0xed ,0x20 ,0xfc ,0xb1 ,0x5b ,0x6a ,0xcb ,0xbe ,0x39 ,0x4a ,0x4c ,0x58 ,0xcf
- ,0xd0 ,0xef ,0xaa ,0xfb ,0x43 ,0x4d ,0x33 ,0x85 ,0x45 ,0xf9 ,0x02 ,0x7f ,0x50 ,0x3c ,0x9f ,0xa8
- ,0x51 ,0xa3 ,0x40 ,0x8f ,0x92 ,0x9d ,0x38 ,0xf5 ,0xbc ,0xb6 ,0xda ,0x21 ,0x10 ,0xff ,0xf3 ,0xd2
- ,0xcd ,0x0c ,0x13 ,0xec ,0x5f ,0x97 ,0x44 ,0x17 ,0xc4 ,0xa7 ,0x7e ,0x3d ,0x64 ,0x5d ,0x19 ,0x73
- ,0x60 ,0x81 ,0x4f ,0xdc ,0x22 ,0x2a ,0x90 ,0x88 ,0x46 ,0xee ,0xb8 ,0x14 ,0xde ,0x5e ,0x0b ,0xdb
- ,0xe0 ,0x32 ,0x3a ,0x0a ,0x49 ,0x06 ,0x24 ,0x5c ,0xc2 ,0xd3 ,0xac ,0x62 ,0x91 ,0x95 ,0xe4 ,0x79
- ,0xe7 ,0xc8 ,0x37 ,0x6d ,0x8d ,0xd5 ,0x4e ,0xa9 ,0x6c ,0x56 ,0xf4 ,0xea ,0x65 ,0x7a ,0xae ,0x08
- ,0xba ,0x78 ,0x25 ,0x2e ,0x1c ,0xa6 ,0xb4 ,0xc6 ,0xe8 ,0xdd ,0x74 ,0x1f ,0x4b ,0xbd ,0x8b ,0x8a
- ,0x70 ,0x3e ,0xb5 ,0x66 ,0x48 ,0x03 ,0xf6 ,0x0e ,0x61 ,0x35 ,0x57 ,0xb9 ,0x86 ,0xc1 ,0x1d ,0x9e
- ,0xe1 ,0xf8 ,0x98 ,0x11 ,0x69 ,0xd9 ,0x8e ,0x94 ,0x9b ,0x1e ,0x87 ,0xe9 ,0xce ,0x55 ,0x28 ,0xdf
- ,0x8c ,0xa1 ,0x89 ,0x0d ,0xbf ,0xe6 ,0x42 ,0x68 ,0x41 ,0x99 ,0x2d ,0x0f ,0xb0 ,0x54 ,0xbb ,0x16};
-
-const std::array<uint8_t, 256> AES::INV_SBOX =
- {0x52 ,0x09 ,0x6a ,0xd5 ,0x30 ,0x36 ,0xa5 ,0x38 ,0xbf ,0x40 ,0xa3 ,0x9e ,0x81 ,0xf3 ,0xd7 ,0xfb 
- ,0x7c ,0xe3 ,0x39 ,0x82 ,0x9b ,0x2f ,0xff ,0x87 ,0x34 ,0x8e ,0x43 ,0x44 ,0xc4 ,0xde ,0xe9 ,0xcb 
- ,0x54 ,0x7b ,0x94 ,0x32 ,0xa6 ,0xc2 ,0x23 ,0x3d ,0xee ,0x4c ,0x95 ,0x0b ,0x42 ,0xfa ,0xc3 ,0x4e 
- ,0x08 ,0x2e ,0xa1 ,0x66 ,0x28 ,0xd9 ,0x24 ,0xb2 ,0x76 ,0x5b ,0xa2 ,0x49 ,0x6d ,0x8b ,0xd1 ,0x25 
- ,0x72 ,0xf8 ,0xf6 ,0x64 ,0x86 ,0x68 ,0x98 ,0x16 ,0xd4 ,0xa4 ,0x5c ,0xcc ,0x5d ,0x65 ,0xb6 ,0x92 
- ,0x6c ,0x70 ,0x48 ,0x50 ,0xfd ,0xed ,0xb9 ,0xda ,0x5e ,0x15 ,0x46 ,0x57 ,0xa7 ,0x8d ,0x9d ,0x84 
- ,0x90 ,0xd8 ,0xab ,0x00 ,0x8c ,0xbc ,0xd3 ,0x0a ,0xf7 ,0xe4 ,0x58 ,0x05 ,0xb8 ,0xb3 ,0x45 ,0x06 
- ,0xd0 ,0x2c ,0x1e ,0x8f ,0xca ,0x3f ,0x0f ,0x02 ,0xc1 ,0xaf ,0xbd ,0x03 ,0x01 ,0x13 ,0x8a ,0x6b 
- ,0x3a ,0x91 ,0x11 ,0x41 ,0x4f ,0x67 ,0xdc ,0xea ,0x97 ,0xf2 ,0xcf ,0xce ,0xf0 ,0xb4 ,0xe6 ,0x73 
- ,0x96 ,0xac ,0x74 ,0x22 ,0xe7 ,0xad ,0x35 ,0x85 ,0xe2 ,0xf9 ,0x37 ,0xe8 ,0x1c ,0x75 ,0xdf ,0x6e 
- ,0x47 ,0xf1 ,0x1a ,0x71 ,0x1d ,0x29 ,0xc5 ,0x89 ,0x6f ,0xb7 ,0x62 ,0x0e ,0xaa ,0x18 ,0xbe ,0x1b 
- ,0xfc ,0x56 ,0x3e ,0x4b ,0xc6 ,0xd2 ,0x79 ,0x20 ,0x9a ,0xdb ,0xc0 ,0xfe ,0x78 ,0xcd ,0x5a ,0xf4 
- ,0x1f ,0xdd ,0xa8 ,0x33 ,0x88 ,0x07 ,0xc7 ,0x31 ,0xb1 ,0x12 ,0x10 ,0x59 ,0x27 ,0x80 ,0xec ,0x5f 
- ,0x60 ,0x51 ,0x7f ,0xa9 ,0x19 ,0xb5 ,0x4a ,0x0d ,0x2d ,0xe5 ,0x7a ,0x9f ,0x93 ,0xc9 ,0x9c ,0xef 
- ,0xa0 ,0xe0 ,0x3b ,0x4d ,0xae ,0x2a ,0xf5 ,0xb0 ,0xc8 ,0xeb ,0xbb ,0x3c ,0x83 ,0x53 ,0x99 ,0x61 
- ,0x17 ,0x2b ,0x04 ,0x7e ,0xba ,0x77 ,0xd6 ,0x26 ,0xe1 ,0x69 ,0x14 ,0x63 ,0x55 ,0x21 ,0x0c ,0x7d};
-
-const std::array<uint8_t, 256> AES::GMUL2 = 
-{0x00,0x02,0x04,0x06,0x08,0x0a,0x0c,0x0e,0x10,0x12,0x14,0x16,0x18,0x1a,0x1c,0x1e,
-0x20,0x22,0x24,0x26,0x28,0x2a,0x2c,0x2e,0x30,0x32,0x34,0x36,0x38,0x3a,0x3c,0x3e,
-0x40,0x42,0x44,0x46,0x48,0x4a,0x4c,0x4e,0x50,0x52,0x54,0x56,0x58,0x5a,0x5c,0x5e,
-0x60,0x62,0x64,0x66,0x68,0x6a,0x6c,0x6e,0x70,0x72,0x74,0x76,0x78,0x7a,0x7c,0x7e,	
-0x80,0x82,0x84,0x86,0x88,0x8a,0x8c,0x8e,0x90,0x92,0x94,0x96,0x98,0x9a,0x9c,0x9e,
-0xa0,0xa2,0xa4,0xa6,0xa8,0xaa,0xac,0xae,0xb0,0xb2,0xb4,0xb6,0xb8,0xba,0xbc,0xbe,
-0xc0,0xc2,0xc4,0xc6,0xc8,0xca,0xcc,0xce,0xd0,0xd2,0xd4,0xd6,0xd8,0xda,0xdc,0xde,
-0xe0,0xe2,0xe4,0xe6,0xe8,0xea,0xec,0xee,0xf0,0xf2,0xf4,0xf6,0xf8,0xfa,0xfc,0xfe,
-0x1b,0x19,0x1f,0x1d,0x13,0x11,0x17,0x15,0x0b,0x09,0x0f,0x0d,0x03,0x01,0x07,0x05,
-0x3b,0x39,0x3f,0x3d,0x33,0x31,0x37,0x35,0x2b,0x29,0x2f,0x2d,0x23,0x21,0x27,0x25,
-0x5b,0x59,0x5f,0x5d,0x53,0x51,0x57,0x55,0x4b,0x49,0x4f,0x4d,0x43,0x41,0x47,0x45,
-0x7b,0x79,0x7f,0x7d,0x73,0x71,0x77,0x75,0x6b,0x69,0x6f,0x6d,0x63,0x61,0x67,0x65,
-0x9b,0x99,0x9f,0x9d,0x93,0x91,0x97,0x95,0x8b,0x89,0x8f,0x8d,0x83,0x81,0x87,0x85,
-0xbb,0xb9,0xbf,0xbd,0xb3,0xb1,0xb7,0xb5,0xab,0xa9,0xaf,0xad,0xa3,0xa1,0xa7,0xa5,
-0xdb,0xd9,0xdf,0xdd,0xd3,0xd1,0xd7,0xd5,0xcb,0xc9,0xcf,0xcd,0xc3,0xc1,0xc7,0xc5,
-0xfb,0xf9,0xff,0xfd,0xf3,0xf1,0xf7,0xf5,0xeb,0xe9,0xef,0xed,0xe3,0xe1,0xe7,0xe5};
-
-const std::array<uint8_t, 256> AES::GMUL3 = 
-{0x00,0x03,0x06,0x05,0x0c,0x0f,0x0a,0x09,0x18,0x1b,0x1e,0x1d,0x14,0x17,0x12,0x11,
-0x30,0x33,0x36,0x35,0x3c,0x3f,0x3a,0x39,0x28,0x2b,0x2e,0x2d,0x24,0x27,0x22,0x21,
-0x60,0x63,0x66,0x65,0x6c,0x6f,0x6a,0x69,0x78,0x7b,0x7e,0x7d,0x74,0x77,0x72,0x71,
-0x50,0x53,0x56,0x55,0x5c,0x5f,0x5a,0x59,0x48,0x4b,0x4e,0x4d,0x44,0x47,0x42,0x41,
-0xc0,0xc3,0xc6,0xc5,0xcc,0xcf,0xca,0xc9,0xd8,0xdb,0xde,0xdd,0xd4,0xd7,0xd2,0xd1,
-0xf0,0xf3,0xf6,0xf5,0xfc,0xff,0xfa,0xf9,0xe8,0xeb,0xee,0xed,0xe4,0xe7,0xe2,0xe1,
-0xa0,0xa3,0xa6,0xa5,0xac,0xaf,0xaa,0xa9,0xb8,0xbb,0xbe,0xbd,0xb4,0xb7,0xb2,0xb1,
-0x90,0x93,0x96,0x95,0x9c,0x9f,0x9a,0x99,0x88,0x8b,0x8e,0x8d,0x84,0x87,0x82,0x81,	
-0x9b,0x98,0x9d,0x9e,0x97,0x94,0x91,0x92,0x83,0x80,0x85,0x86,0x8f,0x8c,0x89,0x8a,
-0xab,0xa8,0xad,0xae,0xa7,0xa4,0xa1,0xa2,0xb3,0xb0,0xb5,0xb6,0xbf,0xbc,0xb9,0xba,
-0xfb,0xf8,0xfd,0xfe,0xf7,0xf4,0xf1,0xf2,0xe3,0xe0,0xe5,0xe6,0xef,0xec,0xe9,0xea,	
-0xcb,0xc8,0xcd,0xce,0xc7,0xc4,0xc1,0xc2,0xd3,0xd0,0xd5,0xd6,0xdf,0xdc,0xd9,0xda,	
-0x5b,0x58,0x5d,0x5e,0x57,0x54,0x51,0x52,0x43,0x40,0x45,0x46,0x4f,0x4c,0x49,0x4a,
-0x6b,0x68,0x6d,0x6e,0x67,0x64,0x61,0x62,0x73,0x70,0x75,0x76,0x7f,0x7c,0x79,0x7a,	
-0x3b,0x38,0x3d,0x3e,0x37,0x34,0x31,0x32,0x23,0x20,0x25,0x26,0x2f,0x2c,0x29,0x2a,
-0x0b,0x08,0x0d,0x0e,0x07,0x04,0x01,0x02,0x13,0x10,0x15,0x16,0x1f,0x1c,0x19,0x1a};
-
-const std::array<uint8_t, 256> AES::GMUL9 = 
-{0x00,0x09,0x12,0x1b,0x24,0x2d,0x36,0x3f,0x48,0x41,0x5a,0x53,0x6c,0x65,0x7e,0x77,
-0x90,0x99,0x82,0x8b,0xb4,0xbd,0xa6,0xaf,0xd8,0xd1,0xca,0xc3,0xfc,0xf5,0xee,0xe7,
-0x3b,0x32,0x29,0x20,0x1f,0x16,0x0d,0x04,0x73,0x7a,0x61,0x68,0x57,0x5e,0x45,0x4c,
-0xab,0xa2,0xb9,0xb0,0x8f,0x86,0x9d,0x94,0xe3,0xea,0xf1,0xf8,0xc7,0xce,0xd5,0xdc,
-0x76,0x7f,0x64,0x6d,0x52,0x5b,0x40,0x49,0x3e,0x37,0x2c,0x25,0x1a,0x13,0x08,0x01,
-0xe6,0xef,0xf4,0xfd,0xc2,0xcb,0xd0,0xd9,0xae,0xa7,0xbc,0xb5,0x8a,0x83,0x98,0x91,
-0x4d,0x44,0x5f,0x56,0x69,0x60,0x7b,0x72,0x05,0x0c,0x17,0x1e,0x21,0x28,0x33,0x3a,
-0xdd,0xd4,0xcf,0xc6,0xf9,0xf0,0xeb,0xe2,0x95,0x9c,0x87,0x8e,0xb1,0xb8,0xa3,0xaa,	
-0xec,0xe5,0xfe,0xf7,0xc8,0xc1,0xda,0xd3,0xa4,0xad,0xb6,0xbf,0x80,0x89,0x92,0x9b,	
-0x7c,0x75,0x6e,0x67,0x58,0x51,0x4a,0x43,0x34,0x3d,0x26,0x2f,0x10,0x19,0x02,0x0b,
-0xd7,0xde,0xc5,0xcc,0xf3,0xfa,0xe1,0xe8,0x9f,0x96,0x8d,0x84,0xbb,0xb2,0xa9,0xa0,
-0x47,0x4e,0x55,0x5c,0x63,0x6a,0x71,0x78,0x0f,0x06,0x1d,0x14,0x2b,0x22,0x39,0x30,
-0x9a,0x93,0x88,0x81,0xbe,0xb7,0xac,0xa5,0xd2,0xdb,0xc0,0xc9,0xf6,0xff,0xe4,0xed,
-0x0a,0x03,0x18,0x11,0x2e,0x27,0x3c,0x35,0x42,0x4b,0x50,0x59,0x66,0x6f,0x74,0x7d,	
-0xa1,0xa8,0xb3,0xba,0x85,0x8c,0x97,0x9e,0xe9,0xe0,0xfb,0xf2,0xcd,0xc4,0xdf,0xd6,
-0x31,0x38,0x23,0x2a,0x15,0x1c,0x07,0x0e,0x79,0x70,0x6b,0x62,0x5d,0x54,0x4f,0x46};
-
-const std::array<uint8_t, 256> AES::GMUL11 = 
-{0x00,0x0b,0x16,0x1d,0x2c,0x27,0x3a,0x31,0x58,0x53,0x4e,0x45,0x74,0x7f,0x62,0x69,
-0xb0,0xbb,0xa6,0xad,0x9c,0x97,0x8a,0x81,0xe8,0xe3,0xfe,0xf5,0xc4,0xcf,0xd2,0xd9,
-0x7b,0x70,0x6d,0x66,0x57,0x5c,0x41,0x4a,0x23,0x28,0x35,0x3e,0x0f,0x04,0x19,0x12,
-0xcb,0xc0,0xdd,0xd6,0xe7,0xec,0xf1,0xfa,0x93,0x98,0x85,0x8e,0xbf,0xb4,0xa9,0xa2,
-0xf6,0xfd,0xe0,0xeb,0xda,0xd1,0xcc,0xc7,0xae,0xa5,0xb8,0xb3,0x82,0x89,0x94,0x9f,
-0x46,0x4d,0x50,0x5b,0x6a,0x61,0x7c,0x77,0x1e,0x15,0x08,0x03,0x32,0x39,0x24,0x2f,
-0x8d,0x86,0x9b,0x90,0xa1,0xaa,0xb7,0xbc,0xd5,0xde,0xc3,0xc8,0xf9,0xf2,0xef,0xe4,
-0x3d,0x36,0x2b,0x20,0x11,0x1a,0x07,0x0c,0x65,0x6e,0x73,0x78,0x49,0x42,0x5f,0x54,
-0xf7,0xfc,0xe1,0xea,0xdb,0xd0,0xcd,0xc6,0xaf,0xa4,0xb9,0xb2,0x83,0x88,0x95,0x9e,
-0x47,0x4c,0x51,0x5a,0x6b,0x60,0x7d,0x76,0x1f,0x14,0x09,0x02,0x33,0x38,0x25,0x2e,
-0x8c,0x87,0x9a,0x91,0xa0,0xab,0xb6,0xbd,0xd4,0xdf,0xc2,0xc9,0xf8,0xf3,0xee,0xe5,
-0x3c,0x37,0x2a,0x21,0x10,0x1b,0x06,0x0d,0x64,0x6f,0x72,0x79,0x48,0x43,0x5e,0x55,
-0x01,0x0a,0x17,0x1c,0x2d,0x26,0x3b,0x30,0x59,0x52,0x4f,0x44,0x75,0x7e,0x63,0x68,
-0xb1,0xba,0xa7,0xac,0x9d,0x96,0x8b,0x80,0xe9,0xe2,0xff,0xf4,0xc5,0xce,0xd3,0xd8,
-0x7a,0x71,0x6c,0x67,0x56,0x5d,0x40,0x4b,0x22,0x29,0x34,0x3f,0x0e,0x05,0x18,0x13,
-0xca,0xc1,0xdc,0xd7,0xe6,0xed,0xf0,0xfb,0x92,0x99,0x84,0x8f,0xbe,0xb5,0xa8,0xa3};
-
-const std::array<uint8_t, 256> AES::GMUL13 = 
-{0x00,0x0d,0x1a,0x17,0x34,0x39,0x2e,0x23,0x68,0x65,0x72,0x7f,0x5c,0x51,0x46,0x4b,
-0xd0,0xdd,0xca,0xc7,0xe4,0xe9,0xfe,0xf3,0xb8,0xb5,0xa2,0xaf,0x8c,0x81,0x96,0x9b,
-0xbb,0xb6,0xa1,0xac,0x8f,0x82,0x95,0x98,0xd3,0xde,0xc9,0xc4,0xe7,0xea,0xfd,0xf0,
-0x6b,0x66,0x71,0x7c,0x5f,0x52,0x45,0x48,0x03,0x0e,0x19,0x14,0x37,0x3a,0x2d,0x20,
-0x6d,0x60,0x77,0x7a,0x59,0x54,0x43,0x4e,0x05,0x08,0x1f,0x12,0x31,0x3c,0x2b,0x26,
-0xbd,0xb0,0xa7,0xaa,0x89,0x84,0x93,0x9e,0xd5,0xd8,0xcf,0xc2,0xe1,0xec,0xfb,0xf6,
-0xd6,0xdb,0xcc,0xc1,0xe2,0xef,0xf8,0xf5,0xbe,0xb3,0xa4,0xa9,0x8a,0x87,0x90,0x9d,
-0x06,0x0b,0x1c,0x11,0x32,0x3f,0x28,0x25,0x6e,0x63,0x74,0x79,0x5a,0x57,0x40,0x4d,
-0xda,0xd7,0xc0,0xcd,0xee,0xe3,0xf4,0xf9,0xb2,0xbf,0xa8,0xa5,0x86,0x8b,0x9c,0x91,
-0x0a,0x07,0x10,0x1d,0x3e,0x33,0x24,0x29,0x62,0x6f,0x78,0x75,0x56,0x5b,0x4c,0x41,
-0x61,0x6c,0x7b,0x76,0x55,0x58,0x4f,0x42,0x09,0x04,0x13,0x1e,0x3d,0x30,0x27,0x2a,
-0xb1,0xbc,0xab,0xa6,0x85,0x88,0x9f,0x92,0xd9,0xd4,0xc3,0xce,0xed,0xe0,0xf7,0xfa,
-0xb7,0xba,0xad,0xa0,0x83,0x8e,0x99,0x94,0xdf,0xd2,0xc5,0xc8,0xeb,0xe6,0xf1,0xfc,
-0x67,0x6a,0x7d,0x70,0x53,0x5e,0x49,0x44,0x0f,0x02,0x15,0x18,0x3b,0x36,0x21,0x2c,
-0x0c,0x01,0x16,0x1b,0x38,0x35,0x22,0x2f,0x64,0x69,0x7e,0x73,0x50,0x5d,0x4a,0x47,
-0xdc,0xd1,0xc6,0xcb,0xe8,0xe5,0xf2,0xff,0xb4,0xb9,0xae,0xa3,0x80,0x8d,0x9a,0x97};
-
-const std::array<uint8_t, 256> AES::GMUL14 =
-{0x00,0x0e,0x1c,0x12,0x38,0x36,0x24,0x2a,0x70,0x7e,0x6c,0x62,0x48,0x46,0x54,0x5a,
-0xe0,0xee,0xfc,0xf2,0xd8,0xd6,0xc4,0xca,0x90,0x9e,0x8c,0x82,0xa8,0xa6,0xb4,0xba,
-0xdb,0xd5,0xc7,0xc9,0xe3,0xed,0xff,0xf1,0xab,0xa5,0xb7,0xb9,0x93,0x9d,0x8f,0x81,
-0x3b,0x35,0x27,0x29,0x03,0x0d,0x1f,0x11,0x4b,0x45,0x57,0x59,0x73,0x7d,0x6f,0x61,
-0xad,0xa3,0xb1,0xbf,0x95,0x9b,0x89,0x87,0xdd,0xd3,0xc1,0xcf,0xe5,0xeb,0xf9,0xf7,
-0x4d,0x43,0x51,0x5f,0x75,0x7b,0x69,0x67,0x3d,0x33,0x21,0x2f,0x05,0x0b,0x19,0x17,
-0x76,0x78,0x6a,0x64,0x4e,0x40,0x52,0x5c,0x06,0x08,0x1a,0x14,0x3e,0x30,0x22,0x2c,
-0x96,0x98,0x8a,0x84,0xae,0xa0,0xb2,0xbc,0xe6,0xe8,0xfa,0xf4,0xde,0xd0,0xc2,0xcc,
-0x41,0x4f,0x5d,0x53,0x79,0x77,0x65,0x6b,0x31,0x3f,0x2d,0x23,0x09,0x07,0x15,0x1b,
-0xa1,0xaf,0xbd,0xb3,0x99,0x97,0x85,0x8b,0xd1,0xdf,0xcd,0xc3,0xe9,0xe7,0xf5,0xfb,
-0x9a,0x94,0x86,0x88,0xa2,0xac,0xbe,0xb0,0xea,0xe4,0xf6,0xf8,0xd2,0xdc,0xce,0xc0,
-0x7a,0x74,0x66,0x68,0x42,0x4c,0x5e,0x50,0x0a,0x04,0x16,0x18,0x32,0x3c,0x2e,0x20,
-0xec,0xe2,0xf0,0xfe,0xd4,0xda,0xc8,0xc6,0x9c,0x92,0x80,0x8e,0xa4,0xaa,0xb8,0xb6,
-0x0c,0x02,0x10,0x1e,0x34,0x3a,0x28,0x26,0x7c,0x72,0x60,0x6e,0x44,0x4a,0x58,0x56,
-0x37,0x39,0x2b,0x25,0x0f,0x01,0x13,0x1d,0x47,0x49,0x5b,0x55,0x7f,0x71,0x63,0x6d,
-0xd7,0xd9,0xcb,0xc5,0xef,0xe1,0xf3,0xfd,0xa7,0xa9,0xbb,0xb5,0x9f,0x91,0x83,0x8d};
-
-const std::array<uint8_t, 10> AES::RC = 
-{0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+#include <filesystem>
+
+// Loads 4 bytes as a big-endian word, so byte 0 of a column lands in the high byte.
+static inline uint32_t loadWord(const uint8_t* p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8)  |  static_cast<uint32_t>(p[3]);
+}
+
+static inline void storeWord(uint8_t* p, uint32_t w)
+{
+    p[0] = static_cast<uint8_t>(w >> 24);
+    p[1] = static_cast<uint8_t>(w >> 16);
+    p[2] = static_cast<uint8_t>(w >> 8);
+    p[3] = static_cast<uint8_t>(w);
+}
+
+// Builds one output column of a final round: row r comes from column c_r, substituted through box.
+static inline uint32_t subWordShifted(const std::array<uint8_t, 256>& box,
+                                      uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3)
+{
+    return (static_cast<uint32_t>(box[c0 >> 24]) << 24) |
+           (static_cast<uint32_t>(box[(c1 >> 16) & 0xff]) << 16) |
+           (static_cast<uint32_t>(box[(c2 >> 8) & 0xff]) << 8) |
+            static_cast<uint32_t>(box[c3 & 0xff]);
+}
 
 AES::AES(const std::vector<uint8_t>& key)
+    : m_backend(detectBackend())
 {
     if (!keyExpansion(key))
     {
@@ -160,17 +42,158 @@ AES::AES(const std::vector<uint8_t>& key)
     }
 }
 
+AES::AES(const std::vector<uint8_t>& key, Backend backend)
+    : m_backend(backend)
+{
+    if (!backendSupported(backend))
+    {
+        throw std::invalid_argument(std::string("Error: This CPU doesn't support the ") + backendName(backend) + " backend.");
+    }
+    if (!keyExpansion(key))
+    {
+        throw std::invalid_argument("Error: The key is invalid. Key must be 128, 192, or 256 bits.");
+    }
+}
+
+AES::AES(std::shared_ptr<const KeySchedule> keySchedule)
+    : m_sharedSchedule(std::move(keySchedule))
+{
+    if (!m_sharedSchedule)
+    {
+        throw std::invalid_argument("Error: The key schedule is missing.");
+    }
+    m_backend = m_sharedSchedule->backend();
+    m_keys = m_sharedSchedule.get();
+}
+
+std::shared_ptr<const AES::KeySchedule> AES::expandKey(const std::vector<uint8_t>& key)
+{
+    return expandKey(key, detectBackend());
+}
+
+std::shared_ptr<const AES::KeySchedule> AES::expandKey(const std::vector<uint8_t>& key, Backend backend)
+{
+    if (!backendSupported(backend))
+    {
+        throw std::invalid_argument(std::string("Error: This CPU doesn't support the ") + backendName(backend) + " backend.");
+    }
+    // KeySchedule's constructor is private, which rules out make_shared
+    std::shared_ptr<KeySchedule> schedule(new KeySchedule(backend));
+    if (!schedule->expand(key))
+    {
+        throw std::invalid_argument("Error: The key is invalid. Key must be 128, 192, or 256 bits.");
+    }
+    return schedule;
+}
+
+bool AES::keyExpansion(const std::vector<uint8_t>& key)
+{
+    Backend previousBackend = m_ownSchedule.m_backend;
+    m_ownSchedule.m_backend = m_backend;
+    if (!m_ownSchedule.expand(key))
+    {
+        m_ownSchedule.m_backend = previousBackend;
+        return false;
+    }
+    m_sharedSchedule.reset();
+    m_keys = &m_ownSchedule;
+    return true;
+}
+
+AES::Backend AES::detectBackend()
+{
+    if (cpuSupportsVAES512())
+    {
+        return Backend::VAES512;
+    }
+    if (cpuSupportsVAES256())
+    {
+        return Backend::VAES256;
+    }
+    if (cpuSupportsAESNI())
+    {
+        return Backend::AESNI;
+    }
+    return Backend::Portable;
+}
+
+bool AES::backendSupported(Backend backend)
+{
+    switch (backend)
+    {
+        case Backend::Portable:
+        case Backend::Bitsliced:
+            return true;
+        case Backend::AESNI:
+            return cpuSupportsAESNI();
+        case Backend::VAES256:
+            return cpuSupportsVAES256();
+        case Backend::VAES512:
+            return cpuSupportsVAES512();
+    }
+    return false;
+}
+
+void AES::setChunkSize(size_t chunkSize)
+{
+    if (chunkSize == 0 || chunkSize % 16 != 0)
+    {
+        throw std::invalid_argument("Error: The chunk size must be a positive multiple of 16 bytes.");
+    }
+    m_chunkSize = chunkSize;
+}
+
+const char* AES::backendName(Backend backend)
+{
+    switch (backend)
+    {
+        case Backend::Portable:
+            return "portable (T-table)";
+        case Backend::AESNI:
+            return "AES-NI";
+        case Backend::VAES256:
+            return "VAES (AVX2, 2 blocks per instruction)";
+        case Backend::VAES512:
+            return "VAES (AVX-512, 4 blocks per instruction)";
+        case Backend::Bitsliced:
+            return "bitsliced (constant-time)";
+    }
+    return "unknown";
+}
+
 void AES::cleanup()
+{
+    m_tweakCipher.reset();
+    m_ownSchedule.clear();
+    m_sharedSchedule.reset();
+    m_keys = &m_ownSchedule;
+}
+
+void AES::KeySchedule::clear()
 {
     for (auto& roundKey : m_roundKeys)
     {
         std::fill(roundKey.begin(), roundKey.end(), 0);
     }
-    std::fill(m_state.begin(), m_state.end(), 0);
+    std::fill(m_encKeyWords.begin(), m_encKeyWords.end(), 0);
+    std::fill(m_decKeyWords.begin(), m_decKeyWords.end(), 0);
+    for (auto& roundKey : m_invRoundKeys)
+    {
+        std::fill(roundKey.begin(), roundKey.end(), 0);
+    }
+    std::fill(m_bitslicedKeys.begin(), m_bitslicedKeys.end(), 0);
+    m_rounds = 0;
 }
 
-void AES::encrypt(std::istream& plaintext, std::ostream& ciphertext, Mode mode)
+void AES::encrypt(std::istream& plaintext, std::ostream& ciphertext, Mode mode) const
 {
+    // XTS ciphertext has no header, so its sectors line up with the plaintext's
+    if (mode == Mode::XTS)
+    {
+        encryptSectors(plaintext, ciphertext);
+        return;
+    }
+
     // Write header
     ciphertext.put(static_cast<char>(mode));
 
@@ -178,66 +201,72 @@ void AES::encrypt(std::istream& plaintext, std::ostream& ciphertext, Mode mode)
     std::array<uint8_t, 16> cbcVector;
     if (mode == Mode::CBC)
     {
-        std::random_device rd;
-        std::uniform_int_distribution<int> dist(0, 255);
-        for (int i = 0; i < 16; i++) cbcVector[i] = static_cast<uint8_t>(dist(rd));
+        randomIV(cbcVector);
         ciphertext.write(reinterpret_cast<char*>(cbcVector.data()), 16);
     }
 
-    // Iterate over the plaintext, encrypting each 16-byte block
-    // and writing them to ciphertext.
+    // CTR mode just needs a random initial counter block in the header. No padding is needed,
+    // and every block can be encrypted independently.
+    if (mode == Mode::CTR)
+    {
+        std::array<uint8_t, 16> counter;
+        randomIV(counter);
+        ciphertext.write(reinterpret_cast<char*>(counter.data()), 16);
+        cryptCTRStream(plaintext, ciphertext, counter);
+        return;
+    }
+
+    // GCM writes its own nonce and tag around the ciphertext
+    if (mode == Mode::GCM)
+    {
+        encryptGCMStream(plaintext, ciphertext);
+        return;
+    }
+
+    // Chunked mode seals one chunk at a time, each with its own tag
+    if (mode == Mode::Chunked)
+    {
+        encryptChunkedStream(plaintext, ciphertext);
+        return;
+    }
+
+    // Iterate over the plaintext a chunk at a time, encrypting it in place
+    // and writing it to ciphertext.
+    std::vector<uint8_t> buffer(m_chunkSize);
     bool doneLooping = false;
     do
     {
-        plaintext.read(reinterpret_cast<char*>(m_state.data()), 16);
+        plaintext.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t numBytes = plaintext.gcount();
         if (plaintext.eof())
         {
-            // We just read the final block of plaintext. Now we need to
+            // We just read the final chunk of plaintext. Now we need to
             // figure out how to pad the final block.
-            uint8_t padBytes = 16 - plaintext.gcount();
-            for (int i = plaintext.gcount(); i < 16; i++)
+            uint8_t padBytes = 16 - numBytes % 16;
+            for (int i = 0; i < padBytes; i++)
             {
-                m_state[i] = padBytes;
+                buffer[numBytes + i] = padBytes;
             }
+            numBytes += padBytes;
             doneLooping = true;
         }
+        size_t numBlocks = numBytes / 16;
 
-        // Add the previous block of ciphertext (or, for the first round, the IV,
-        // if we're doing CBC mode.
         if (mode == Mode::CBC)
         {
-            for (int i = 0; i < 16; i++) m_state[i] ^= cbcVector[i];
+            encryptBlocksCBC(buffer.data(), buffer.data(), numBlocks, cbcVector);
         }
-
-        // Initial round key addition
-        addRoundKey(0);
-
-        // Iterate over the rounds...
-        int numRounds = m_roundKeys.size() - 1;
-        for (int i = 1; i < numRounds; i++)
+        else
         {
-            subBytes();
-            shiftRows();
-            mixColumns();
-            addRoundKey(i);
+            encryptBlocks(buffer.data(), buffer.data(), numBlocks);
         }
-        // Final round: don't do the MixColumns step
-        subBytes();
-        shiftRows();
-        addRoundKey(numRounds);
-
-        ciphertext.write(reinterpret_cast<char*>(m_state.data()), 16);
 
-        // If we're doing CBC mode, keep this ciphertext block for the next block
-        if (mode == Mode::CBC)
-        {
-            for (int i = 0; i < 16; i++) cbcVector[i] = m_state[i];
-        }
+        ciphertext.write(reinterpret_cast<char*>(buffer.data()), numBytes);
     }
     while (!doneLooping);
 }
 
-void AES::decrypt(std::istream& ciphertext, std::ostream& plaintext, bool useHeader, bool usePadding)
+void AES::decrypt(std::istream& ciphertext, std::ostream& plaintext, bool useHeader, bool usePadding) const
 {
     // Get the header
     std::array<uint8_t, 16> cbcVector;
@@ -254,256 +283,864 @@ void AES::decrypt(std::istream& ciphertext, std::ostream& plaintext, bool useHea
                 mode = Mode::CBC;
                 ciphertext.read(reinterpret_cast<char*>(cbcVector.data()), 16);
                 break;
+            case static_cast<int>(Mode::CTR):
+            {
+                // CTR decryption is the same as encryption
+                std::array<uint8_t, 16> counter;
+                ciphertext.read(reinterpret_cast<char*>(counter.data()), 16);
+                if (ciphertext.gcount() != 16)
+                {
+                    throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
+                }
+                cryptCTRStream(ciphertext, plaintext, counter);
+                return;
+            }
+            case static_cast<int>(Mode::GCM):
+                decryptGCMStream(ciphertext, plaintext);
+                return;
+            case static_cast<int>(Mode::Chunked):
+                decryptChunkedStream(ciphertext, plaintext);
+                return;
             default:
                 throw std::invalid_argument("Error: Decryption failed. Unrecognized header of ciphertext.");
 
         }
     }
 
-    // Iterate over the ciphertext, decrypting each 16-byte block
-    // and writing them to plaintext.
+    // Iterate over the ciphertext in large chunks, decrypting each one on all of the
+    // shared ThreadPool's threads, and writing them to plaintext.
+    std::vector<uint8_t> buffer(m_chunkSize);
     for (;;)
     {
-        ciphertext.read(reinterpret_cast<char*>(m_state.data()), 16);
-        std::array<uint8_t, 16> currCiphertext = m_state;
-        if (ciphertext.eof())
+        ciphertext.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t numBytes = ciphertext.gcount();
+
+        // We should always have an integer number of blocks when decrypting,
+        // because we pad the input to have an integer number of blocks.
+        if (numBytes % 16 != 0)
+        {
+            // The ciphertext was malformed!
+            // This could be a problem with the ciphertext. Or it could be a bad key.
+            throw std::invalid_argument("Error: Decryption failed.");
+        }
+        if (numBytes == 0)
         {
-            // We should always have an integer number of blocks when decrypting,
-            // because we pad the input to have an integer number of blocks.
-            if (ciphertext.gcount() != 0)
-            {
-                // The ciphertext was malformed!
-                // This could be a problem with the ciphertext. Or it could be a bad key.
-                throw std::invalid_argument("Error: Decryption failed.");
-            }
             break;
         }
+        bool lastBatch = ciphertext.eof() || ciphertext.peek() == EOF;
 
-        int numRounds = m_roundKeys.size() - 1;
+        decryptBlocksParallel(buffer.data(), buffer.data(), numBytes / 16, mode, cbcVector);
 
-        // Initial round. Don't do the inverse MixColumns step
-        addRoundKey(numRounds);
-        invShiftRows();
-        invSubBytes();
+        // Before writing this to plaintext, check to see if this chunk had the last block.
+        if (usePadding && lastBatch)
+        {
+            // The last block is in this chunk! Verify and strip the padding
+            numBytes -= paddingLength(buffer.data() + numBytes - 16);
+        }
+        plaintext.write(reinterpret_cast<char*>(buffer.data()), numBytes);
 
-        // The rest of the rounds...
-        for (int i = numRounds-1; i > 0; i--)
+        if (lastBatch)
         {
-            addRoundKey(i);
-            invMixColumns();
-            invShiftRows();
-            invSubBytes();
+            break;
         }
+    }
+}
 
-        // Final round key addition
-        addRoundKey(0);
+uint64_t AES::encryptedSize(uint64_t plaintextSize, Mode mode, size_t chunkSize)
+{
+    switch (mode)
+    {
+        case Mode::ECB:
+            return 1 + (plaintextSize / 16 + 1) * 16;
+        case Mode::CBC:
+            return 1 + 16 + (plaintextSize / 16 + 1) * 16;
+        case Mode::CTR:
+            return 1 + 16 + plaintextSize;
+        case Mode::GCM:
+            return 1 + 12 + plaintextSize + 16;
+        case Mode::Chunked:
+            // A tag for every chunk, and there's always at least one
+            return CHUNKED_HEADER_SIZE + plaintextSize +
+                   16 * std::max<uint64_t>(1, (plaintextSize + chunkSize - 1) / chunkSize);
+        case Mode::XTS:
+            return plaintextSize;
+    }
+    return 0;
+}
 
-        if (mode == Mode::CBC)
-        {
-            for (int i = 0; i < 16; i++)
+size_t AES::decryptedSizeBound(std::span<const uint8_t> ciphertext)
+{
+    // Everything after the header, less GCM's tag. ECB and CBC plaintext is decrypted along
+    // with its padding, which is only stripped from the size afterwards.
+    if (ciphertext.empty())
+    {
+        return 0;
+    }
+    size_t overhead = 1;
+    switch (ciphertext[0])
+    {
+        case static_cast<uint8_t>(Mode::CBC):
+        case static_cast<uint8_t>(Mode::CTR):
+            overhead += 16;
+            break;
+        case static_cast<uint8_t>(Mode::GCM):
+            overhead += 12 + 16;
+            break;
+        case static_cast<uint8_t>(Mode::Chunked):
+            // Every chunk has a tag, so the header says how many there are. Ciphertext that
+            // doesn't fit its header is rejected by decrypt, so it needs no space.
+            try
             {
-                m_state[i] ^= cbcVector[i];
-                cbcVector[i] = currCiphertext[i];
+                return static_cast<size_t>(chunkLayout(ciphertext).plaintextSize);
             }
-        }
+            catch (const std::invalid_argument&)
+            {
+                return 0;
+            }
+    }
+    return ciphertext.size() > overhead ? ciphertext.size() - overhead : 0;
+}
+
+size_t AES::encrypt(std::span<const uint8_t> plaintext, std::span<uint8_t> ciphertext, Mode mode) const
+{
+    uint64_t outSize = encryptedSize(plaintext.size(), mode, m_chunkSize);
+    if (ciphertext.size() < outSize)
+    {
+        throw std::invalid_argument("Error: The ciphertext buffer is too small.");
+    }
+    const uint8_t* in = plaintext.data();
+    size_t inSize = plaintext.size();
+    uint8_t* out = ciphertext.data();
+
+    // Chunked mode writes its own header, which has more than the mode in it, and XTS has none
+    if (mode == Mode::Chunked)
+    {
+        encryptChunkedBuffer(in, inSize, out);
+        return outSize;
+    }
+    if (mode == Mode::XTS)
+    {
+        encryptSectors(plaintext, ciphertext.first(inSize), 0);
+        return outSize;
+    }
+
+    *out++ = static_cast<uint8_t>(mode);
+    if (mode == Mode::CTR)
+    {
+        std::array<uint8_t, 16> counter;
+        randomIV(counter);
+        std::copy(counter.begin(), counter.end(), out);
+        cryptCTRParallel(in, out + 16, inSize, counter);
+        return outSize;
+    }
+    if (mode == Mode::GCM)
+    {
+        encryptGCMBuffer(in, inSize, out);
+        return outSize;
+    }
 
-        // Now m_state contains the plain text of this block.
-        // Before writing this to plaintext, check to see if this was the last block.
-        int numBytesToWrite = 16;
-        if (usePadding && ciphertext.peek() == EOF)
+    std::array<uint8_t, 16> cbcVector;
+    if (mode == Mode::CBC)
+    {
+        randomIV(cbcVector);
+        std::copy(cbcVector.begin(), cbcVector.end(), out);
+        out += 16;
+    }
+
+    // Every whole block of plaintext, then a final block with what's left over and the padding
+    size_t numBlocks = inSize / 16;
+    std::array<uint8_t, 16> lastBlock;
+    size_t leftover = inSize % 16;
+    std::copy(in + 16 * numBlocks, in + inSize, lastBlock.begin());
+    std::fill(lastBlock.begin() + leftover, lastBlock.end(), static_cast<uint8_t>(16 - leftover));
+
+    if (mode == Mode::CBC)
+    {
+        encryptBlocksCBC(in, out, numBlocks, cbcVector);
+        encryptBlocksCBC(lastBlock.data(), out + 16 * numBlocks, 1, cbcVector);
+    }
+    else
+    {
+        // ECB blocks don't depend on each other, so a large input is split over the pool, like
+        // ECB decryption
+        forEachChunkRange(numBlocks, 16, [&](uint64_t first, uint64_t count)
         {
-            // This was the last block! Verify and strip the padding
-            int padding = m_state[15];
-            for (int i = 16-padding; i < 15; i++)
+            encryptBlocks(in + 16 * first, out + 16 * first, static_cast<size_t>(count));
+        });
+        encryptBlock(lastBlock.data(), out + 16 * numBlocks);
+    }
+    return outSize;
+}
+
+size_t AES::decrypt(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext) const
+{
+    if (plaintext.size() < decryptedSizeBound(ciphertext))
+    {
+        throw std::invalid_argument("Error: The plaintext buffer is too small.");
+    }
+    const uint8_t* in = ciphertext.data();
+    size_t inSize = ciphertext.size();
+    uint8_t* out = plaintext.data();
+
+    int modeVal = inSize > 0 ? in[0] : EOF;
+    size_t headerSize = 1;
+    std::array<uint8_t, 16> vector;
+    switch (modeVal)
+    {
+        case static_cast<int>(Mode::ECB):
+            break;
+        case static_cast<int>(Mode::CBC):
+        case static_cast<int>(Mode::CTR):
+            headerSize += 16;
+            if (inSize < headerSize)
             {
-                if (m_state[i] != padding)
-                {
-                    // Problem! We expected 'padding' number of padding bytes, but found fewer.
-                    // The ciphertext was malformed!
-                    // This could be a problem with the ciphertext. Or it could be a bad key.
-                    throw std::invalid_argument("Error: Decryption failed.");
-                }
+                throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
             }
-            numBytesToWrite = 16 - padding;
+            std::copy(in + 1, in + headerSize, vector.begin());
+            break;
+        case static_cast<int>(Mode::GCM):
+            return decryptGCMBuffer(in + 1, inSize - 1, out);
+        case static_cast<int>(Mode::Chunked):
+            return decryptChunkedBuffer(ciphertext, plaintext);
+        default:
+            throw std::invalid_argument("Error: Decryption failed. Unrecognized header of ciphertext.");
+    }
+    in += headerSize;
+    size_t numBytes = inSize - headerSize;
+
+    if (modeVal == static_cast<int>(Mode::CTR))
+    {
+        cryptCTRParallel(in, out, numBytes, vector);
+        return numBytes;
+    }
+    if (numBytes % 16 != 0)
+    {
+        throw std::invalid_argument("Error: Decryption failed.");
+    }
+    if (numBytes == 0)
+    {
+        return 0;
+    }
+    decryptBlocksParallel(in, out, numBytes / 16, static_cast<Mode>(modeVal), vector);
+    return numBytes - paddingLength(out + numBytes - 16);
+}
+
+bool AES::encryptFile(const std::string& inputPath, const std::string& outputPath, Mode mode) const
+{
+    std::error_code error;
+    if (!MappedFile::isMappable(inputPath) ||
+        (std::filesystem::exists(outputPath, error) && !MappedFile::isMappable(outputPath)))
+    {
+        return false;
+    }
+    // Encrypt straight from one mapping into the other, which is created at its final size
+    MappedFile input(inputPath);
+    MappedFile output(outputPath, encryptedSize(input.size(), mode, m_chunkSize));
+    encrypt(std::span<const uint8_t>(input.data(), input.size()), std::span<uint8_t>(output.data(), output.size()), mode);
+    return true;
+}
+
+bool AES::decryptFile(const std::string& inputPath, const std::string& outputPath) const
+{
+    std::error_code error;
+    if (!MappedFile::isMappable(inputPath) ||
+        (std::filesystem::exists(outputPath, error) && !MappedFile::isMappable(outputPath)))
+    {
+        return false;
+    }
+    // How big the plaintext is depends on the padding, which isn't known until the last block
+    // is decrypted, so map enough for it with padding and then trim the file
+    MappedFile input(inputPath);
+    std::span<const uint8_t> ciphertext(input.data(), input.size());
+    MappedFile output(outputPath, decryptedSizeBound(ciphertext));
+    size_t plaintextSize = decrypt(ciphertext, std::span<uint8_t>(output.data(), output.size()));
+    output.shrink(plaintextSize);
+    return true;
+}
+
+void AES::decryptBlocksParallel(const uint8_t* in, uint8_t* out, size_t numBlocks, Mode mode,
+                                std::array<uint8_t, 16>& cbcVector) const
+{
+    // Small inputs aren't worth handing off, and stay free of allocations
+    if (16 * numBlocks <= MIN_TASK_SIZE)
+    {
+        if (mode == Mode::CBC)
+        {
+            decryptBlocksCBC(in, out, numBlocks, cbcVector);
+        }
+        else
+        {
+            decryptBlocks(in, out, numBlocks);
+        }
+        return;
+    }
+    // Give each thread a contiguous range of whole blocks. Unlike CBC encryption, CBC
+    // decryption of a block only needs the ciphertext block before it, so each range is
+    // seeded with the last ciphertext block of the range before it. Those are copied out
+    // first, since in place, every range is being decrypted at the same time.
+    ThreadPool& pool = ThreadPool::shared();
+    size_t numTasks = std::min<size_t>(pool.size(), (16 * numBlocks + MIN_TASK_SIZE - 1) / MIN_TASK_SIZE);
+    size_t blocksPerTask = (numBlocks + numTasks - 1) / numTasks;
+    std::vector<std::array<uint8_t, 16>> taskVectors;
+    if (mode == Mode::CBC)
+    {
+        taskVectors.resize(numTasks);
+        taskVectors[0] = cbcVector;
+        for (size_t task = 1; task < numTasks && task * blocksPerTask < numBlocks; task++)
+        {
+            const uint8_t* previous = in + 16 * (task * blocksPerTask - 1);
+            std::copy(previous, previous + 16, taskVectors[task].begin());
         }
-        plaintext.write(reinterpret_cast<char*>(m_state.data()), numBytesToWrite);
+        std::copy(in + 16 * (numBlocks - 1), in + 16 * numBlocks, cbcVector.begin());
     }
+    pool.parallelFor(numTasks, [&](size_t task)
+    {
+        size_t start = task * blocksPerTask;
+        if (start >= numBlocks) return;
+        size_t count = std::min(numBlocks - start, blocksPerTask);
+        if (mode == Mode::CBC)
+        {
+            decryptBlocksCBC(in + 16 * start, out + 16 * start, count, taskVectors[task]);
+        }
+        else
+        {
+            decryptBlocks(in + 16 * start, out + 16 * start, count);
+        }
+    });
 }
 
-bool AES::keyExpansion(const std::vector<uint8_t>& key)
+size_t AES::paddingLength(const uint8_t* lastBlock)
 {
-    // Holds all of the bytes of the round keys in a single vector.
-    // Helpful, because the size of the key and the size of the round keys
-    // are different for AES-192 and AES-256. This vector will be divided
-    // into sets of 16 bytes as it's put into m_roundKeys.
-    std::vector<uint8_t> roundKeysInt;
+    int padding = lastBlock[15];
+    if (padding == 0 || padding > 16)
+    {
+        throw std::invalid_argument("Error: Decryption failed.");
+    }
+    for (int i = 16-padding; i < 15; i++)
+    {
+        if (lastBlock[i] != padding)
+        {
+            // Problem! We expected 'padding' number of padding bytes, but found fewer.
+            // The ciphertext was malformed!
+            // This could be a problem with the ciphertext. Or it could be a bad key.
+            throw std::invalid_argument("Error: Decryption failed.");
+        }
+    }
+    return padding;
+}
+
+void AES::randomIV(std::array<uint8_t, 16>& iv)
+{
+    RandomGenerator::threadLocal().generate(iv.data(), iv.size());
+}
 
-    switch (key.size())
+void AES::addToCounter(std::array<uint8_t, 16>& counter, uint64_t blocks)
+{
+    // Add from the least significant (last) byte up, carrying into the more significant bytes
+    uint64_t carry = blocks;
+    for (int i = 15; i >= 0 && carry != 0; i--)
     {
-        case 16:
-            m_roundKeys.resize(11);
-            roundKeysInt.resize(176);
-            break;
-        case 24:
-            m_roundKeys.resize(13);
-            roundKeysInt.resize(216); // 216 instead of 208 in order not to run over the end
+        carry += counter[i];
+        counter[i] = static_cast<uint8_t>(carry);
+        carry >>= 8;
+    }
+}
+
+void AES::cryptCTR(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16> counter) const
+{
+    // Build a batch of counter blocks and encrypt them all at once, so the multi-block kernels
+    // can keep several in flight. Then XOR the keystream into the data.
+    std::array<uint8_t, 16 * 64> keystream;
+    while (numBytes > 0)
+    {
+        size_t batchBytes = std::min(numBytes, keystream.size());
+        size_t batchBlocks = (batchBytes + 15) / 16;
+        for (size_t b = 0; b < batchBlocks; b++)
+        {
+            std::copy(counter.begin(), counter.end(), keystream.begin() + 16*b);
+            addToCounter(counter, 1);
+        }
+        encryptBlocks(keystream.data(), keystream.data(), batchBlocks);
+        for (size_t i = 0; i < batchBytes; i++)
+        {
+            out[i] = in[i] ^ keystream[i];
+        }
+        in += batchBytes;
+        out += batchBytes;
+        numBytes -= batchBytes;
+    }
+    std::fill(keystream.begin(), keystream.end(), 0);
+}
+
+void AES::cryptCTRParallel(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16> counter) const
+{
+    // Small inputs aren't worth handing off, and stay free of allocations
+    if (numBytes <= MIN_TASK_SIZE)
+    {
+        cryptCTR(in, out, numBytes, counter);
+        return;
+    }
+    // Give each thread a contiguous range of whole blocks, with the counter for its first block
+    ThreadPool& pool = ThreadPool::shared();
+    size_t numBlocks = (numBytes + 15) / 16;
+    size_t numTasks = std::min<size_t>(pool.size(), (numBytes + MIN_TASK_SIZE - 1) / MIN_TASK_SIZE);
+    size_t blocksPerTask = (numBlocks + numTasks - 1) / numTasks;
+    pool.parallelFor(numTasks, [&](size_t task)
+    {
+        size_t start = 16 * task * blocksPerTask;
+        if (start >= numBytes) return;
+        size_t length = std::min(numBytes - start, 16 * blocksPerTask);
+        std::array<uint8_t, 16> taskCounter = counter;
+        addToCounter(taskCounter, task * blocksPerTask);
+        cryptCTR(in + start, out + start, length, taskCounter);
+    });
+}
+
+void AES::cryptCTRStream(std::istream& in, std::ostream& out, std::array<uint8_t, 16> counter) const
+{
+    std::vector<uint8_t> buffer(m_chunkSize);
+    for (;;)
+    {
+        in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t numBytes = in.gcount();
+        if (numBytes == 0)
+        {
             break;
-        case 32:
-            m_roundKeys.resize(15);
-            roundKeysInt.resize(256);
+        }
+
+        cryptCTRParallel(buffer.data(), buffer.data(), numBytes, counter);
+        addToCounter(counter, (numBytes + 15) / 16);
+
+        out.write(reinterpret_cast<char*>(buffer.data()), numBytes);
+        if (numBytes < buffer.size())
+        {
             break;
-        default:
-            // AES key must be 128, 192, or 256 bits
-            return false;
-    }
-
-    // The first bytes of the round key are equal to the AES key
-    std::copy(key.begin(), key.end(), roundKeysInt.begin());
-
-    // Derive the rest of the bytes from the first key.size() bytes
-    int rcon = 0;
-    for (int i = key.size(); i < roundKeysInt.size(); i += key.size())
-    {
-        // Derive first 4 bytes of next set of key.size() bytes
-        std::array<uint8_t, 4> g;
-        // g = four previous bytes
-        g[0] = roundKeysInt[i-4];
-        g[1] = roundKeysInt[i-3];
-        g[2] = roundKeysInt[i-2];
-        g[3] = roundKeysInt[i-1];
-        // 1-byte left circular rotation
-        uint8_t g0 = g[0];
-        for (int j = 0; j < 3; j++) g[j] = g[j+1];
-        g[3] = g0;
-        // SubBytes on each byte of g
-        for (int j = 0; j < 4; j++) g[j] = SBOX[g[j]];
-        // XOR g with the round constant
-        g[0] ^= RC[rcon];
-        rcon++;
-        // Use g to get first 4 bytes
-        for (int j = 0; j < 4; j++) roundKeysInt[i+j] = roundKeysInt[i+j-key.size()] ^ g[j];
-
-        // For the rest of the bytes, XOR the corresponding byte of the previous chunk
-        // with the corresponding byte of the previous column of this chunk
-        for (int j = 4; j < key.size(); j++)
+        }
+    }
+}
+
+template <int Rounds, typename SubByte>
+void AES::KeySchedule::expandWords(uint8_t* words, SubByte subByte)
+{
+    // Each word after the key is the word KeyWords back XORed with the previous word, which is
+    // first rotated, substituted, and XORed with the round constant at the start of each key-sized
+    // chunk. AES-256 also substitutes the previous word halfway through each chunk. The key size
+    // is a constant, so that step compiles away for AES-128 and AES-192.
+    constexpr int KeyWords = Rounds - 6;
+    constexpr int TotalWords = 4 * (Rounds + 1);
+    for (int i = KeyWords; i < TotalWords; i++)
+    {
+        const uint8_t* prev = words + 4 * (i - 1);
+        std::array<uint8_t, 4> t = {prev[0], prev[1], prev[2], prev[3]};
+        if (i % KeyWords == 0)
         {
-            if (key.size() == 32 && j >= 16 && j <= 19)
+            t = {static_cast<uint8_t>(subByte(prev[1]) ^ RC[i / KeyWords - 1]),
+                 subByte(prev[2]), subByte(prev[3]), subByte(prev[0])};
+        }
+        else if constexpr (KeyWords == 8)
+        {
+            if (i % KeyWords == 4)
             {
-                roundKeysInt[i+j] = roundKeysInt[i+j-key.size()] ^ SBOX[roundKeysInt[i+j-4]];
+                for (uint8_t& b : t) b = subByte(b);
             }
-            else
+        }
+        for (int j = 0; j < 4; j++) words[4*i + j] = words[4*(i - KeyWords) + j] ^ t[j];
+    }
+}
+
+bool AES::KeySchedule::expand(const std::vector<uint8_t>& key)
+{
+    // AES key must be 128, 192, or 256 bits
+    if (key.size() != 16 && key.size() != 24 && key.size() != 32)
+    {
+        return false;
+    }
+    m_rounds = static_cast<int>(key.size()) / 4 + 6;
+
+    if (usesAESNIRoundKeys(m_backend))
+    {
+        expandAESNI(key);
+        return true;
+    }
+
+    // The round keys are expanded in place, as one run of 4-byte words. The first words are
+    // the AES key itself.
+    uint8_t* words = m_roundKeys[0].data();
+    static_assert(sizeof(m_roundKeys) == 16 * (MAX_ROUNDS + 1), "Round keys must be contiguous");
+    std::copy(key.begin(), key.end(), words);
+
+    // The bitsliced backend is meant to be constant-time, so it can't use SBOX for SubWord either.
+    // The S-box is picked here, once, and each one gets its own copy of the recurrence.
+    if (m_backend == Backend::Bitsliced)
+    {
+        AES_DISPATCH_ROUNDS(m_rounds, expandWords, words, [](uint8_t x) { return subByteBitsliced(x); });
+        bitslice();
+        return true;
+    }
+    AES_DISPATCH_ROUNDS(m_rounds, expandWords, words, [](uint8_t x) { return SBOX[x]; });
+
+    // Pack the round keys into words for the T-table engine
+    int numRounds = m_rounds;
+    for (int k = 0; k <= numRounds; k++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            m_encKeyWords[4*k + c] = loadWord(&m_roundKeys[k][4*c]);
+        }
+    }
+
+    // The equivalent inverse cipher uses the round keys in reverse order, and moves
+    // InvMixColumns before AddRoundKey, so the inner round keys need InvMixColumns applied too.
+    // TD0[SBOX[b]] is InvMixColumns applied to a lone byte b, since INV_SBOX cancels SBOX.
+    for (int k = 0; k <= numRounds; k++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            uint32_t w = m_encKeyWords[4*(numRounds - k) + c];
+            if (k != 0 && k != numRounds)
             {
-                roundKeysInt[i+j] = roundKeysInt[i+j-key.size()] ^ roundKeysInt[i+j-4];
+                w = TD0[SBOX[w >> 24]] ^
+                    TD1[SBOX[(w >> 16) & 0xff]] ^
+                    TD2[SBOX[(w >> 8) & 0xff]] ^
+                    TD3[SBOX[w & 0xff]];
             }
+            m_decKeyWords[4*k + c] = w;
+        }
+    }
+    return true;
+}
+
+void AES::encryptBlock(const uint8_t* in, uint8_t* out) const
+{
+    if (usesAESNIRoundKeys())
+    {
+        encryptBlockAESNI(in, out);
+    }
+    else if (m_backend == Backend::Bitsliced)
+    {
+        encryptBlocksBitsliced(in, out, 1);
+    }
+    else
+    {
+        encryptBlocksTTable(in, out, 1);
+    }
+}
+
+void AES::decryptBlock(const uint8_t* in, uint8_t* out) const
+{
+    if (usesAESNIRoundKeys())
+    {
+        decryptBlockAESNI(in, out);
+    }
+    else if (m_backend == Backend::Bitsliced)
+    {
+        decryptBlocksBitsliced(in, out, 1);
+    }
+    else
+    {
+        decryptBlocksTTable(in, out, 1);
+    }
+}
+
+void AES::encryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    switch (m_backend)
+    {
+        case Backend::VAES512:
+            encryptBlocksVAES512(in, out, numBlocks);
+            return;
+        case Backend::VAES256:
+            encryptBlocksVAES256(in, out, numBlocks);
+            return;
+        case Backend::AESNI:
+            encryptBlocksAESNI(in, out, numBlocks);
+            return;
+        case Backend::Bitsliced:
+            encryptBlocksBitsliced(in, out, numBlocks);
+            return;
+        default:
+            encryptBlocksTTable(in, out, numBlocks);
+            return;
+    }
+}
+
+void AES::decryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    switch (m_backend)
+    {
+        case Backend::VAES512:
+            decryptBlocksVAES512(in, out, numBlocks);
+            return;
+        case Backend::VAES256:
+            decryptBlocksVAES256(in, out, numBlocks);
+            return;
+        case Backend::AESNI:
+            decryptBlocksAESNI(in, out, numBlocks);
+            return;
+        case Backend::Bitsliced:
+            decryptBlocksBitsliced(in, out, numBlocks);
+            return;
+        default:
+            decryptBlocksTTable(in, out, numBlocks);
+            return;
+    }
+}
+
+void AES::encryptBlocksCBC(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const
+{
+    // Each block depends on the previous block of ciphertext (or, for the first block, the IV),
+    // so CBC encryption has to go one block at a time
+    for (size_t b = 0; b < numBlocks; b++, in += 16, out += 16)
+    {
+        for (int i = 0; i < 16; i++) out[i] = in[i] ^ iv[i];
+        encryptBlock(out, out);
+        std::copy(out, out + 16, iv.begin());
+    }
+}
+
+void AES::encryptCBCBatch(std::span<CBCJob> jobs)
+{
+    for (const CBCJob& job : jobs)
+    {
+        if (!job.keySchedule)
+        {
+            throw std::invalid_argument("Error: The key schedule is missing.");
+        }
+        if (job.in.size() % 16 != 0 || job.out.size() != job.in.size())
+        {
+            throw std::invalid_argument("Error: Each CBC job needs whole blocks, and an output the same size as its input.");
         }
     }
-    if (roundKeysInt.size() == 216) roundKeysInt.resize(208);
-    if (roundKeysInt.size() == 256) roundKeysInt.resize(240);
 
-    // Now pack roundKeysInt into m_roundKeys
-    int j = 0;
-    for (int k = 0; k < m_roundKeys.size(); k++)
+    // The multi-buffer engine runs one round count at a time, so that its rounds are unrolled.
+    // It gets each job's round keys alongside its index.
+    std::array<std::vector<size_t>, 3> byRounds;
+    std::array<std::vector<const std::array<uint8_t, 16>*>, 3> roundKeysByRounds;
+    for (size_t i = 0; i < jobs.size(); i++)
     {
+        const KeySchedule& keys = *jobs[i].keySchedule;
+        if (usesAESNIRoundKeys(keys.backend()))
+        {
+            byRounds[(keys.m_rounds - 10) / 2].push_back(i);
+            roundKeysByRounds[(keys.m_rounds - 10) / 2].push_back(keys.m_roundKeys.data());
+        }
+        else
+        {
+            AES aes(jobs[i].keySchedule);
+            aes.encryptBlocksCBC(jobs[i].in.data(), jobs[i].out.data(), jobs[i].in.size() / 16, jobs[i].iv);
+        }
+    }
+    for (size_t r = 0; r < byRounds.size(); r++)
+    {
+        if (!byRounds[r].empty())
+        {
+            encryptCBCBatchAESNI(jobs.data(), byRounds[r].data(), roundKeysByRounds[r].data(), byRounds[r].size(),
+                                 static_cast<int>(10 + 2 * r));
+        }
+    }
+}
+
+void AES::decryptBlocksCBC(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const
+{
+    switch (m_backend)
+    {
+        case Backend::VAES512:
+            decryptBlocksCBCVAES512(in, out, numBlocks, iv);
+            return;
+        case Backend::VAES256:
+            decryptBlocksCBCVAES256(in, out, numBlocks, iv);
+            return;
+        case Backend::AESNI:
+            decryptBlocksCBCAESNI(in, out, numBlocks, iv);
+            return;
+        case Backend::Bitsliced:
+            decryptBlocksCBCBitsliced(in, out, numBlocks, iv);
+            return;
+        default:
+            break;
+    }
+    for (size_t b = 0; b < numBlocks; b++)
+    {
+        // Keep this ciphertext block before (possibly) overwriting it, since it's the
+        // chaining value for the next block.
+        std::array<uint8_t, 16> currCiphertext;
+        std::copy(in + 16*b, in + 16*b + 16, currCiphertext.begin());
+        decryptBlock(in + 16*b, out + 16*b);
         for (int i = 0; i < 16; i++)
         {
-            m_roundKeys[k][i] = roundKeysInt[j];
-            j++;
+            out[16*b + i] ^= iv[i];
         }
+        iv = currCiphertext;
+    }
+}
+
+void AES::encryptBlocksTTable(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    AES_DISPATCH_ROUNDS(m_keys->m_rounds, encryptTTable, m_keys->m_encKeyWords.data(), in, out, numBlocks);
+}
+
+void AES::decryptBlocksTTable(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    AES_DISPATCH_ROUNDS(m_keys->m_rounds, decryptTTable, m_keys->m_decKeyWords.data(), in, out, numBlocks);
+}
+
+template <int Rounds>
+void AES::encryptTTable(const uint32_t* keyWords, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    for (size_t b = 0; b < numBlocks; b++, in += 16, out += 16)
+    {
+        const uint32_t* rk = keyWords;
+
+        // Initial round key addition. Each word is one column of the state.
+        uint32_t s0 = loadWord(in)      ^ rk[0];
+        uint32_t s1 = loadWord(in + 4)  ^ rk[1];
+        uint32_t s2 = loadWord(in + 8)  ^ rk[2];
+        uint32_t s3 = loadWord(in + 12) ^ rk[3];
+
+        // Each full round: output column c takes row r from input column c+r (ShiftRows), and the
+        // T-table lookup does SubBytes and that row's share of MixColumns at once. The round count
+        // is a constant, so the compiler can unroll this completely.
+        for (int round = 1; round < Rounds; round++)
+        {
+            rk += 4;
+            uint32_t t0 = TE0[s0 >> 24] ^ TE1[(s1 >> 16) & 0xff] ^ TE2[(s2 >> 8) & 0xff] ^ TE3[s3 & 0xff] ^ rk[0];
+            uint32_t t1 = TE0[s1 >> 24] ^ TE1[(s2 >> 16) & 0xff] ^ TE2[(s3 >> 8) & 0xff] ^ TE3[s0 & 0xff] ^ rk[1];
+            uint32_t t2 = TE0[s2 >> 24] ^ TE1[(s3 >> 16) & 0xff] ^ TE2[(s0 >> 8) & 0xff] ^ TE3[s1 & 0xff] ^ rk[2];
+            uint32_t t3 = TE0[s3 >> 24] ^ TE1[(s0 >> 16) & 0xff] ^ TE2[(s1 >> 8) & 0xff] ^ TE3[s2 & 0xff] ^ rk[3];
+            s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+        }
+
+        // Final round: don't do the MixColumns step, so use the plain SBOX
+        rk += 4;
+        storeWord(out,      subWordShifted(SBOX, s0, s1, s2, s3) ^ rk[0]);
+        storeWord(out + 4,  subWordShifted(SBOX, s1, s2, s3, s0) ^ rk[1]);
+        storeWord(out + 8,  subWordShifted(SBOX, s2, s3, s0, s1) ^ rk[2]);
+        storeWord(out + 12, subWordShifted(SBOX, s3, s0, s1, s2) ^ rk[3]);
+    }
+}
+
+template <int Rounds>
+void AES::decryptTTable(const uint32_t* keyWords, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    for (size_t b = 0; b < numBlocks; b++, in += 16, out += 16)
+    {
+        const uint32_t* rk = keyWords;
+
+        uint32_t s0 = loadWord(in)      ^ rk[0];
+        uint32_t s1 = loadWord(in + 4)  ^ rk[1];
+        uint32_t s2 = loadWord(in + 8)  ^ rk[2];
+        uint32_t s3 = loadWord(in + 12) ^ rk[3];
+
+        // Same as encryptTTable, but InvShiftRows takes row r from input column c-r
+        for (int round = 1; round < Rounds; round++)
+        {
+            rk += 4;
+            uint32_t t0 = TD0[s0 >> 24] ^ TD1[(s3 >> 16) & 0xff] ^ TD2[(s2 >> 8) & 0xff] ^ TD3[s1 & 0xff] ^ rk[0];
+            uint32_t t1 = TD0[s1 >> 24] ^ TD1[(s0 >> 16) & 0xff] ^ TD2[(s3 >> 8) & 0xff] ^ TD3[s2 & 0xff] ^ rk[1];
+            uint32_t t2 = TD0[s2 >> 24] ^ TD1[(s1 >> 16) & 0xff] ^ TD2[(s0 >> 8) & 0xff] ^ TD3[s3 & 0xff] ^ rk[2];
+            uint32_t t3 = TD0[s3 >> 24] ^ TD1[(s2 >> 16) & 0xff] ^ TD2[(s1 >> 8) & 0xff] ^ TD3[s0 & 0xff] ^ rk[3];
+            s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+        }
+
+        rk += 4;
+        storeWord(out,      subWordShifted(INV_SBOX, s0, s3, s2, s1) ^ rk[0]);
+        storeWord(out + 4,  subWordShifted(INV_SBOX, s1, s0, s3, s2) ^ rk[1]);
+        storeWord(out + 8,  subWordShifted(INV_SBOX, s2, s1, s0, s3) ^ rk[2]);
+        storeWord(out + 12, subWordShifted(INV_SBOX, s3, s2, s1, s0) ^ rk[3]);
     }
-    return true;
 }
 
-void AES::addRoundKey(int round)
+void AES::addRoundKey(std::array<uint8_t, 16>& state, int round) const
 {
-    for (int i = 0; i < 16; i++) m_state[i] ^= m_roundKeys[round][i];
+    for (int i = 0; i < 16; i++) state[i] ^= m_keys->m_roundKeys[round][i];
 }
 
-void AES::subBytes()
+void AES::subBytes(std::array<uint8_t, 16>& state)
 {
     for (int i = 0; i < 16; i++)
     {
-        m_state[i] = SBOX[m_state[i]];
+        state[i] = SBOX[state[i]];
     }
 }
 
-void AES::invSubBytes()
+void AES::invSubBytes(std::array<uint8_t, 16>& state)
 {
     for (int i = 0; i < 16; i++)
     {
-        m_state[i] = INV_SBOX[m_state[i]];
+        state[i] = INV_SBOX[state[i]];
     }
 }
 
-void AES::shiftRows()
+void AES::shiftRows(std::array<uint8_t, 16>& state)
 {
-    std::array<uint8_t, 16> oldState = m_state;
+    std::array<uint8_t, 16> oldState = state;
     
     // Row 1 (indices 0, 4, 8, 12) doesn't shift
 
     // Row 2 (indices 1, 5, 9, 13) shifts 1
-    m_state[1] = oldState[5];
-    m_state[5] = oldState[9];
-    m_state[9] = oldState[13];
-    m_state[13] = oldState[1];
+    state[1] = oldState[5];
+    state[5] = oldState[9];
+    state[9] = oldState[13];
+    state[13] = oldState[1];
 
     // Row 3 (indices 2, 6, 10, 14) shifts 2
-    m_state[2] = oldState[10];
-    m_state[6] = oldState[14];
-    m_state[10] = oldState[2];
-    m_state[14] = oldState[6];
+    state[2] = oldState[10];
+    state[6] = oldState[14];
+    state[10] = oldState[2];
+    state[14] = oldState[6];
 
     // Row 4 (indices 3, 7, 11, 15) shifts 3
-    m_state[3] = oldState[15];
-    m_state[7] = oldState[3];
-    m_state[11] = oldState[7];
-    m_state[15] = oldState[11];
+    state[3] = oldState[15];
+    state[7] = oldState[3];
+    state[11] = oldState[7];
+    state[15] = oldState[11];
 }
 
-void AES::invShiftRows()
+void AES::invShiftRows(std::array<uint8_t, 16>& state)
 {
-    std::array<uint8_t, 16> oldState = m_state;
+    std::array<uint8_t, 16> oldState = state;
     
     // Row 1 (indices 0, 4, 8, 12) doesn't shift
 
     // Row 2 (indices 1, 5, 9, 13) shifts 1
-    m_state[1] = oldState[13];
-    m_state[5] = oldState[1];
-    m_state[9] = oldState[5];
-    m_state[13] = oldState[9];
+    state[1] = oldState[13];
+    state[5] = oldState[1];
+    state[9] = oldState[5];
+    state[13] = oldState[9];
 
     // Row 3 (indices 2, 6, 10, 14) shifts 2
-    m_state[2] = oldState[10];
-    m_state[6] = oldState[14];
-    m_state[10] = oldState[2];
-    m_state[14] = oldState[6];
+    state[2] = oldState[10];
+    state[6] = oldState[14];
+    state[10] = oldState[2];
+    state[14] = oldState[6];
 
     // Row 4 (indices 3, 7, 11, 15) shifts 3
-    m_state[3] = oldState[7];
-    m_state[7] = oldState[11];
-    m_state[11] = oldState[15];
-    m_state[15] = oldState[3];
+    state[3] = oldState[7];
+    state[7] = oldState[11];
+    state[11] = oldState[15];
+    state[15] = oldState[3];
 }
 
-void AES::mixColumns()
+void AES::mixColumns(std::array<uint8_t, 16>& state)
 {
-    std::array<uint8_t, 16> oldState = m_state;
+    std::array<uint8_t, 16> oldState = state;
     for (int i = 0; i < 16; i += 4)
     {
-        m_state[i]  = GMUL2[oldState[i]] ^ GMUL3[oldState[i+1]] ^ oldState[i+2]        ^ oldState[i+3];
-        m_state[i+1]= oldState[i]        ^ GMUL2[oldState[i+1]] ^ GMUL3[oldState[i+2]] ^ oldState[i+3];
-        m_state[i+2]= oldState[i]        ^ oldState[i+1]        ^ GMUL2[oldState[i+2]] ^ GMUL3[oldState[i+3]];
-        m_state[i+3]= GMUL3[oldState[i]] ^ oldState[i+1]        ^ oldState[i+2]        ^ GMUL2[oldState[i+3]];
+        state[i]  = GMUL2[oldState[i]] ^ GMUL3[oldState[i+1]] ^ oldState[i+2]        ^ oldState[i+3];
+        state[i+1]= oldState[i]        ^ GMUL2[oldState[i+1]] ^ GMUL3[oldState[i+2]] ^ oldState[i+3];
+        state[i+2]= oldState[i]        ^ oldState[i+1]        ^ GMUL2[oldState[i+2]] ^ GMUL3[oldState[i+3]];
+        state[i+3]= GMUL3[oldState[i]] ^ oldState[i+1]        ^ oldState[i+2]        ^ GMUL2[oldState[i+3]];
     }
 }
 
-void AES::invMixColumns()
+void AES::invMixColumns(std::array<uint8_t, 16>& state)
 {
-    std::array<uint8_t, 16> oldState = m_state;
+    std::array<uint8_t, 16> oldState = state;
     for (int i = 0; i < 16; i += 4)
     {
-        m_state[i]  = GMUL14[oldState[i]] ^ GMUL11[oldState[i+1]] ^ GMUL13[oldState[i+2]] ^ GMUL9[oldState[i+3]];
-        m_state[i+1]= GMUL9[oldState[i]]  ^ GMUL14[oldState[i+1]] ^ GMUL11[oldState[i+2]] ^ GMUL13[oldState[i+3]];
-        m_state[i+2]= GMUL13[oldState[i]] ^ GMUL9[oldState[i+1]]  ^ GMUL14[oldState[i+2]] ^ GMUL11[oldState[i+3]];
-        m_state[i+3]= GMUL11[oldState[i]] ^ GMUL13[oldState[i+1]] ^ GMUL9[oldState[i+2]]  ^ GMUL14[oldState[i+3]];
+        state[i]  = GMUL14[oldState[i]] ^ GMUL11[oldState[i+1]] ^ GMUL13[oldState[i+2]] ^ GMUL9[oldState[i+3]];
+        state[i+1]= GMUL9[oldState[i]]  ^ GMUL14[oldState[i+1]] ^ GMUL11[oldState[i+2]] ^ GMUL13[oldState[i+3]];
+        state[i+2]= GMUL13[oldState[i]] ^ GMUL9[oldState[i+1]]  ^ GMUL14[oldState[i+2]] ^ GMUL11[oldState[i+3]];
+        state[i+3]= GMUL11[oldState[i]] ^ GMUL13[oldState[i+1]] ^ GMUL9[oldState[i+2]]  ^ GMUL14[oldState[i+3]];
     }
 }
@@ -4,65 +4,495 @@
 #include <vector>
 #include <array>
 #include <string>
+#include <span>
+#include <memory>
+#include <functional>
+#include "aestables.h"
 
 /* Alexander Schurman
  *
- * Implements the AES algorithm.
- * For now, only ECB mode is implemented.
+ * Implements the AES algorithm, in ECB, CBC, CTR, GCM, Chunked (GCM in chunks), and XTS modes.
  * This was done for fun. Obviously don't use any of this code in any security-critical application.
  */
 
+// Calls kernel<Rounds>(args...) for a key's round count (10, 12, or 14), so that each kernel is
+// compiled once per key size with a constant round count and its rounds unrolled. The choice is
+// made once per call, outside every loop. It's a macro rather than a template taking a lambda
+// because GCC and Clang don't apply a function's target attributes to lambdas inside it.
+#define AES_DISPATCH_ROUNDS(rounds, kernel, ...) \
+    ((rounds) == 10 ? kernel<10>(__VA_ARGS__) : \
+     (rounds) == 12 ? kernel<12>(__VA_ARGS__) : kernel<14>(__VA_ARGS__))
+
 class AES
 {
 public:
     enum class Mode : uint8_t
     {
         ECB = 0,
-        CBC = 1
+        CBC = 1,
+        CTR = 2,
+        GCM = 3,
+        // Fixed-size chunks, each sealed with GCM on its own, so any byte range can be decrypted
+        // (and authenticated) without touching the rest of the file
+        Chunked = 4,
+        // Two-key XTS (IEEE 1619) for disk images: each sector is encrypted on its own with a
+        // tweak from its number, and the ciphertext is the same size as the plaintext
+        XTS = 5
+    };
+
+    // Implementations of the block cipher. The constructor picks the fastest one this CPU supports.
+    enum class Backend : uint8_t
+    {
+        Portable = 0, // T-table round engine in plain C++
+        AESNI = 1,    // x86 AES-NI instructions
+        VAES256 = 2,  // AES-NI, plus VAES on 256-bit ymm registers (2 blocks per instruction)
+        VAES512 = 3,  // AES-NI, plus VAES on 512-bit zmm registers (4 blocks per instruction)
+        Bitsliced = 4 // Constant-time bitsliced engine in plain C++ (4 blocks at once, no tables)
+    };
+
+    // The expanded key, in the formats its backend needs. A schedule is never changed once it's
+    // built, so one can be shared by any number of AES objects on any number of threads without
+    // locking, and without expanding the key again for each of them. Aligned to a cache line, so
+    // that a shared schedule never shares a line with anything that's written to.
+    class alignas(64) KeySchedule
+    {
+    public:
+        ~KeySchedule() { clear(); }
+
+        KeySchedule(const KeySchedule&) = delete;
+        KeySchedule& operator=(const KeySchedule&) = delete;
+
+        Backend backend() const { return m_backend; }
+
+    private:
+        friend class AES;
+
+        explicit KeySchedule(Backend backend) : m_backend(backend) { }
+
+        // AES-256 has the most rounds
+        static constexpr int MAX_ROUNDS = 14;
+
+        // 16-byte round keys derived from the AES key: one per round, plus one extra.
+        // For 128-bit key, 10 rounds, 11 round keys, 176 bytes;
+        //     192-bit key, 12 rounds, 13 round keys, 208 bytes;
+        //     256-bit key, 14 rounds, 15 round keys, 240 bytes.
+        // Each round key's array represents a matrix. Indices 0-3 are column 1, 4-7 are column 2, etc.
+        // Only the first m_rounds + 1 are used. The round keys are stored back to back, and the
+        // key expansion treats them as one array of 4-byte words.
+        std::array<std::array<uint8_t, 16>, MAX_ROUNDS + 1> m_roundKeys;
+        int m_rounds = 0;
+        Backend m_backend;
+
+        // The round keys for AES-NI decryption (AESDEC), used by the AES-NI and VAES backends:
+        // m_roundKeys in reverse order, with AESIMC (InvMixColumns) applied to every round key
+        // except the first and last.
+        std::array<std::array<uint8_t, 16>, MAX_ROUNDS + 1> m_invRoundKeys;
+
+        // The same round keys packed into big-endian 32-bit words (4 per round key) for the T-table
+        // round engine. m_encKeyWords is in encryption order. m_decKeyWords holds the round keys of
+        // the equivalent inverse cipher: in reverse order, with InvMixColumns applied to every round
+        // key except the first and last.
+        std::array<uint32_t, 4 * (MAX_ROUNDS + 1)> m_encKeyWords;
+        std::array<uint32_t, 4 * (MAX_ROUNDS + 1)> m_decKeyWords;
+
+        // The round keys in bitsliced form for Backend::Bitsliced: 8 words per round key, each
+        // holding one bit of every byte of 4 copies of the round key. Used for both directions.
+        std::array<uint64_t, 8 * (MAX_ROUNDS + 1)> m_bitslicedKeys;
+
+        // Expands the key to m_roundKeys using the AES key schedule, and fills in the round keys of
+        // m_backend's format (m_encKeyWords/m_decKeyWords, m_invRoundKeys, or m_bitslicedKeys).
+        // Returns false, changing nothing, if the key isn't 16, 24, or 32 bytes. Doesn't allocate.
+        bool expand(const std::vector<uint8_t>& key);
+        // The word recurrence of the AES key schedule for one key size, filling the round keys
+        // that follow the key at the start of 'words'. subByte is the S-box to use for SubWord.
+        template <int Rounds, typename SubByte>
+        static void expandWords(uint8_t* words, SubByte subByte);
+        // The AES-NI version of expand, using AESKEYGENASSIST. Expects a valid key size.
+        void expandAESNI(const std::vector<uint8_t>& key);
+        // Converts m_roundKeys into m_bitslicedKeys
+        void bitslice();
+        // Zeroes every round key
+        void clear();
     };
 
     AES(const std::vector<uint8_t>& key);
+    // Uses the given backend instead of the fastest one. Throws if the CPU doesn't support it.
+    AES(const std::vector<uint8_t>& key, Backend backend);
+    // Uses a key schedule from expandKey, with the backend it was expanded for
+    explicit AES(std::shared_ptr<const KeySchedule> keySchedule);
     ~AES() { cleanup(); }
 
+    // Expands 'key' for the fastest backend this CPU supports, or the given one. Throws if the
+    // key isn't 128, 192, or 256 bits, or the CPU doesn't support the backend.
+    static std::shared_ptr<const KeySchedule> expandKey(const std::vector<uint8_t>& key);
+    static std::shared_ptr<const KeySchedule> expandKey(const std::vector<uint8_t>& key, Backend backend);
+
+    // One message for encryptCBCBatch: raw CBC encryption of whole blocks, with no header or
+    // padding. 'iv' is updated to the last ciphertext block, as for a chained call.
+    struct CBCJob
+    {
+        std::shared_ptr<const KeySchedule> keySchedule;
+        std::array<uint8_t, 16> iv;
+        std::span<const uint8_t> in;
+        std::span<uint8_t> out;
+    };
+    // CBC-encrypts many independent messages, each with its own key schedule and IV, in one pass.
+    // CBC encryption of one message is serial, so with AES-NI (and VAES schedules, which share
+    // its round keys), blocks from up to 8 messages are interleaved through the cipher at once,
+    // as the next message takes over a lane as soon as one finishes. Schedules for other backends
+    // are encrypted one message at a time. Each 'in' must be a whole number of blocks, and
+    // 'out' the same size; they may be the same buffer, but mustn't overlap another job's.
+    // Throws if a job is malformed, before anything is encrypted.
+    static void encryptCBCBatch(std::span<CBCJob> jobs);
+
     // Encrypt plaintext into ciphertext.
-    void encrypt(std::istream& plaintext, std::ostream& ciphertext, Mode mode);
+    void encrypt(std::istream& plaintext, std::ostream& ciphertext, Mode mode) const;
+
+    // Encrypted files start with a 1-byte header holding the Mode. For CBC it's followed by the
+    // 16-byte IV, and for CTR by the 16-byte initial counter block. CTR isn't padded.
+    // For GCM the header is followed by a 12-byte nonce, and the ciphertext by a 16-byte tag that
+    // authenticates the header and the ciphertext. GCM isn't padded either.
+    // For Chunked the mode is followed by the chunk size (4 bytes, big-endian) and a 12-byte file
+    // nonce. Then comes each chunk of plaintext, all of them the chunk size except the last, as
+    // GCM ciphertext and a 16-byte tag. A chunk's nonce is the file nonce with its index XORed
+    // into the last 8 bytes. Its additional data is the header and a byte that's 1 for the last
+    // chunk and 0 otherwise, so chunks can't be moved, dropped, or cut off without failing.
+    // There's no table of chunk positions in the header: every chunk but the last is the same
+    // size, so chunk i always starts at header + i * (chunkSize + 16), and the nonce binds it to i.
+    // Encrypting in Chunked mode uses chunkSize() as the chunk size.
+    // XTS has no header, so that sector n of a disk image stays at byte n * sectorSize(); it's
+    // encrypted as sectors from 0 on, and decrypted with decryptSectors rather than decrypt.
 
     // Decrypt ciphertext into plaintext. 'usePadding' indicates whether PKCS7 padding is used, or
     // whether no padding is used at all; usePadding=false is used for the sake of testing with
-    // NIST test vectors, which are 16 bytes
-    void decrypt(std::istream& ciphertext, std::ostream& plaintext, bool usePadding = true, bool useHeader = true);
+    // NIST test vectors, which are 16 bytes.
+    // ECB and CBC ciphertext is decrypted a large chunk at a time, spread over all cores.
+    // In GCM mode, plaintext is written as it's decrypted, and the tag is only checked at the end;
+    // if it doesn't match, decrypt throws and the caller must discard everything written.
+    // In Chunked mode, each chunk's tag is checked before its plaintext is written.
+    void decrypt(std::istream& ciphertext, std::ostream& plaintext, bool usePadding = true, bool useHeader = true) const;
+
+    // Encrypt or decrypt a buffer in memory, producing exactly the bytes that encrypt and decrypt
+    // write to a stream. Buffers up to MIN_TASK_SIZE (64 KiB) are done on the calling thread with
+    // no allocations; bigger ones are spread over the shared ThreadPool. The output mustn't
+    // overlap the input, and an output that's too small throws.
+    // 'ciphertext' must hold encryptedSize(plaintext.size(), mode) bytes. Returns that size.
+    size_t encrypt(std::span<const uint8_t> plaintext, std::span<uint8_t> ciphertext, Mode mode) const;
+    // 'plaintext' must hold decryptedSizeBound(ciphertext) bytes. Returns the size of the plaintext.
+    size_t decrypt(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext) const;
+    // The size of the ciphertext for plaintextSize bytes of plaintext, header included. For
+    // Chunked, chunkSize must be the encrypting object's chunkSize().
+    static uint64_t encryptedSize(uint64_t plaintextSize, Mode mode, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+    // The space decrypt needs for the plaintext of 'ciphertext': its exact size for CTR, GCM, and
+    // Chunked, and the size including padding for ECB and CBC
+    static size_t decryptedSizeBound(std::span<const uint8_t> ciphertext);
+    // Decrypts the plaintext bytes [offset, offset + plaintext.size()) of Chunked ciphertext,
+    // stopping at the end of the plaintext, and returns how many bytes it wrote. Only the chunks
+    // that overlap the range are decrypted and authenticated, spread over the shared ThreadPool.
+    // Throws if the ciphertext isn't Chunked, or one of those chunks fails authentication, in
+    // which case 'plaintext' is zeroed.
+    size_t decryptRange(std::span<const uint8_t> ciphertext, uint64_t offset, std::span<uint8_t> plaintext) const;
+
+    // XTS encryption and decryption of consecutive sectors of sectorSize() bytes, the first of
+    // which is sector number firstSector. The last sector may be short, and if it isn't a whole
+    // number of blocks, it's finished with ciphertext stealing; it must be at least 16 bytes.
+    // Sectors are spread over the shared ThreadPool. Needs a tweak key from setTweakKey. The
+    // output is the same size as the input, and may be the same buffer. Throws on bad sizes.
+    void encryptSectors(std::span<const uint8_t> plaintext, std::span<uint8_t> ciphertext, uint64_t firstSector) const;
+    void decryptSectors(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext, uint64_t firstSector) const;
+    // The same, a chunk of whole sectors at a time
+    void encryptSectors(std::istream& plaintext, std::ostream& ciphertext, uint64_t firstSector = 0) const;
+    void decryptSectors(std::istream& ciphertext, std::ostream& plaintext, uint64_t firstSector = 0) const;
+
+    // Incremental encryption and decryption, for data that arrives a piece at a time rather than
+    // as a whole stream. Defined below.
+    class Encryptor;
+    class Decryptor;
+
+    // Encrypt or decrypt one file into another through memory mappings of both, reading and
+    // writing the same format as encrypt and decrypt. Returns false, without touching either
+    // file, if they can't be mapped (e.g. a pipe), in which case use the stream versions.
+    // If decryptFile throws, the output file holds garbage and should be deleted.
+    bool encryptFile(const std::string& inputPath, const std::string& outputPath, Mode mode) const;
+    bool decryptFile(const std::string& inputPath, const std::string& outputPath) const;
+    // decryptRange from one mapped file into another, which holds the (at most) 'length' bytes
+    // of plaintext from 'offset' on
+    bool decryptFileRange(const std::string& inputPath, const std::string& outputPath, uint64_t offset,
+                          uint64_t length) const;
+    // decryptSectors from one mapped file into another, from sector 0 on. XTS ciphertext is
+    // encrypted with encryptFile.
+    bool decryptSectorsFile(const std::string& inputPath, const std::string& outputPath) const;
 
     // Run my collection of tests
     static void test();
-    
+
+    // Measures the throughput of ECB and CBC encryption and decryption with each of 'backends',
+    // for every key size and message sizes from 16 bytes up to maxBytes, on one thread and (for
+    // the operations that are split up) on the shared ThreadPool. Writes the results to 'json'.
+    static void benchmark(std::ostream& json, const std::vector<Backend>& backends, uint64_t maxBytes);
+    // Measures the latency, in nanoseconds, of key setup, single-block encryption and decryption,
+    // and encrypting a small message in each mode, with each of 'backends' and every key size.
+    // Each call is timed on its own where the clock allows it. Writes the results, with a
+    // histogram of each, to 'json'.
+    static void benchmarkLatency(std::ostream& json, const std::vector<Backend>& backends);
+    // Measures the throughput of encryptCBCBatch against encrypting the same batch of messages,
+    // each with its own key, one after another, for message sizes from 64 bytes to 16 KiB.
+    static void benchmarkBatch(std::ostream& json, const std::vector<Backend>& backends);
+
+    // Returns the fastest backend that the CPU we're running on supports.
+    static Backend detectBackend();
+    static bool cpuSupportsAESNI();
+    static bool cpuSupportsVAES256();
+    static bool cpuSupportsVAES512();
+    // Whether GCM can use PCLMULQDQ (carry-less multiply) for GHASH
+    static bool cpuSupportsPCLMUL();
+    static bool backendSupported(Backend backend);
+    static const char* backendName(Backend backend);
+
+    // The backend this AES object was constructed with
+    Backend backend() const { return m_backend; }
+
+    // The number of bytes encrypt and decrypt read from the stream, and run the cipher over, at
+    // once. Must be a positive multiple of 16; throws otherwise. Defaults to DEFAULT_CHUNK_SIZE.
+    void setChunkSize(size_t chunkSize);
+    size_t chunkSize() const { return m_chunkSize; }
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+    // XTS's second key, which encrypts each sector number into its tweak. It's expanded for this
+    // object's backend by an AES object of its own. Throws if it isn't the same size as this
+    // object's key, or if it's the same key, which XTS forbids.
+    void setTweakKey(const std::vector<uint8_t>& key);
+    // The size of an XTS sector (data unit). Must be a positive multiple of 16; throws otherwise.
+    void setSectorSize(size_t sectorSize);
+    size_t sectorSize() const { return m_sectorSize; }
+    static constexpr size_t DEFAULT_SECTOR_SIZE = 512;
+
 private:
     AES() { }
 
-    // A collection of 16-byte round keys derived from the AES key: one per round, plus one extra.
-    // For 128-bit key, 10 rounds, 11 round keys, 176 bytes;
-    //     192-bit key, 12 rounds, 13 round keys, 208 bytes;
-    //     256-bit key, 14 rounds, 15 round keys, 240 bytes.
-    // Each round key's array represents a matrix. Indices 0-3 are column 1, 4-7 are column 2, etc.
-    std::vector<std::array<uint8_t, 16>> m_roundKeys;
+    Backend m_backend = Backend::Portable;
+    size_t m_chunkSize = DEFAULT_CHUNK_SIZE;
+    size_t m_sectorSize = DEFAULT_SECTOR_SIZE;
+    // Encrypts XTS tweaks, once setTweakKey has been called
+    std::unique_ptr<AES> m_tweakCipher;
+
+    // The VAES backends use AES-NI's round keys, key expansion, and single-block functions,
+    // and only replace the multi-block kernels.
+    static bool usesAESNIRoundKeys(Backend backend)
+    {
+        return backend == Backend::AESNI || backend == Backend::VAES256 || backend == Backend::VAES512;
+    }
+    bool usesAESNIRoundKeys() const { return usesAESNIRoundKeys(m_backend); }
 
-    // The 16-byte state
-    std::array<uint8_t, 16> m_state;
+    // The round keys. Every function that encrypts or decrypts only reads them, and keeps the
+    // block it's working on in locals, so an AES object can be used by several threads at once.
+    // m_keys points to either the object's own schedule, which it expands its key into without
+    // allocating, or one it shares, which m_sharedSchedule keeps alive.
+    const KeySchedule* m_keys = &m_ownSchedule;
+    KeySchedule m_ownSchedule{Backend::Portable};
+    std::shared_ptr<const KeySchedule> m_sharedSchedule;
 
-    // Expands the key to m_roundKeys using the AES key schedule.
-    // Expects key to contain exactly 16, 24, or 32 bytes,
-    // for AES-128, AES-192, or AES-256. If the key isn't the right size,
-    // then don't change m_roundKeys and return false.
+    // Expands 'key' into m_ownSchedule for m_backend, and uses that.
+    // Expects key to contain exactly 16, 24, or 32 bytes, for AES-128, AES-192, or AES-256.
+    // If the key isn't the right size, then don't change the round keys and return false.
     bool keyExpansion(const std::vector<uint8_t>& key);
 
-    // Each of these functions apply a step of the AES algorithm to m_state.
-    void addRoundKey(int round);
-    void subBytes();
-    void invSubBytes();
-    void shiftRows();
-    void invShiftRows();
-    void mixColumns();
-    void invMixColumns();
+    // Encrypts or decrypts a single 16-byte block with m_backend.
+    // 'in' and 'out' may point to the same block.
+    void encryptBlock(const uint8_t* in, uint8_t* out) const;
+    void decryptBlock(const uint8_t* in, uint8_t* out) const;
+
+    // Encrypts or decrypts numBlocks independent 16-byte blocks (ECB) with m_backend, which may
+    // keep several blocks in flight at once. 'in' and 'out' may point to the same buffer.
+    void encryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    // CBC-encrypts numBlocks blocks, one at a time, since each depends on the ciphertext of the one
+    // before. Same rules for iv and in-place buffers as decryptBlocksCBC.
+    void encryptBlocksCBC(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
+    // CBC-decrypts numBlocks blocks. iv holds the ciphertext block preceding 'in' (or the IV), and
+    // is updated to the last ciphertext block of 'in' so the next call can carry on from there.
+    // 'in' and 'out' may point to the same buffer.
+    void decryptBlocksCBC(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
 
+    // The T-table round engine, which fuses SubBytes, ShiftRows, and MixColumns into four
+    // table lookups per column. The members pick the kernel for the key's round count.
+    void encryptBlocksTTable(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksTTable(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    template <int Rounds>
+    static void encryptTTable(const uint32_t* keyWords, const uint8_t* in, uint8_t* out, size_t numBlocks);
+    template <int Rounds>
+    static void decryptTTable(const uint32_t* keyWords, const uint8_t* in, uint8_t* out, size_t numBlocks);
+
+    // The AES-NI engine. The multi-block versions interleave 8 (then 4) independent blocks
+    // to hide the latency of AESENC/AESDEC.
+    void encryptBlockAESNI(const uint8_t* in, uint8_t* out) const;
+    void decryptBlockAESNI(const uint8_t* in, uint8_t* out) const;
+    void encryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksCBCAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
+    // encryptCBCBatch's multi-buffer engine, for jobs[indices[0..count)], whose schedules all
+    // have AES-NI round keys for 'rounds' rounds; roundKeys[i] are those of jobs[indices[i]]
+    static void encryptCBCBatchAESNI(CBCJob* jobs, const size_t* indices, const std::array<uint8_t, 16>* const* roundKeys,
+                                     size_t count, int rounds);
+
+    // The VAES engines, which run an AES round on every 128-bit lane of a ymm or zmm register,
+    // with 4 registers in flight. Leftover blocks that don't fill a register go to AES-NI.
+    void encryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksCBCVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
+    void encryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksCBCVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
+
+    // The bitsliced engine. Works on 4 blocks at a time; a partial batch is padded out.
+    void encryptBlocksBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks) const;
+    void decryptBlocksCBCBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const;
+    // CTR mode: XORs numBytes of 'in' with the keystream that starts at 'counter' (the counter
+    // block for the first block of 'in'), writing to 'out'. 'in' and 'out' may be the same buffer.
+    void cryptCTR(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16> counter) const;
+    // cryptCTR, with the data split into counter ranges that are processed on the shared ThreadPool
+    void cryptCTRParallel(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16> counter) const;
+    // Encrypts or decrypts a whole stream in CTR mode, a chunk at a time with cryptCTRParallel
+    void cryptCTRStream(std::istream& in, std::ostream& out, std::array<uint8_t, 16> counter) const;
+    // ECB or CBC decryption of numBlocks blocks, split into ranges that are processed on the
+    // shared ThreadPool. Same rules for cbcVector and in-place buffers as decryptBlocksCBC.
+    void decryptBlocksParallel(const uint8_t* in, uint8_t* out, size_t numBlocks, Mode mode,
+                               std::array<uint8_t, 16>& cbcVector) const;
+
+    // GHASH, GCM's authenticator: a running hash x is updated by each 16-byte block y to (x ^ y) * H
+    // in GF(2^128), where H is the zero block encrypted with the key.
+    struct GHashKey
+    {
+        // Shoup's 4-bit tables for the portable multiply: H times every 4-bit polynomial, as the
+        // high and low 64 bits of the product.
+        std::array<uint64_t, 16> tableHigh;
+        std::array<uint64_t, 16> tableLow;
+        // H, H^2, ..., H^8, byte-reflected, so PCLMULQDQ can hash 8 blocks with a single reduction
+        std::array<std::array<uint8_t, 16>, 8> powers;
+        // H itself, as the high and low 64 bits, for the constant-time multiply
+        uint64_t hHigh;
+        uint64_t hLow;
+        bool useCLMUL;
+        // Whether to use the constant-time multiply instead of the tables, whose lookups are
+        // indexed by bits of H and the data
+        bool constantTime;
+    };
+    // Computes H and the tables for it. The AES-NI backends use PCLMULQDQ when the CPU has it.
+    // The bitsliced backend uses a constant-time carry-less multiply built from integer
+    // multiplies, so GCM doesn't leak H through the cache; the portable backend uses the tables.
+    void initGHash(GHashKey& key) const;
+    static void initGHashCLMUL(GHashKey& key, const uint8_t* h);
+    // Hashes numBytes of data into x. A partial final block is padded with zeroes, so only the
+    // last call for a given piece of data may pass a length that isn't a multiple of 16.
+    static void ghash(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes);
+    static void ghashPortable(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes);
+    static void ghashConstantTime(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes);
+    static void ghashCLMUL(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes);
+    // GCM encryption or decryption of numBytes: CTR with 'counter', plus GHASH of the ciphertext
+    // into x. Updates counter and x so the next call can carry on. Same length rules as ghash.
+    // 'in' and 'out' may be the same buffer.
+    void cryptGCM(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                  std::array<uint8_t, 16>& x, const GHashKey& key, bool decrypting) const;
+    // The AES-NI version, which stitches AESENC and PCLMULQDQ together over 8 blocks at a time so
+    // the data is only touched once. Handles as many whole 8-block groups as fit in numBytes, and
+    // returns the number of bytes it processed.
+    size_t cryptGCMAESNI(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                         std::array<uint8_t, 16>& x, const GHashKey& key, bool decrypting) const;
+    // Sets up GCM for the given 12-byte nonce: the GHASH key, the hash of the header (which is
+    // the additional data), the first counter block J0, and the counter to encrypt from.
+    void startGCM(const uint8_t* nonce, GHashKey& key, std::array<uint8_t, 16>& x,
+                  std::array<uint8_t, 16>& j0, std::array<uint8_t, 16>& counter) const;
+    // Encrypts or decrypts the body of a GCM stream, after the mode byte. Encryption writes the
+    // nonce, the ciphertext, and the tag; decryption throws if the tag doesn't match.
+    void encryptGCMStream(std::istream& in, std::ostream& out) const;
+    void decryptGCMStream(std::istream& in, std::ostream& out) const;
+    // The same for a body in memory. 'out' must hold inSize + 28 bytes when encrypting, and
+    // inSize - 28 when decrypting, which returns the plaintext size. When the tag doesn't match,
+    // 'out' is zeroed before decryptGCMBuffer throws.
+    void encryptGCMBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const;
+    size_t decryptGCMBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const;
+    // Throws unless the computed tag matches the expected one. Compares every byte, so the time
+    // taken doesn't reveal how much of the tag was right.
+    static void checkTag(const uint8_t* computed, const uint8_t* expected);
+    // Computes the tag from the finished GHASH state and the counter block for the nonce (J0)
+    void finishGCM(const GHashKey& key, std::array<uint8_t, 16>& x, uint64_t aadBytes, uint64_t textBytes,
+                   const std::array<uint8_t, 16>& j0, uint8_t* tag) const;
+
+    // Where the chunks of Chunked ciphertext are: read from the header, and checked against the
+    // ciphertext's size. Throws if the header is truncated, or the size doesn't fit.
+    struct ChunkLayout
+    {
+        size_t chunkSize;
+        uint64_t numChunks;
+        // The plaintext size of the last chunk, and of the whole message
+        size_t lastChunkSize;
+        uint64_t plaintextSize;
+    };
+    static ChunkLayout chunkLayout(std::span<const uint8_t> ciphertext);
+    // GCM-encrypts or decrypts one chunk of 'size' bytes, with chunk 'index''s nonce and the
+    // additional data for 'header', and computes its tag. 'key' is the GHASH key from initGHash,
+    // which is the same for every chunk.
+    void cryptChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                    size_t size, uint8_t* out, uint8_t* tag, bool decrypting) const;
+    // Encrypts a chunk into 'out', followed by its tag
+    void sealChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                   size_t size, uint8_t* out) const;
+    // Decrypts a chunk, whose tag follows the 'size' bytes at 'in', into 'out'. If the tag doesn't
+    // match, 'out' is zeroed and openChunk throws. 'in' and 'out' may be the same buffer.
+    void openChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                   size_t size, uint8_t* out) const;
+    // Fills in the CHUNKED_HEADER_SIZE-byte header for a new Chunked message, with a fresh nonce.
+    // Throws if chunkSize() doesn't fit in the header.
+    void startChunked(uint8_t* header) const;
+    // Runs task(first, count) over ranges of chunks (or sectors) [0, numChunks) of chunkSize
+    // bytes, on the shared ThreadPool if there's enough work to split up
+    static void forEachChunkRange(uint64_t numChunks, size_t chunkSize,
+                                  const std::function<void(uint64_t, uint64_t)>& task);
+    // Encrypts or decrypts the body of a Chunked stream, after the mode byte, a chunk at a time
+    void encryptChunkedStream(std::istream& in, std::ostream& out) const;
+    void decryptChunkedStream(std::istream& in, std::ostream& out) const;
+    // XTS-encrypts or decrypts one sector of 'size' bytes (at least 16), with the tweak for
+    // sector number 'sector'. 'tweaks' is scratch space for size / 16 tweaks.
+    void cryptSector(const uint8_t* in, uint8_t* out, size_t size, uint64_t sector, uint8_t* tweaks,
+                     bool decrypting) const;
+    // cryptSector over consecutive sectors, spread over the shared ThreadPool
+    void cryptSectors(std::span<const uint8_t> in, std::span<uint8_t> out, uint64_t firstSector,
+                      bool decrypting) const;
+    void cryptSectorsStream(std::istream& in, std::ostream& out, uint64_t firstSector, bool decrypting) const;
+
+    // Encrypts a whole Chunked message, header included, into the encryptedSize bytes at 'out'
+    void encryptChunkedBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const;
+    // Decrypts a whole Chunked message, and returns the size of the plaintext
+    size_t decryptChunkedBuffer(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext) const;
+
+    // Returns the number of PKCS7 padding bytes in the final block of plaintext, or throws if
+    // the padding is malformed
+    static size_t paddingLength(const uint8_t* lastBlock);
+    // Adds 'blocks' to a 128-bit big-endian counter block
+    static void addToCounter(std::array<uint8_t, 16>& counter, uint64_t blocks);
+    // Fills 'iv' with random bytes from the calling thread's RandomGenerator, for a CBC IV, CTR
+    // initial counter block, or GCM nonce
+    static void randomIV(std::array<uint8_t, 16>& iv);
+    // The generator runs on cryptCTR
+    friend class RandomGenerator;
+    // The cache hashes keys with encryptBlocksCBC
+    friend class KeyScheduleCache;
+
+    // The S-box without a table lookup, for a key schedule that doesn't leak the key through timing
+    static uint8_t subByteBitsliced(uint8_t x);
+
+    // Each of these functions apply a step of the AES algorithm to a block's state.
+    void addRoundKey(std::array<uint8_t, 16>& state, int round) const;
+    static void subBytes(std::array<uint8_t, 16>& state);
+    static void invSubBytes(std::array<uint8_t, 16>& state);
+    static void shiftRows(std::array<uint8_t, 16>& state);
+    static void invShiftRows(std::array<uint8_t, 16>& state);
+    static void mixColumns(std::array<uint8_t, 16>& state);
+    static void invMixColumns(std::array<uint8_t, 16>& state);
+
+    // Zeroes the object's own round keys, and drops its reference to a shared schedule, which
+    // zeroes itself once nothing refers to it
     void cleanup();
 
     // Test Functions //
@@ -74,14 +504,171 @@ private:
     void testEndToEnd(const std::string& plaintextFilename, Mode mode);
     // test decrypting ciphertext with improper padding or a non-integer number of blocks
     void testMalformedCiphertext(const std::string& ciphertextFilename);
+    // tests that the multi-block functions match encrypting/decrypting one block at a time
+    void testMultiBlock();
+    // tests CTR mode with NIST's test vectors, and counter arithmetic
+    void testCTR();
+    // tests GCM with the test vectors from the GCM specification, and tag verification
+    void testGCM();
+    // tests that every mode gives the same results whatever the chunk size
+    void testChunkSizes();
+    // tests that decryption split over the thread pool matches decrypting one block at a time,
+    // and that only the last chunk's padding is checked
+    void testParallelDecrypt();
+    // tests that encryptFile/decryptFile match encrypt/decrypt
+    void testMappedFiles();
+    // tests that the span API matches the stream API, and rejects outputs that are too small
+    void testSpans();
+    // tests that Encryptor and Decryptor match the stream API however the input is split up
+    void testIncremental();
+    // tests AES objects sharing one key schedule, and one AES object shared by several threads
+    void testSharedKeySchedule();
+    // tests KeyScheduleCache's hits, misses, and least-recently-used eviction
+    void testKeyScheduleCache();
+    // tests RandomGenerator's output across refills and rekeying, and between generators and threads
+    void testRandomGenerator();
+    // tests Chunked mode round trips, random-access decryption, and tampering with chunks
+    void testChunked();
+    // tests XTS against IEEE 1619 vectors, ciphertext stealing, and sector-parallel processing
+    void testXTS();
+    // tests encryptCBCBatch against encrypting each message on its own
+    void testCBCBatch();
+    // tests nested work on the thread pool, and batch encryption of directory trees and manifests
+    void testBatch();
+    // tests that streaming through StreamPipeline matches the stream API, and passes on errors
+    void testPipeline();
+
+    // The smallest piece of a chunk worth handing to another thread
+    static constexpr size_t MIN_TASK_SIZE = 64 << 10;
+    // GCM's 32-bit block counter starts at 2, so a message can be at most 2^32 - 2 blocks
+    static constexpr uint64_t GCM_MAX_BYTES = ((1ull << 32) - 2) * 16;
+    // The header, the mode byte and the nonce, is authenticated as GCM's additional data
+    static constexpr size_t GCM_HEADER_SIZE = 13;
+    // The mode byte, the chunk size, and the file nonce
+    static constexpr size_t CHUNKED_HEADER_SIZE = 17;
+    // The largest chunk a Chunked message may have, so a forged header can't make decryption
+    // allocate too much
+    static constexpr size_t MAX_CHUNKED_CHUNK_SIZE = 1 << 30;
+
+    // The lookup tables, generated at compile time by AESTables. TE0 is SubBytes followed by
+    // MixColumns applied to a single byte, and TE1-TE3 are TE0 rotated right by 8, 16, and 24
+    // bits. TD0-TD3 are the same for the inverse cipher.
+    static constexpr std::array<uint8_t, 256> SBOX = AESTables::makeSBox();
+    static constexpr std::array<uint8_t, 256> INV_SBOX = AESTables::makeInvSBox();
+    static constexpr std::array<uint8_t, 256> GMUL2 = AESTables::makeMulTable(2);
+    static constexpr std::array<uint8_t, 256> GMUL3 = AESTables::makeMulTable(3);
+    static constexpr std::array<uint8_t, 256> GMUL9 = AESTables::makeMulTable(9);
+    static constexpr std::array<uint8_t, 256> GMUL11 = AESTables::makeMulTable(11);
+    static constexpr std::array<uint8_t, 256> GMUL13 = AESTables::makeMulTable(13);
+    static constexpr std::array<uint8_t, 256> GMUL14 = AESTables::makeMulTable(14);
+    static constexpr std::array<uint8_t,  10> RC = AESTables::makeRoundConstants();
+    static constexpr std::array<uint32_t, 256> TE0 = AESTables::makeTTable(SBOX, AESTables::ENCRYPT_COLUMN, 0);
+    static constexpr std::array<uint32_t, 256> TE1 = AESTables::makeTTable(SBOX, AESTables::ENCRYPT_COLUMN, 1);
+    static constexpr std::array<uint32_t, 256> TE2 = AESTables::makeTTable(SBOX, AESTables::ENCRYPT_COLUMN, 2);
+    static constexpr std::array<uint32_t, 256> TE3 = AESTables::makeTTable(SBOX, AESTables::ENCRYPT_COLUMN, 3);
+    static constexpr std::array<uint32_t, 256> TD0 = AESTables::makeTTable(INV_SBOX, AESTables::DECRYPT_COLUMN, 0);
+    static constexpr std::array<uint32_t, 256> TD1 = AESTables::makeTTable(INV_SBOX, AESTables::DECRYPT_COLUMN, 1);
+    static constexpr std::array<uint32_t, 256> TD2 = AESTables::makeTTable(INV_SBOX, AESTables::DECRYPT_COLUMN, 2);
+    static constexpr std::array<uint32_t, 256> TD3 = AESTables::makeTTable(INV_SBOX, AESTables::DECRYPT_COLUMN, 3);
+
+    // Spot checks of the generated tables against FIPS-197 and the reference implementation's tables
+    static_assert(AESTables::gmul(0x57, 0x83) == 0xc1 && AESTables::gmul(0x57, 0x13) == 0xfe, "GF(2^8) multiplication is wrong");
+    static_assert(SBOX[0x00] == 0x63 && SBOX[0x01] == 0x7c && SBOX[0x53] == 0xed && SBOX[0xff] == 0x16, "S-box is wrong");
+    static_assert(INV_SBOX[0x00] == 0x52 && INV_SBOX[0xed] == 0x53 && INV_SBOX[0xff] == 0x7d, "Inverse S-box is wrong");
+    static_assert(GMUL2[0x80] == 0x1b && GMUL3[0xff] == 0x1a && GMUL14[0x01] == 0x0e, "Multiplication tables are wrong");
+    static_assert(RC[0] == 0x01 && RC[8] == 0x1b && RC[9] == 0x36, "Round constants are wrong");
+    static_assert(TE0[0x00] == 0xc66363a5 && TE0[0xff] == 0x2c16163a && TE1[0x00] == 0xa5c66363 &&
+                  TE3[0x00] == 0x6363a5c6, "Encryption T-tables are wrong");
+    static_assert(TD0[0x00] == 0x51f4a750 && TD0[0xff] == 0xd0b85742 && TD1[0x00] == 0x5051f4a7 &&
+                  TD3[0xff] == 0xb85742d0, "Decryption T-tables are wrong");
+};
+
+// Encrypts a piece at a time, writing exactly what AES::encrypt writes for all of the pieces
+// together. update encrypts every whole block it can and holds on to the rest; finalize encrypts
+// what's left, with PKCS7 padding for ECB and CBC, and writes GCM's tag. The AES object must
+// outlive the Encryptor.
+class AES::Encryptor
+{
+public:
+    Encryptor(const AES& aes, Mode mode);
+    ~Encryptor();
+
+    Encryptor(const Encryptor&) = delete;
+    Encryptor& operator=(const Encryptor&) = delete;
+
+    // Both return the number of bytes written to 'out'. update needs room for
+    // in.size() + MAX_OVERHEAD bytes, and finalize for MAX_OVERHEAD; otherwise they throw.
+    // Calling either after finalize throws std::logic_error.
+    size_t update(std::span<const uint8_t> in, std::span<uint8_t> out);
+    size_t finalize(std::span<uint8_t> out);
+
+    // The most that either function writes beyond its input: a header, held-back bytes, and
+    // a padding block or tag
+    static constexpr size_t MAX_OVERHEAD = 48;
+
+private:
+    const AES& m_aes;
+    Mode m_mode;
+    bool m_wroteHeader = false;
+    bool m_finalized = false;
+    // The CBC chaining value, or the CTR counter for the next block
+    std::array<uint8_t, 16> m_vector;
+    // Input that doesn't fill a block yet
+    std::array<uint8_t, 16> m_pending;
+    size_t m_pendingSize = 0;
+    // GCM's state: the nonce, and everything cryptGCM carries between calls
+    std::array<uint8_t, 16> m_nonce;
+    GHashKey m_key;
+    std::array<uint8_t, 16> m_x, m_j0;
+    uint64_t m_totalBytes = 0;
+
+    // Writes the header to 'out' if it hasn't been written yet, returning its size
+    size_t writeHeader(uint8_t* out);
+    // Encrypts whole blocks, carrying the mode's state on to the next call
+    void encryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks);
+};
+
+// Decrypts a piece at a time what AES::encrypt (or an Encryptor) wrote, starting with the header.
+// update decrypts every whole block it can, except for the last block of ECB and CBC, whose
+// padding can only be stripped once finalize knows it's the last, and GCM's tag. Malformed
+// ciphertext makes update or finalize throw, as AES::decrypt does.
+// As with AES::decrypt, GCM plaintext is handed out before the tag is checked; if finalize
+// throws, everything update wrote must be discarded. The AES object must outlive the Decryptor.
+class AES::Decryptor
+{
+public:
+    explicit Decryptor(const AES& aes);
+    ~Decryptor();
+
+    Decryptor(const Decryptor&) = delete;
+    Decryptor& operator=(const Decryptor&) = delete;
+
+    // The same rules for the size of 'out' as Encryptor
+    size_t update(std::span<const uint8_t> in, std::span<uint8_t> out);
+    size_t finalize(std::span<uint8_t> out);
+
+private:
+    const AES& m_aes;
+    Mode m_mode = Mode::ECB;
+    bool m_finalized = false;
+    // The header, gathered until it's complete
+    std::array<uint8_t, 17> m_header;
+    size_t m_headerBytes = 0;
+    bool m_started = false;
+    // Input that can't be decrypted yet: a partial block, plus a whole block held back for
+    // ECB and CBC's padding or GCM's tag
+    std::array<uint8_t, 32> m_pending;
+    size_t m_pendingSize = 0;
+    size_t m_holdBack = 0;
+    std::array<uint8_t, 16> m_vector;
+    GHashKey m_key;
+    std::array<uint8_t, 16> m_x, m_j0;
+    uint64_t m_totalBytes = 0;
 
-    static const std::array<uint8_t, 256> SBOX;
-    static const std::array<uint8_t, 256> INV_SBOX;
-    static const std::array<uint8_t, 256> GMUL2;
-    static const std::array<uint8_t, 256> GMUL3;
-    static const std::array<uint8_t, 256> GMUL9;
-    static const std::array<uint8_t, 256> GMUL11;
-    static const std::array<uint8_t, 256> GMUL13;
-    static const std::array<uint8_t, 256> GMUL14;
-    static const std::array<uint8_t,  10> RC;
+    // The full size of the header for the mode byte it starts with. Throws if the mode byte
+    // isn't one we know.
+    size_t headerSize() const;
+    // Sets up the mode's state from the completed header
+    void startMode();
+    void decryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks);
 };
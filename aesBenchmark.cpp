@@ -0,0 +1,415 @@
+#include "aes.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <stdexcept>
+
+// The benchmarks for AES are implemented here, rather than in aes.cpp.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+// The time stamp counter ticks at a fixed rate, which is the CPU's base clock on anything recent.
+// With turbo boost, actual core cycles run faster, so cycles/byte figures are a little high.
+static inline uint64_t readCycleCounter() { return __rdtsc(); }
+// For timing a single short call: the fences keep the call's work from moving across either read
+static inline uint64_t readCycleCounterFenced()
+{
+    _mm_lfence();
+    uint64_t cycles = __rdtsc();
+    _mm_lfence();
+    return cycles;
+}
+static constexpr bool HAS_CYCLE_COUNTER = true;
+#else
+static inline uint64_t readCycleCounter() { return 0; }
+static inline uint64_t readCycleCounterFenced() { return 0; }
+static constexpr bool HAS_CYCLE_COUNTER = false;
+#endif
+
+// Each sample repeats the operation until it's covered at least this many bytes, so that even a
+// single block takes long enough to time
+static constexpr uint64_t SAMPLE_BYTES = 1 << 20;
+// Samples are taken until there are MAX_SAMPLES, or there are MIN_SAMPLES and SAMPLE_SECONDS
+// have passed
+static constexpr size_t MIN_SAMPLES = 5;
+static constexpr size_t MAX_SAMPLES = 1000;
+static constexpr double SAMPLE_SECONDS = 0.25;
+
+// The latency benchmarks time every call on its own with the cycle counter, so the percentiles
+// are those of single calls. Without a cycle counter, steady_clock can be too coarse for a single
+// block (100 ns on Windows), so the block operations are timed this many calls at once instead,
+// and each sample is the average of the batch.
+static constexpr size_t LATENCY_BATCH = 16;
+// The histogram splits each power of 2 into this many buckets of equal width
+static constexpr int HISTOGRAM_SUBBUCKETS = 8;
+static constexpr size_t LATENCY_WARMUP = 1000;
+static constexpr size_t LATENCY_SAMPLES = 2000;
+// The size of the "small message" the latency benchmarks encrypt from start to finish
+static constexpr size_t SMALL_MESSAGE_BYTES = 64;
+
+// The times of each sample of an operation, in seconds and in cycles
+struct BenchmarkSamples
+{
+    std::vector<double> seconds;
+    std::vector<double> cycles;
+    uint64_t bytesPerSample;
+};
+
+// Runs 'operation' (which handles 'bytes' bytes) for one sample's worth of bytes to warm up the
+// caches, the branch predictors, and the clock speed, and fault in the buffer's pages, and then
+// times samples of it
+static BenchmarkSamples sampleOperation(const std::function<void()>& operation, uint64_t bytes)
+{
+    using Clock = std::chrono::steady_clock;
+    uint64_t repeats = std::max<uint64_t>(1, SAMPLE_BYTES / bytes);
+    BenchmarkSamples samples;
+    samples.bytesPerSample = repeats * bytes;
+
+    for (uint64_t r = 0; r < repeats; r++)
+    {
+        operation();
+    }
+    Clock::time_point start = Clock::now();
+    while (samples.seconds.size() < MAX_SAMPLES &&
+           (samples.seconds.size() < MIN_SAMPLES ||
+            std::chrono::duration<double>(Clock::now() - start).count() < SAMPLE_SECONDS))
+    {
+        Clock::time_point begin = Clock::now();
+        uint64_t beginCycles = readCycleCounter();
+        for (uint64_t r = 0; r < repeats; r++)
+        {
+            operation();
+        }
+        uint64_t endCycles = readCycleCounter();
+        samples.seconds.push_back(std::chrono::duration<double>(Clock::now() - begin).count());
+        samples.cycles.push_back(static_cast<double>(endCycles - beginCycles));
+    }
+    return samples;
+}
+
+// The value that 'fraction' of the samples are at or below, e.g. 0.5 for the median
+static double percentile(std::vector<double> values, double fraction)
+{
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(std::ceil(fraction * values.size()));
+    return values[std::min(values.size() - 1, index > 0 ? index - 1 : 0)];
+}
+
+// Writes one result as a JSON object. Throughput is in MB/s (10^6 bytes). The p99 figures come
+// from the slowest 1% of samples, so p99 throughput is lower than the median. The largest sizes
+// only get MIN_SAMPLES or so, and with fewer than 100 samples p99 is just the slowest one, which
+// "p99IsMax" flags.
+static void writeResult(std::ostream& json, const char* backend, size_t keyBits, const char* mode,
+                        const char* operation, unsigned int threads, uint64_t bytes, const BenchmarkSamples& samples)
+{
+    double medianSeconds = percentile(samples.seconds, 0.5);
+    double p99Seconds = percentile(samples.seconds, 0.99);
+    double sampleBytes = static_cast<double>(samples.bytesPerSample);
+    json << "    {\"backend\": \"" << backend << "\", \"keyBits\": " << keyBits
+         << ", \"mode\": \"" << mode << "\", \"operation\": \"" << operation
+         << "\", \"threads\": " << threads << ", \"bytes\": " << bytes
+         << ", \"samples\": " << samples.seconds.size()
+         << ", \"p99IsMax\": " << (samples.seconds.size() < 100 ? "true" : "false")
+         << ", \"medianMBps\": " << sampleBytes / medianSeconds / 1e6
+         << ", \"p99MBps\": " << sampleBytes / p99Seconds / 1e6;
+    if (HAS_CYCLE_COUNTER)
+    {
+        json << ", \"medianCyclesPerByte\": " << percentile(samples.cycles, 0.5) / sampleBytes
+             << ", \"p99CyclesPerByte\": " << percentile(samples.cycles, 0.99) / sampleBytes;
+    }
+    json << "}";
+}
+
+// Measures how many cycle counter ticks there are per nanosecond, by counting them over a short
+// stretch of steady_clock
+static double measureTicksPerNanosecond()
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point begin = Clock::now();
+    uint64_t beginTicks = readCycleCounter();
+    while (Clock::now() - begin < std::chrono::milliseconds(50))
+    {
+    }
+    uint64_t endTicks = readCycleCounter();
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - begin;
+    return static_cast<double>(endTicks - beginTicks) / elapsed.count();
+}
+
+// Times LATENCY_SAMPLES samples of 'operation', after warming up, in nanoseconds per call. Each
+// sample is 'batch' calls, which is 1 unless there's no cycle counter. overheadNs, the time
+// taken to time nothing at all, is taken off each sample.
+static std::vector<double> sampleLatency(const std::function<void()>& operation, size_t batch,
+                                         double ticksPerNs, double overheadNs)
+{
+    using Clock = std::chrono::steady_clock;
+    for (size_t i = 0; i < LATENCY_WARMUP; i++)
+    {
+        operation();
+    }
+    std::vector<double> nanoseconds;
+    nanoseconds.reserve(LATENCY_SAMPLES);
+    for (size_t s = 0; s < LATENCY_SAMPLES; s++)
+    {
+        double elapsedNs;
+        if (HAS_CYCLE_COUNTER)
+        {
+            uint64_t begin = readCycleCounterFenced();
+            for (size_t i = 0; i < batch; i++)
+            {
+                operation();
+            }
+            uint64_t end = readCycleCounterFenced();
+            elapsedNs = static_cast<double>(end - begin) / ticksPerNs;
+        }
+        else
+        {
+            Clock::time_point begin = Clock::now();
+            for (size_t i = 0; i < batch; i++)
+            {
+                operation();
+            }
+            elapsedNs = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+        }
+        nanoseconds.push_back(std::max(0.0, elapsedNs - overheadNs) / batch);
+    }
+    return nanoseconds;
+}
+
+// The histogram bucket holding 'ns': below 2 * HISTOGRAM_SUBBUCKETS ns, buckets are 1 ns wide;
+// above that, each power of 2 is split into HISTOGRAM_SUBBUCKETS buckets, so every bucket is
+// within 1/HISTOGRAM_SUBBUCKETS of its lower bound.
+static void histogramBucket(double ns, double& low, double& width)
+{
+    width = 1;
+    if (ns >= 2 * HISTOGRAM_SUBBUCKETS)
+    {
+        width = std::exp2(std::floor(std::log2(ns))) / HISTOGRAM_SUBBUCKETS;
+    }
+    low = std::floor(ns / width) * width;
+}
+
+// Writes one latency result as a JSON object, with a histogram of the samples in the buckets of
+// histogramBucket. Only buckets with samples in them are listed; each is [lowNs, highNs).
+static void writeLatencyResult(std::ostream& json, const char* backend, size_t keyBits, const char* operation,
+                               size_t batch, std::vector<double> nanoseconds)
+{
+    std::sort(nanoseconds.begin(), nanoseconds.end());
+    json << "    {\"backend\": \"" << backend << "\", \"keyBits\": " << keyBits
+         << ", \"operation\": \"" << operation << "\", \"batch\": " << batch
+         << ", \"samples\": " << nanoseconds.size()
+         << ", \"minNs\": " << nanoseconds.front()
+         << ", \"medianNs\": " << percentile(nanoseconds, 0.5)
+         << ", \"p99Ns\": " << percentile(nanoseconds, 0.99)
+         << ", \"p999Ns\": " << percentile(nanoseconds, 0.999)
+         << ", \"maxNs\": " << nanoseconds.back()
+         << ", \"histogram\": [";
+    auto sample = nanoseconds.begin();
+    for (bool firstBucket = true; sample != nanoseconds.end(); firstBucket = false)
+    {
+        double low;
+        double width;
+        histogramBucket(*sample, low, width);
+        auto end = std::lower_bound(sample, nanoseconds.end(), low + width);
+        json << (firstBucket ? "" : ", ") << "{\"lowNs\": " << low << ", \"highNs\": " << low + width
+             << ", \"count\": " << (end - sample) << "}";
+        sample = end;
+    }
+    json << "]}";
+}
+
+void AES::benchmark(std::ostream& json, const std::vector<Backend>& backends, uint64_t maxBytes)
+{
+    // 16 bytes to 1 GiB, in steps of 4x
+    std::vector<uint64_t> sizes;
+    for (uint64_t size = 16; size <= maxBytes && size <= (1ull << 30); size *= 4)
+    {
+        sizes.push_back(size);
+    }
+    if (sizes.empty())
+    {
+        throw std::invalid_argument("Error: The largest benchmark size must be at least 16 bytes.");
+    }
+    std::vector<uint8_t> buffer(sizes.back());
+    for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<uint8_t>(i * 131);
+    unsigned int poolThreads = ThreadPool::shared().size();
+
+    json << std::fixed << std::setprecision(3);
+    json << "{\n  \"cycleCounter\": " << (HAS_CYCLE_COUNTER ? "true" : "false")
+         << ",\n  \"poolThreads\": " << poolThreads << ",\n  \"results\": [\n";
+    bool first = true;
+    for (Backend backend : backends)
+    {
+        std::cerr << "Benchmarking backend: " << backendName(backend) << "\n";
+        for (size_t keySize : {16, 24, 32})
+        {
+            std::vector<uint8_t> key(keySize);
+            for (size_t i = 0; i < keySize; i++) key[i] = static_cast<uint8_t>(i);
+            AES aes(key, backend);
+            for (uint64_t size : sizes)
+            {
+                uint8_t* data = buffer.data();
+                size_t numBlocks = size / 16;
+                std::array<uint8_t, 16> vector = {};
+
+                // CBC encryption can't be split up, and neither can anything up to MIN_TASK_SIZE,
+                // so only the bigger decryptions are run on the pool too
+                struct Operation
+                {
+                    const char* mode;
+                    const char* name;
+                    unsigned int threads;
+                    std::function<void()> run;
+                };
+                std::vector<Operation> operations =
+                {
+                    {"ecb", "encrypt", 1, [&] { aes.encryptBlocks(data, data, numBlocks); }},
+                    {"ecb", "decrypt", 1, [&] { aes.decryptBlocks(data, data, numBlocks); }},
+                    {"cbc", "encrypt", 1, [&] { aes.encryptBlocksCBC(data, data, numBlocks, vector); }},
+                    {"cbc", "decrypt", 1, [&] { aes.decryptBlocksCBC(data, data, numBlocks, vector); }},
+                };
+                if (poolThreads > 1 && size > MIN_TASK_SIZE)
+                {
+                    operations.push_back({"ecb", "decrypt", poolThreads,
+                                          [&] { aes.decryptBlocksParallel(data, data, numBlocks, Mode::ECB, vector); }});
+                    operations.push_back({"cbc", "decrypt", poolThreads,
+                                          [&] { aes.decryptBlocksParallel(data, data, numBlocks, Mode::CBC, vector); }});
+                }
+
+                for (const Operation& operation : operations)
+                {
+                    BenchmarkSamples samples = sampleOperation(operation.run, size);
+                    json << (first ? "" : ",\n");
+                    first = false;
+                    writeResult(json, backendName(backend), 8 * keySize, operation.mode, operation.name,
+                                operation.threads, size, samples);
+                }
+            }
+        }
+    }
+    json << "\n  ]\n}\n";
+}
+
+void AES::benchmarkLatency(std::ostream& json, const std::vector<Backend>& backends)
+{
+    double ticksPerNs = HAS_CYCLE_COUNTER ? measureTicksPerNanosecond() : 0;
+    std::vector<double> overhead = sampleLatency([] { }, 1, ticksPerNs, 0);
+    double overheadNs = percentile(overhead, 0.5);
+
+    json << std::fixed << std::setprecision(1);
+    json << "{\n  \"timer\": \"" << (HAS_CYCLE_COUNTER ? "cycleCounter" : "steadyClock")
+         << "\",\n  \"timerOverheadNs\": " << overheadNs << ",\n  \"results\": [\n";
+    bool first = true;
+    for (Backend backend : backends)
+    {
+        std::cerr << "Benchmarking backend: " << backendName(backend) << "\n";
+        for (size_t keySize : {16, 24, 32})
+        {
+            std::vector<uint8_t> key(keySize);
+            for (size_t i = 0; i < keySize; i++) key[i] = static_cast<uint8_t>(i);
+            AES aes(key, backend);
+            std::array<uint8_t, 16> block = {};
+            std::array<uint8_t, SMALL_MESSAGE_BYTES> message = {};
+            std::vector<uint8_t> ciphertext(std::max(encryptedSize(SMALL_MESSAGE_BYTES, Mode::CBC),
+                                                      encryptedSize(SMALL_MESSAGE_BYTES, Mode::GCM)));
+
+            // Key setup, on its own and as part of constructing an AES object, then the block
+            // cipher by itself, then encrypting a small message from start to finish: the header,
+            // a fresh IV or nonce, padding, and (for GCM) the tag. Only the single blocks are
+            // short enough to need batching without a cycle counter.
+            const size_t blockBatch = HAS_CYCLE_COUNTER ? 1 : LATENCY_BATCH;
+            struct Operation
+            {
+                const char* name;
+                size_t batch;
+                std::function<void()> run;
+            };
+            std::vector<Operation> operations =
+            {
+                {"keyExpansion", 1, [&] { aes.keyExpansion(key); }},
+                {"construct", 1, [&] { AES fresh(key, backend); }},
+                {"encryptBlock", blockBatch, [&] { aes.encryptBlock(block.data(), block.data()); }},
+                {"decryptBlock", blockBatch, [&] { aes.decryptBlock(block.data(), block.data()); }},
+                {"encryptMessageECB", 1, [&] { aes.encrypt(message, ciphertext, Mode::ECB); }},
+                {"encryptMessageCBC", 1, [&] { aes.encrypt(message, ciphertext, Mode::CBC); }},
+                {"encryptMessageCTR", 1, [&] { aes.encrypt(message, ciphertext, Mode::CTR); }},
+                {"encryptMessageGCM", 1, [&] { aes.encrypt(message, ciphertext, Mode::GCM); }},
+            };
+
+            for (const Operation& operation : operations)
+            {
+                std::vector<double> nanoseconds = sampleLatency(operation.run, operation.batch, ticksPerNs, overheadNs);
+                json << (first ? "" : ",\n");
+                first = false;
+                writeLatencyResult(json, backendName(backend), 8 * keySize, operation.name, operation.batch,
+                                   std::move(nanoseconds));
+            }
+        }
+    }
+    json << "\n  ]\n}\n";
+}
+
+void AES::benchmarkBatch(std::ostream& json, const std::vector<Backend>& backends)
+{
+    // A queue of small messages, each with its own key and IV, as a server would have
+    constexpr size_t BATCH_MESSAGES = 256;
+    json << std::fixed << std::setprecision(3);
+    json << "{\n  \"messages\": " << BATCH_MESSAGES << ",\n  \"results\": [\n";
+    bool first = true;
+    for (Backend backend : backends)
+    {
+        std::cerr << "Benchmarking backend: " << backendName(backend) << "\n";
+        for (size_t keySize : {16, 24, 32})
+        {
+            std::vector<CBCJob> jobs(BATCH_MESSAGES);
+            std::vector<std::unique_ptr<AES>> ciphers;
+            for (size_t m = 0; m < BATCH_MESSAGES; m++)
+            {
+                std::vector<uint8_t> key(keySize);
+                for (size_t i = 0; i < keySize; i++) key[i] = static_cast<uint8_t>(i + 7 * m);
+                jobs[m].keySchedule = expandKey(key, backend);
+                jobs[m].iv.fill(static_cast<uint8_t>(m));
+                ciphers.push_back(std::make_unique<AES>(jobs[m].keySchedule));
+            }
+            for (size_t size = 64; size <= (16 << 10); size *= 4)
+            {
+                std::vector<uint8_t> buffer(BATCH_MESSAGES * size);
+                for (size_t i = 0; i < buffer.size(); i++) buffer[i] = static_cast<uint8_t>(i * 131);
+                for (size_t m = 0; m < BATCH_MESSAGES; m++)
+                {
+                    jobs[m].in = std::span<const uint8_t>(buffer.data() + m * size, size);
+                    jobs[m].out = std::span<uint8_t>(buffer.data() + m * size, size);
+                }
+
+                // The same messages, encrypted one after another, and then all together
+                BenchmarkSamples sequential = sampleOperation([&]
+                {
+                    for (size_t m = 0; m < BATCH_MESSAGES; m++)
+                    {
+                        ciphers[m]->encryptBlocksCBC(jobs[m].out.data(), jobs[m].out.data(), size / 16, jobs[m].iv);
+                    }
+                }, buffer.size());
+                BenchmarkSamples batch = sampleOperation([&] { encryptCBCBatch(jobs); }, buffer.size());
+
+                double sequentialMBps = sequential.bytesPerSample / percentile(sequential.seconds, 0.5) / 1e6;
+                double batchMBps = batch.bytesPerSample / percentile(batch.seconds, 0.5) / 1e6;
+                json << (first ? "" : ",\n");
+                first = false;
+                json << "    {\"backend\": \"" << backendName(backend) << "\", \"keyBits\": " << 8 * keySize
+                     << ", \"messageBytes\": " << size
+                     << ", \"sequentialMBps\": " << sequentialMBps
+                     << ", \"sequentialP99MBps\": " << sequential.bytesPerSample / percentile(sequential.seconds, 0.99) / 1e6
+                     << ", \"batchMBps\": " << batchMBps
+                     << ", \"batchP99MBps\": " << batch.bytesPerSample / percentile(batch.seconds, 0.99) / 1e6
+                     << ", \"speedup\": " << batchMBps / sequentialMBps << "}";
+            }
+        }
+    }
+    json << "\n  ]\n}\n";
+}
@@ -1,38 +1,115 @@
 #include "aes.h"
+#include "batchcrypt.h"
+#include "keyschedulecache.h"
+#include "pipeline.h"
+#include "randomgenerator.h"
+#include "threadpool.h"
+#include <atomic>
 #include <cassert>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <string>
 #include <cstdlib>
 #include <ctime>
+#include <thread>
 
 // All of the test functions for AES are implemented here, rather than in aes.cpp.
 
 void AES::test()
 {
-    AES aes;
     std::cout << "Testing AES...\n";
     srand(time(NULL));
-    std::cout << "Running testSteps()...\n";
-    aes.testSteps();
-    aes.cleanup();
-    std::cout << "Running testEncyptDecrypt()...\n";
-    aes.testEncryptDecrypt();
-    aes.cleanup();
-    std::cout << "Running testEndToEnd()...\n";
-    aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::ECB);
-    aes.cleanup();
-    aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::CBC);
-    aes.cleanup();
-    aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::ECB);
-    aes.cleanup();
-    aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::CBC);
-    aes.cleanup();
-    std::cout << "Running testMalformedCiphertext()...\n";
-    aes.testMalformedCiphertext(".\\testFiles\\ciphertext1.test"); // test malformed padding
-    aes.cleanup();
-    aes.testMalformedCiphertext(".\\testFiles\\texttest.txt"); // test non-integer number of blocks
+
+    // Run every test against each backend this CPU can run
+    for (Backend backend : {Backend::Portable, Backend::Bitsliced, Backend::AESNI, Backend::VAES256, Backend::VAES512})
+    {
+        if (!backendSupported(backend))
+        {
+            std::cout << "Skipping backend (not supported by this CPU): " << backendName(backend) << "\n";
+            continue;
+        }
+        AES aes;
+        aes.m_backend = backend;
+        std::cout << "Testing backend: " << backendName(backend) << "\n";
+        std::cout << "Running testSteps()...\n";
+        aes.testSteps();
+        aes.cleanup();
+        std::cout << "Running testEncyptDecrypt()...\n";
+        aes.testEncryptDecrypt();
+        aes.cleanup();
+        std::cout << "Running testEndToEnd()...\n";
+        aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::ECB);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::CBC);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::ECB);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::CBC);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::CTR);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::CTR);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\texttest.txt", Mode::GCM);
+        aes.cleanup();
+        aes.testEndToEnd(".\\testFiles\\largetest.txt", Mode::GCM);
+        aes.cleanup();
+        std::cout << "Running testMalformedCiphertext()...\n";
+        aes.testMalformedCiphertext(".\\testFiles\\ciphertext1.test"); // test malformed padding
+        aes.cleanup();
+        aes.testMalformedCiphertext(".\\testFiles\\texttest.txt"); // test non-integer number of blocks
+        aes.cleanup();
+        std::cout << "Running testMultiBlock()...\n";
+        aes.testMultiBlock();
+        aes.cleanup();
+        std::cout << "Running testCTR()...\n";
+        aes.testCTR();
+        aes.cleanup();
+        std::cout << "Running testGCM()...\n";
+        aes.testGCM();
+        aes.cleanup();
+        std::cout << "Running testChunkSizes()...\n";
+        aes.testChunkSizes();
+        aes.cleanup();
+        std::cout << "Running testParallelDecrypt()...\n";
+        aes.testParallelDecrypt();
+        aes.cleanup();
+        std::cout << "Running testMappedFiles()...\n";
+        aes.testMappedFiles();
+        aes.cleanup();
+        std::cout << "Running testSpans()...\n";
+        aes.testSpans();
+        aes.cleanup();
+        std::cout << "Running testIncremental()...\n";
+        aes.testIncremental();
+        aes.cleanup();
+        std::cout << "Running testSharedKeySchedule()...\n";
+        aes.testSharedKeySchedule();
+        aes.cleanup();
+        std::cout << "Running testKeyScheduleCache()...\n";
+        aes.testKeyScheduleCache();
+        aes.cleanup();
+        std::cout << "Running testRandomGenerator()...\n";
+        aes.testRandomGenerator();
+        aes.cleanup();
+        std::cout << "Running testChunked()...\n";
+        aes.testChunked();
+        aes.cleanup();
+        std::cout << "Running testXTS()...\n";
+        aes.testXTS();
+        aes.cleanup();
+        std::cout << "Running testCBCBatch()...\n";
+        aes.testCBCBatch();
+        aes.cleanup();
+        std::cout << "Running testBatch()...\n";
+        aes.testBatch();
+        aes.cleanup();
+        std::cout << "Running testPipeline()...\n";
+        aes.testPipeline();
+        aes.cleanup();
+    }
     std::cout << "Done testing AES!\n";
 }
 
@@ -314,7 +391,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys1[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys1[i][j]);
         }
     }
     assert(keyExpansion(key2));
@@ -322,7 +399,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys2[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys2[i][j]);
         }
     }
     assert(keyExpansion(key3));
@@ -330,7 +407,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys3[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys3[i][j]);
         }
     }
     assert(keyExpansion(key4));
@@ -338,7 +415,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys4[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys4[i][j]);
         }
     }
     assert(keyExpansion(key5));
@@ -346,7 +423,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys5[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys5[i][j]);
         }
     }
     assert(keyExpansion(key6));
@@ -354,7 +431,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys6[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys6[i][j]);
         }
     }
     assert(keyExpansion(key7));
@@ -362,7 +439,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys7[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys7[i][j]);
         }
     }
     assert(keyExpansion(key8));
@@ -370,7 +447,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys8[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys8[i][j]);
         }
     }
     assert(keyExpansion(key9));
@@ -378,7 +455,7 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys9[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys9[i][j]);
         }
     }
     assert(keyExpansion(key10));
@@ -386,125 +463,132 @@ void AES::testSteps()
     {
         for (int j = 0; j < 16; j++)
         {
-            assert(m_roundKeys[i][j] == roundkeys10[i][j]);
+            assert(m_keys->m_roundKeys[i][j] == roundkeys10[i][j]);
         }
     }
 
     /////////////// TEST ADDROUNDKEY ///////////////
     
     assert(keyExpansion(key4));
-    for (int i = 0; i < 16; i++) m_state[i] = state1[i];
-    addRoundKey(0);
-    assert(m_state[0] == 0x49);
-    assert(m_state[1] == 0x20);
-    assert(m_state[2] == 0xe2);
-    assert(m_state[3] == 0x99);
-    assert(m_state[4] == 0xa5);
-    assert(m_state[5] == 0x20);
-    assert(m_state[6] == 0x52);
-    assert(m_state[7] == 0x61);
-    assert(m_state[8] == 0x64);
-    assert(m_state[9] == 0x69);
-    assert(m_state[10] == 0x6f);
-    assert(m_state[11] == 0x47);
-    assert(m_state[12] == 0x61);
-    assert(m_state[13] == 0x74);
-    assert(m_state[14] == 0x75);
-    assert(m_state[15] == 0x6e);
-    addRoundKey(1);
-    assert(m_state[0] == (0x49 ^ 0xda));
-    assert(m_state[1] == (0x20 ^ 0xbd));
-    assert(m_state[2] == (0xe2 ^ 0x7d));
-    assert(m_state[3] == (0x99 ^ 0x76));
-    assert(m_state[4] == (0xa5 ^ 0x7f));
-    assert(m_state[5] == (0x20 ^ 0x9d));
-    assert(m_state[6] == (0x52 ^ 0x2f));
-    assert(m_state[7] == (0x61 ^ 0x17));
-    assert(m_state[8] == (0x64 ^ 0x1b));
-    assert(m_state[9] == (0x69 ^ 0xf4));
-    assert(m_state[10] == (0x6f ^ 0x40));
-    assert(m_state[11] == (0x47 ^ 0x50));
-    assert(m_state[12] == (0x61 ^ 0x7a));
-    assert(m_state[13] == (0x74 ^ 0x80));
-    assert(m_state[14] == (0x75 ^ 0x35));
-    assert(m_state[15] == (0x6e ^ 0x3e));
+    std::array<uint8_t, 16> state;
+    for (int i = 0; i < 16; i++) state[i] = state1[i];
+    addRoundKey(state, 0);
+    assert(state[0] == 0x49);
+    assert(state[1] == 0x20);
+    assert(state[2] == 0xe2);
+    assert(state[3] == 0x99);
+    assert(state[4] == 0xa5);
+    assert(state[5] == 0x20);
+    assert(state[6] == 0x52);
+    assert(state[7] == 0x61);
+    assert(state[8] == 0x64);
+    assert(state[9] == 0x69);
+    assert(state[10] == 0x6f);
+    assert(state[11] == 0x47);
+    assert(state[12] == 0x61);
+    assert(state[13] == 0x74);
+    assert(state[14] == 0x75);
+    assert(state[15] == 0x6e);
+    addRoundKey(state, 1);
+    assert(state[0] == (0x49 ^ 0xda));
+    assert(state[1] == (0x20 ^ 0xbd));
+    assert(state[2] == (0xe2 ^ 0x7d));
+    assert(state[3] == (0x99 ^ 0x76));
+    assert(state[4] == (0xa5 ^ 0x7f));
+    assert(state[5] == (0x20 ^ 0x9d));
+    assert(state[6] == (0x52 ^ 0x2f));
+    assert(state[7] == (0x61 ^ 0x17));
+    assert(state[8] == (0x64 ^ 0x1b));
+    assert(state[9] == (0x69 ^ 0xf4));
+    assert(state[10] == (0x6f ^ 0x40));
+    assert(state[11] == (0x47 ^ 0x50));
+    assert(state[12] == (0x61 ^ 0x7a));
+    assert(state[13] == (0x74 ^ 0x80));
+    assert(state[14] == (0x75 ^ 0x35));
+    assert(state[15] == (0x6e ^ 0x3e));
 
     /////////////// TEST SUBBYTES ///////////////
 
-    for (int i = 0; i < 16; i++) m_state[i] = state1[i];
-    subBytes();
+    for (int i = 0; i < 16; i++) state[i] = state1[i];
+    subBytes(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == subbedState1[i]);
+        assert(state[i] == subbedState1[i]);
     }
-    invSubBytes();
+    invSubBytes(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state1[i]);
+        assert(state[i] == state1[i]);
     }
 
-    for (int i = 0; i < 16; i++) m_state[i] = state2[i];
-    subBytes();
+    for (int i = 0; i < 16; i++) state[i] = state2[i];
+    subBytes(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == subbedState2[i]);
+        assert(state[i] == subbedState2[i]);
     }
-    invSubBytes();
+    invSubBytes(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state2[i]);
+        assert(state[i] == state2[i]);
+    }
+
+    // The table-free S-box circuit must match the table for every byte
+    for (int x = 0; x < 256; x++)
+    {
+        assert(subByteBitsliced(x) == SBOX[x]);
     }
 
     /////////////// TEST SHIFTROWS ///////////////
 
-    for (int i = 0; i < 16; i++) m_state[i] = state1[i];
-    shiftRows();
+    for (int i = 0; i < 16; i++) state[i] = state1[i];
+    shiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == shiftState1[i]);
+        assert(state[i] == shiftState1[i]);
     }
-    invShiftRows();
+    invShiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state1[i]);
+        assert(state[i] == state1[i]);
     }
 
-    for (int i = 0; i < 16; i++) m_state[i] = state2[i];
-    shiftRows();
+    for (int i = 0; i < 16; i++) state[i] = state2[i];
+    shiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == shiftState2[i]);
+        assert(state[i] == shiftState2[i]);
     }
-    invShiftRows();
+    invShiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state2[i]);
+        assert(state[i] == state2[i]);
     }
 
-    for (int i = 0; i < 16; i++) m_state[i] = state3[i];
-    shiftRows();
+    for (int i = 0; i < 16; i++) state[i] = state3[i];
+    shiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == shiftState3[i]);
+        assert(state[i] == shiftState3[i]);
     }
-    invShiftRows();
+    invShiftRows(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state3[i]);
+        assert(state[i] == state3[i]);
     }
 
     /////////////// TEST MIXCOLUMNS ///////////////
 
-    for (int i = 0; i < 16; i++) m_state[i] = state4[i];
-    mixColumns();
+    for (int i = 0; i < 16; i++) state[i] = state4[i];
+    mixColumns(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == mixColState4[i]);
+        assert(state[i] == mixColState4[i]);
     }
-    invMixColumns();
+    invMixColumns(state);
     for (int i = 0; i < 16; i++)
     {
-        assert(m_state[i] == state4[i]);
+        assert(state[i] == state4[i]);
     }
 }
 
@@ -679,3 +763,1308 @@ void AES::testMalformedCiphertext(const std::string& ciphertextFilename)
     ciphertextFile.close();
     std::filesystem::remove(plaintextFilename);
 }
+
+void AES::testMultiBlock()
+{
+    // Try every block count up to a few past twice the widest kernel's batch (16 blocks for VAES512),
+    // so each combination of full and leftover batches gets used.
+    for (int keySize : {16, 24, 32})
+    {
+        std::vector<uint8_t> key;
+        getRandomKey(key, keySize);
+        assert(keyExpansion(key));
+
+        for (size_t numBlocks = 0; numBlocks <= 37; numBlocks++)
+        {
+            std::vector<uint8_t> input(16 * numBlocks);
+            for (auto& byte : input) byte = rand() % 256;
+            std::array<uint8_t, 16> iv;
+            for (auto& byte : iv) byte = rand() % 256;
+
+            // Expected output, one block at a time
+            std::vector<uint8_t> ecbEncrypted(input.size());
+            std::vector<uint8_t> ecbDecrypted(input.size());
+            std::vector<uint8_t> cbcDecrypted(input.size());
+            for (size_t b = 0; b < numBlocks; b++)
+            {
+                encryptBlock(&input[16*b], &ecbEncrypted[16*b]);
+                decryptBlock(&input[16*b], &ecbDecrypted[16*b]);
+                for (int i = 0; i < 16; i++)
+                {
+                    uint8_t prev = (b == 0) ? iv[i] : input[16*(b-1) + i];
+                    cbcDecrypted[16*b + i] = ecbDecrypted[16*b + i] ^ prev;
+                }
+            }
+
+            // Multi-block versions, in place
+            std::vector<uint8_t> output = input;
+            encryptBlocks(output.data(), output.data(), numBlocks);
+            assert(output == ecbEncrypted);
+
+            output = input;
+            decryptBlocks(output.data(), output.data(), numBlocks);
+            assert(output == ecbDecrypted);
+
+            output = input;
+            std::array<uint8_t, 16> chain = iv;
+            decryptBlocksCBC(output.data(), output.data(), numBlocks, chain);
+            assert(output == cbcDecrypted);
+            if (numBlocks > 0)
+            {
+                assert(std::equal(chain.begin(), chain.end(), input.end() - 16));
+            }
+        }
+    }
+}
+
+void AES::testCTR()
+{
+    // NIST SP 800-38A, F.5.1 CTR-AES128.Encrypt
+    const std::vector<uint8_t> key =
+    {0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+    const std::array<uint8_t, 16> counter =
+    {0xf0,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa,0xfb,0xfc,0xfd,0xfe,0xff};
+    const uint8_t plaintext[64] =
+    {0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+     0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+     0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+     0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10};
+    const uint8_t ciphertext[64] =
+    {0x87,0x4d,0x61,0x91,0xb6,0x20,0xe3,0x26,0x1b,0xef,0x68,0x64,0x99,0x0d,0xb6,0xce,
+     0x98,0x06,0xf6,0x6b,0x79,0x70,0xfd,0xff,0x86,0x17,0x18,0x7b,0xb9,0xff,0xfd,0xff,
+     0x5a,0xe4,0xdf,0x3e,0xdb,0xd5,0xd3,0x5e,0x5b,0x4f,0x09,0x02,0x0d,0xb0,0x3e,0xab,
+     0x1e,0x03,0x1d,0xda,0x2f,0xbe,0x03,0xd1,0x79,0x21,0x70,0xa0,0xf3,0x00,0x9c,0xee};
+
+    assert(keyExpansion(key));
+    uint8_t output[64];
+    cryptCTR(plaintext, output, 64, counter);
+    assert(std::equal(output, output + 64, ciphertext));
+    cryptCTR(ciphertext, output, 64, counter);
+    assert(std::equal(output, output + 64, plaintext));
+
+    // Starting partway through, with the counter advanced to match, gives the same keystream
+    std::array<uint8_t, 16> laterCounter = counter;
+    addToCounter(laterCounter, 2);
+    cryptCTR(plaintext + 32, output, 32, laterCounter);
+    assert(std::equal(output, output + 32, ciphertext + 32));
+
+    // A partial final block only uses part of the keystream
+    cryptCTR(plaintext, output, 21, counter);
+    assert(std::equal(output, output + 21, ciphertext));
+
+    // The counter carries all the way across the block
+    std::array<uint8_t, 16> carried;
+    carried.fill(0xff);
+    addToCounter(carried, 1);
+    for (uint8_t byte : carried) assert(byte == 0);
+    carried = {0,0,0,0,0,0,0,0,0x00,0xff,0xff,0xff,0xff,0xff,0xff,0xfe};
+    addToCounter(carried, 0x1000003);
+    const std::array<uint8_t, 16> expected = {0,0,0,0,0,0,0,0,0x01,0x00,0x00,0x00,0x01,0x00,0x00,0x01};
+    assert(carried == expected);
+}
+
+void AES::testGCM()
+{
+    // Encrypts and decrypts with the GCM building blocks, checking the ciphertext and tag.
+    // An empty 'ciphertext' means only the tag is known, so only encryption is checked.
+    auto checkVector = [this](const std::vector<uint8_t>& key, const std::vector<uint8_t>& nonce,
+                              const std::vector<uint8_t>& aad, const std::vector<uint8_t>& plaintext,
+                              const std::vector<uint8_t>& ciphertext, const std::vector<uint8_t>& tag)
+    {
+        assert(keyExpansion(key));
+        GHashKey hashKey;
+        initGHash(hashKey);
+        std::array<uint8_t, 16> j0 = {};
+        std::copy(nonce.begin(), nonce.end(), j0.begin());
+        j0[15] = 1;
+
+        for (bool decrypting : {false, true})
+        {
+            if (decrypting && ciphertext.empty() && !plaintext.empty())
+            {
+                continue;
+            }
+            const std::vector<uint8_t>& input = decrypting ? ciphertext : plaintext;
+            const std::vector<uint8_t>& expected = decrypting ? plaintext : ciphertext;
+            std::vector<uint8_t> output(input.size());
+            std::array<uint8_t, 16> x = {};
+            ghash(hashKey, x, aad.data(), aad.size());
+            std::array<uint8_t, 16> counter = j0;
+            addToCounter(counter, 1);
+            cryptGCM(input.data(), output.data(), input.size(), counter, x, hashKey, decrypting);
+            assert(output == expected || ciphertext.empty());
+            std::array<uint8_t, 16> outTag;
+            finishGCM(hashKey, x, aad.size(), input.size(), j0, outTag.data());
+            assert(std::equal(tag.begin(), tag.end(), outTag.begin()));
+        }
+    };
+
+    // Test cases 2, 4, and 16 from McGrew and Viega, "The Galois/Counter Mode of Operation"
+    checkVector(std::vector<uint8_t>(16, 0), std::vector<uint8_t>(12, 0), {}, std::vector<uint8_t>(16, 0),
+        {0x03,0x88,0xda,0xce,0x60,0xb6,0xa3,0x92,0xf3,0x28,0xc2,0xb9,0x71,0xb2,0xfe,0x78},
+        {0xab,0x6e,0x47,0xd4,0x2c,0xec,0x13,0xbd,0xf5,0x3a,0x67,0xb2,0x12,0x57,0xbd,0xdf});
+    const std::vector<uint8_t> nonce = {0xca,0xfe,0xba,0xbe,0xfa,0xce,0xdb,0xad,0xde,0xca,0xf8,0x88};
+    const std::vector<uint8_t> aad =
+    {0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,0xfe,0xed,0xfa,0xce,0xde,0xad,0xbe,0xef,0xab,0xad,0xda,0xd2};
+    const std::vector<uint8_t> plaintext =
+    {0xd9,0x31,0x32,0x25,0xf8,0x84,0x06,0xe5,0xa5,0x59,0x09,0xc5,0xaf,0xf5,0x26,0x9a,
+     0x86,0xa7,0xa9,0x53,0x15,0x34,0xf7,0xda,0x2e,0x4c,0x30,0x3d,0x8a,0x31,0x8a,0x72,
+     0x1c,0x3c,0x0c,0x95,0x95,0x68,0x09,0x53,0x2f,0xcf,0x0e,0x24,0x49,0xa6,0xb5,0x25,
+     0xb1,0x6a,0xed,0xf5,0xaa,0x0d,0xe6,0x57,0xba,0x63,0x7b,0x39};
+    checkVector({0xfe,0xff,0xe9,0x92,0x86,0x65,0x73,0x1c,0x6d,0x6a,0x8f,0x94,0x67,0x30,0x83,0x08},
+        nonce, aad, plaintext,
+        {0x42,0x83,0x1e,0xc2,0x21,0x77,0x74,0x24,0x4b,0x72,0x21,0xb7,0x84,0xd0,0xd4,0x9c,
+         0xe3,0xaa,0x21,0x2f,0x2c,0x02,0xa4,0xe0,0x35,0xc1,0x7e,0x23,0x29,0xac,0xa1,0x2e,
+         0x21,0xd5,0x14,0xb2,0x54,0x66,0x93,0x1c,0x7d,0x8f,0x6a,0x5a,0xac,0x84,0xaa,0x05,
+         0x1b,0xa3,0x0b,0x39,0x6a,0x0a,0xac,0x97,0x3d,0x58,0xe0,0x91},
+        {0x5b,0xc9,0x4f,0xbc,0x32,0x21,0xa5,0xdb,0x94,0xfa,0xe9,0x5a,0xe7,0x12,0x1a,0x47});
+    checkVector({0xfe,0xff,0xe9,0x92,0x86,0x65,0x73,0x1c,0x6d,0x6a,0x8f,0x94,0x67,0x30,0x83,0x08,
+                 0xfe,0xff,0xe9,0x92,0x86,0x65,0x73,0x1c,0x6d,0x6a,0x8f,0x94,0x67,0x30,0x83,0x08},
+        nonce, aad, plaintext,
+        {0x52,0x2d,0xc1,0xf0,0x99,0x56,0x7d,0x07,0xf4,0x7f,0x37,0xa3,0x2a,0x84,0x42,0x7d,
+         0x64,0x3a,0x8c,0xdc,0xbf,0xe5,0xc0,0xc9,0x75,0x98,0xa2,0xbd,0x25,0x55,0xd1,0xaa,
+         0x8c,0xb0,0x8e,0x48,0x59,0x0d,0xbb,0x3d,0xa7,0xb0,0x8b,0x10,0x56,0x82,0x88,0x38,
+         0xc5,0xf6,0x1e,0x63,0x93,0xba,0x7a,0x0a,0xbc,0xc9,0xf6,0x62},
+        {0x76,0xfc,0x6e,0xce,0x0f,0x4e,0x17,0x68,0xcd,0xdf,0x88,0x53,0xbb,0x2d,0x55,0x1b});
+
+    // A longer message, enough for several passes of the 8-block kernel (tag only)
+    std::vector<uint8_t> longKey(16);
+    std::vector<uint8_t> longNonce(12);
+    std::vector<uint8_t> longText(1000);
+    for (size_t i = 0; i < longKey.size(); i++) longKey[i] = static_cast<uint8_t>(i);
+    for (size_t i = 0; i < longNonce.size(); i++) longNonce[i] = static_cast<uint8_t>(i);
+    for (size_t i = 0; i < longText.size(); i++) longText[i] = static_cast<uint8_t>(i % 251);
+    checkVector(longKey, longNonce, {0x03}, longText, {},
+        {0xdb,0xd1,0x90,0x78,0x42,0xec,0xe1,0x3d,0x67,0xe4,0x5e,0x12,0xd0,0xc8,0xb9,0xd3});
+
+    // Splitting the message into block-aligned pieces, and the portable and constant-time GHASH,
+    // give the same result
+    GHashKey hashKey;
+    initGHash(hashKey);
+    std::array<uint8_t, 16> start = {1,2,3,4,5,6,7,8,9,10,11,12,0,0,0,2};
+    std::vector<uint8_t> whole(longText.size());
+    std::array<uint8_t, 16> wholeX = {};
+    std::array<uint8_t, 16> counter = start;
+    cryptGCM(longText.data(), whole.data(), longText.size(), counter, wholeX, hashKey, false);
+    for (size_t split : {16, 128, 144, 512, 992})
+    {
+        std::vector<uint8_t> pieces(longText.size());
+        std::array<uint8_t, 16> x = {};
+        counter = start;
+        cryptGCM(longText.data(), pieces.data(), split, counter, x, hashKey, false);
+        cryptGCM(longText.data() + split, pieces.data() + split, longText.size() - split, counter, x, hashKey, false);
+        assert(pieces == whole && x == wholeX);
+    }
+    GHashKey portableKey = hashKey;
+    portableKey.useCLMUL = false;
+    portableKey.constantTime = false;
+    std::vector<uint8_t> portable(longText.size());
+    std::array<uint8_t, 16> portableX = {};
+    counter = start;
+    cryptGCM(longText.data(), portable.data(), longText.size(), counter, portableX, portableKey, false);
+    assert(portable == whole && portableX == wholeX);
+    GHashKey constantTimeKey = portableKey;
+    constantTimeKey.constantTime = true;
+    std::vector<uint8_t> constantTime(longText.size());
+    std::array<uint8_t, 16> constantTimeX = {};
+    counter = start;
+    cryptGCM(longText.data(), constantTime.data(), longText.size(), counter, constantTimeX, constantTimeKey, false);
+    assert(constantTime == whole && constantTimeX == wholeX);
+
+    // Through the stream API, any change to the nonce, ciphertext, or tag is caught
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    assert(keyExpansion(key));
+    std::string message = "Attack at dawn! The quick brown fox jumps over the lazy dog.";
+    std::stringstream plainStream(message);
+    std::stringstream cipherStream;
+    encrypt(plainStream, cipherStream, Mode::GCM);
+    std::string sealed = cipherStream.str();
+    assert(sealed.size() == 1 + 12 + message.size() + 16);
+    {
+        std::stringstream in(sealed);
+        std::stringstream out;
+        decrypt(in, out);
+        assert(out.str() == message);
+    }
+    // (Except the mode byte: changing it to another mode decrypts without authentication at all.)
+    for (size_t i = 1; i <= sealed.size(); i++)
+    {
+        // Flip a bit of each byte in turn, and finally drop the last byte
+        std::string tampered = sealed;
+        if (i < sealed.size())
+        {
+            tampered[i] ^= 0x01;
+        }
+        else
+        {
+            tampered.pop_back();
+        }
+        std::stringstream in(tampered);
+        std::stringstream out;
+        bool foundException = false;
+        try
+        {
+            decrypt(in, out);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+}
+
+void AES::testChunkSizes()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 16);
+    assert(keyExpansion(key));
+
+    // Chunk sizes have to be whole blocks
+    for (size_t badSize : {0, 8, 24})
+    {
+        bool foundException = false;
+        try
+        {
+            setChunkSize(badSize);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+
+    // Encrypt with one chunk size and decrypt with another, with messages that do and don't
+    // end on a chunk boundary
+    for (size_t length : {0, 15, 16, 48, 1000, 4096, 5000})
+    {
+        std::string message(length, '\0');
+        for (char& c : message) c = static_cast<char>(rand() % 256);
+        for (Mode mode : {Mode::ECB, Mode::CBC, Mode::CTR, Mode::GCM})
+        {
+            for (size_t encryptChunk : {16, 48, 4096})
+            {
+                setChunkSize(encryptChunk);
+                std::stringstream plainStream(message);
+                std::stringstream cipherStream;
+                encrypt(plainStream, cipherStream, mode);
+
+                setChunkSize(encryptChunk == 16 ? 4096 : 16);
+                std::stringstream decrypted;
+                decrypt(cipherStream, decrypted);
+                assert(decrypted.str() == message);
+            }
+        }
+    }
+    setChunkSize(DEFAULT_CHUNK_SIZE);
+}
+
+void AES::testMappedFiles()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 24);
+    assert(keyExpansion(key));
+
+    auto readFile = [](const std::string& filename)
+    {
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    auto writeFile = [](const std::string& filename, const std::string& contents)
+    {
+        std::ofstream file(filename, std::ios::out | std::ios::binary);
+        file.write(contents.data(), contents.size());
+    };
+
+    std::string plaintextFilename = "plaintext.tmp";
+    std::string ciphertextFilename = "ciphertext.tmp";
+    std::string finalPlaintextFilename = "finalPlaintext.tmp";
+    for (size_t length : {0, 1, 16, 5000, 100000})
+    {
+        std::string message(length, '\0');
+        for (char& c : message) c = static_cast<char>(rand() % 256);
+        writeFile(plaintextFilename, message);
+
+        for (Mode mode : {Mode::ECB, Mode::CBC, Mode::CTR, Mode::GCM})
+        {
+            // Mapped encryption, streamed decryption
+            assert(encryptFile(plaintextFilename, ciphertextFilename, mode));
+            std::string ciphertext = readFile(ciphertextFilename);
+            assert(ciphertext.size() == encryptedSize(length, mode));
+            std::stringstream cipherStream(ciphertext);
+            std::stringstream decrypted;
+            decrypt(cipherStream, decrypted);
+            assert(decrypted.str() == message);
+
+            // Streamed encryption, mapped decryption
+            std::stringstream plainStream(message);
+            std::stringstream encrypted;
+            encrypt(plainStream, encrypted, mode);
+            writeFile(ciphertextFilename, encrypted.str());
+            assert(decryptFile(ciphertextFilename, finalPlaintextFilename));
+            assert(readFile(finalPlaintextFilename) == message);
+        }
+    }
+
+    // Malformed ciphertext throws, as with the stream API
+    for (const std::string& malformed : {std::string(), std::string("\x01", 1), std::string("\x03", 1), std::string(20, '\0')})
+    {
+        writeFile(ciphertextFilename, malformed);
+        bool foundException = false;
+        try
+        {
+            decryptFile(ciphertextFilename, finalPlaintextFilename);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+
+    std::filesystem::remove(plaintextFilename);
+    std::filesystem::remove(ciphertextFilename);
+    std::filesystem::remove(finalPlaintextFilename);
+}
+
+void AES::testSpans()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    assert(keyExpansion(key));
+
+    // Sizes on both sides of MIN_TASK_SIZE, so both the inline and threaded paths are covered
+    for (size_t length : std::initializer_list<size_t>{0, 1, 15, 16, 17, 1000, MIN_TASK_SIZE, MIN_TASK_SIZE + 16, 3 * MIN_TASK_SIZE + 5})
+    {
+        std::vector<uint8_t> message(length);
+        for (uint8_t& b : message) b = static_cast<uint8_t>(rand() % 256);
+        std::string messageString(message.begin(), message.end());
+
+        for (Mode mode : {Mode::ECB, Mode::CBC, Mode::CTR, Mode::GCM})
+        {
+            std::vector<uint8_t> ciphertext(encryptedSize(length, mode));
+            assert(encrypt(message, ciphertext, mode) == ciphertext.size());
+
+            // ECB has no IV, so the span and stream APIs must agree byte for byte
+            std::stringstream plainStream(messageString);
+            std::stringstream cipherStream;
+            encrypt(plainStream, cipherStream, mode);
+            assert(cipherStream.str().size() == ciphertext.size());
+            if (mode == Mode::ECB)
+            {
+                assert(cipherStream.str() == std::string(ciphertext.begin(), ciphertext.end()));
+            }
+
+            // Each API decrypts what the other encrypted
+            std::stringstream spanCipherStream(std::string(ciphertext.begin(), ciphertext.end()));
+            std::stringstream decryptedStream;
+            decrypt(spanCipherStream, decryptedStream);
+            assert(decryptedStream.str() == messageString);
+
+            std::string streamCiphertext = cipherStream.str();
+            std::span<const uint8_t> streamSpan(reinterpret_cast<const uint8_t*>(streamCiphertext.data()), streamCiphertext.size());
+            std::vector<uint8_t> decrypted(decryptedSizeBound(streamSpan));
+            assert(decrypted.size() >= length && decrypted.size() <= length + 16);
+            decrypted.resize(decrypt(streamSpan, decrypted));
+            assert(decrypted == message);
+
+            // Output spans that are too small throw rather than overrun
+            bool foundException = false;
+            try
+            {
+                encrypt(message, std::span<uint8_t>(ciphertext.data(), ciphertext.size() - 1), mode);
+            }
+            catch (const std::invalid_argument& e)
+            {
+                foundException = true;
+            }
+            assert(foundException);
+            if (decryptedSizeBound(ciphertext) > 0)
+            {
+                foundException = false;
+                try
+                {
+                    decrypt(ciphertext, std::span<uint8_t>(decrypted.data(), decryptedSizeBound(ciphertext) - 1));
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    foundException = true;
+                }
+                assert(foundException);
+            }
+        }
+    }
+}
+
+void AES::testIncremental()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 16);
+    assert(keyExpansion(key));
+
+    // Splits 'input' into random pieces of up to maxPiece bytes (some of them empty), feeds them
+    // to 'context', and returns everything it writes
+    auto feed = [](auto& context, const std::vector<uint8_t>& input, size_t maxPiece)
+    {
+        std::vector<uint8_t> output;
+        size_t offset = 0;
+        while (offset < input.size())
+        {
+            size_t piece = std::min<size_t>(rand() % (maxPiece + 1), input.size() - offset);
+            size_t start = output.size();
+            output.resize(start + piece + Encryptor::MAX_OVERHEAD);
+            size_t written = context.update(std::span<const uint8_t>(input.data() + offset, piece),
+                                            std::span<uint8_t>(output.data() + start, piece + Encryptor::MAX_OVERHEAD));
+            output.resize(start + written);
+            offset += piece;
+        }
+        size_t start = output.size();
+        output.resize(start + Encryptor::MAX_OVERHEAD);
+        output.resize(start + context.finalize(std::span<uint8_t>(output.data() + start, Encryptor::MAX_OVERHEAD)));
+        return output;
+    };
+
+    for (size_t length : std::initializer_list<size_t>{0, 1, 15, 16, 17, 31, 32, 33, 1000, 4096, MIN_TASK_SIZE + 5})
+    {
+        std::vector<uint8_t> message(length);
+        for (uint8_t& b : message) b = static_cast<uint8_t>(rand() % 256);
+
+        for (Mode mode : {Mode::ECB, Mode::CBC, Mode::CTR, Mode::GCM})
+        {
+            for (size_t maxPiece : std::initializer_list<size_t>{1, 7, 16, 100, 100000})
+            {
+                // Incremental encryption, one-shot decryption
+                Encryptor encryptor(*this, mode);
+                std::vector<uint8_t> ciphertext = feed(encryptor, message, maxPiece);
+                assert(ciphertext.size() == encryptedSize(length, mode));
+                std::vector<uint8_t> decrypted(decryptedSizeBound(ciphertext));
+                decrypted.resize(decrypt(ciphertext, decrypted));
+                assert(decrypted == message);
+                if (mode == Mode::ECB)
+                {
+                    std::vector<uint8_t> expected(ciphertext.size());
+                    encrypt(message, expected, mode);
+                    assert(ciphertext == expected);
+                }
+
+                // One-shot encryption, incremental decryption
+                std::vector<uint8_t> oneShot(encryptedSize(length, mode));
+                encrypt(message, oneShot, mode);
+                Decryptor decryptor(*this);
+                assert(feed(decryptor, oneShot, maxPiece) == message);
+            }
+        }
+    }
+
+    // Malformed ciphertext throws from update or finalize
+    std::vector<uint8_t> message(100, 'a');
+    std::vector<uint8_t> gcm(encryptedSize(message.size(), Mode::GCM));
+    encrypt(message, gcm, Mode::GCM);
+    std::vector<uint8_t> tampered = gcm;
+    tampered[50] ^= 1;
+    std::vector<uint8_t> cbc(encryptedSize(message.size(), Mode::CBC));
+    encrypt(message, cbc, Mode::CBC);
+    std::vector<uint8_t> truncatedCBC(cbc.begin(), cbc.end() - 1);
+    std::vector<uint8_t> truncatedHeader(cbc.begin(), cbc.begin() + 10);
+    std::vector<uint8_t> truncatedGCM(gcm.begin(), gcm.begin() + 20);
+    for (const std::vector<uint8_t>& malformed : {tampered, truncatedCBC, truncatedHeader, truncatedGCM,
+                                                  std::vector<uint8_t>(), std::vector<uint8_t>(20, 0x07)})
+    {
+        bool foundException = false;
+        try
+        {
+            Decryptor decryptor(*this);
+            feed(decryptor, malformed, 16);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+
+    // Nothing more can be fed in after finalize
+    Encryptor encryptor(*this, Mode::CBC);
+    std::vector<uint8_t> out(Encryptor::MAX_OVERHEAD);
+    encryptor.finalize(out);
+    bool foundException = false;
+    try
+    {
+        encryptor.update(std::span<const uint8_t>(), out);
+    }
+    catch (const std::logic_error& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+}
+
+void AES::testSharedKeySchedule()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    std::shared_ptr<const KeySchedule> schedule = expandKey(key, m_backend);
+    assert(schedule->backend() == m_backend);
+
+    // Objects sharing a schedule are interchangeable with one that expanded the key itself
+    std::vector<uint8_t> message(5000);
+    for (uint8_t& b : message) b = static_cast<uint8_t>(rand() % 256);
+    AES own(key, m_backend);
+    AES shared(schedule);
+    std::vector<uint8_t> ciphertext(encryptedSize(message.size(), Mode::CBC));
+    shared.encrypt(message, ciphertext, Mode::CBC);
+    std::vector<uint8_t> decrypted(decryptedSizeBound(ciphertext));
+    decrypted.resize(own.decrypt(ciphertext, decrypted));
+    assert(decrypted == message);
+
+    // The schedule stays alive for as long as something uses it
+    {
+        AES second(schedule);
+        schedule.reset();
+        std::vector<uint8_t> again(decryptedSizeBound(ciphertext));
+        again.resize(second.decrypt(ciphertext, again));
+        assert(again == message);
+    }
+
+    // One object used by several threads at once
+    std::vector<std::thread> threads;
+    std::array<bool, 4> results = {};
+    for (size_t t = 0; t < results.size(); t++)
+    {
+        threads.emplace_back([&shared, &results, t]()
+        {
+            bool ok = true;
+            for (int i = 0; i < 50; i++)
+            {
+                std::vector<uint8_t> text(100 + 37 * t + i, static_cast<uint8_t>(t));
+                Mode mode = static_cast<Mode>((t + i) % 4);
+                std::vector<uint8_t> encrypted(encryptedSize(text.size(), mode));
+                shared.encrypt(text, encrypted, mode);
+                std::vector<uint8_t> plain(decryptedSizeBound(encrypted));
+                plain.resize(shared.decrypt(encrypted, plain));
+                ok = ok && plain == text;
+            }
+            results[t] = ok;
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    for (bool ok : results) assert(ok);
+
+    // Bad keys and missing schedules are rejected
+    for (size_t badSize : {0, 15, 20, 33})
+    {
+        std::vector<uint8_t> badKey(badSize, 0x42);
+        bool foundException = false;
+        try
+        {
+            expandKey(badKey, m_backend);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+    bool foundException = false;
+    try
+    {
+        AES missing{std::shared_ptr<const KeySchedule>()};
+    }
+    catch (const std::invalid_argument& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+}
+
+void AES::testKeyScheduleCache()
+{
+    KeyScheduleCache cache(3, m_backend);
+    std::vector<std::vector<uint8_t>> keys(5);
+    for (size_t i = 0; i < keys.size(); i++) getRandomKey(keys[i], 16 + 8 * (i % 3));
+
+    // A cached schedule is handed out again, and works like a freshly expanded one
+    std::shared_ptr<const KeySchedule> first = cache.get(keys[0]);
+    assert(cache.get(keys[0]) == first);
+    assert(cache.hits() == 1 && cache.misses() == 1);
+    std::vector<uint8_t> message(100, 'x');
+    std::vector<uint8_t> ciphertext(encryptedSize(message.size(), Mode::CTR));
+    AES(cache.get(keys[0])).encrypt(message, ciphertext, Mode::CTR);
+    std::vector<uint8_t> decrypted(decryptedSizeBound(ciphertext));
+    decrypted.resize(AES(keys[0], m_backend).decrypt(ciphertext, decrypted));
+    assert(decrypted == message);
+
+    // Filling the cache evicts the least recently used key: using keys[0] keeps it, so
+    // keys[1] goes when keys[3] arrives
+    cache.get(keys[1]);
+    cache.get(keys[2]);
+    cache.get(keys[0]);
+    cache.get(keys[3]);
+    assert(cache.size() == 3);
+    uint64_t misses = cache.misses();
+    cache.get(keys[0]);
+    cache.get(keys[2]);
+    cache.get(keys[3]);
+    assert(cache.misses() == misses);
+    cache.get(keys[1]);
+    assert(cache.misses() == misses + 1);
+
+    // Schedules that have been handed out outlive their eviction
+    cache.clear();
+    assert(cache.size() == 0);
+    decrypted.assign(decryptedSizeBound(ciphertext), 0);
+    decrypted.resize(AES(first).decrypt(ciphertext, decrypted));
+    assert(decrypted == message);
+
+    // Keys that differ only in length, or in their last byte, are different keys
+    std::vector<uint8_t> prefix(keys[4].begin(), keys[4].begin() + 16);
+    assert(cache.get(keys[4]) != cache.get(prefix));
+    std::vector<uint8_t> changed = keys[4];
+    changed.back() ^= 1;
+    assert(cache.get(keys[4]) != cache.get(changed));
+
+    bool foundException = false;
+    try
+    {
+        cache.get(std::vector<uint8_t>(20, 0));
+    }
+    catch (const std::invalid_argument& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+}
+
+void AES::testRandomGenerator()
+{
+    // Read in uneven pieces, so reads straddle refills of the buffer. With a tiny rekey interval,
+    // every refill rekeys too. No two 16-byte blocks should match, and every byte value should
+    // turn up about as often as the others.
+    for (uint64_t rekeyBytes : {RandomGenerator::DEFAULT_REKEY_BYTES, uint64_t(16)})
+    {
+        RandomGenerator generator(rekeyBytes);
+        std::vector<uint8_t> output(1 << 16);
+        for (size_t i = 0, length = 1; i < output.size(); i += length, length = length % 37 + 1)
+        {
+            generator.generate(output.data() + i, std::min(length, output.size() - i));
+        }
+        std::vector<std::string> blocks;
+        for (size_t i = 0; i < output.size(); i += 16)
+        {
+            blocks.emplace_back(output.begin() + i, output.begin() + i + 16);
+        }
+        std::sort(blocks.begin(), blocks.end());
+        assert(std::adjacent_find(blocks.begin(), blocks.end()) == blocks.end());
+        std::array<size_t, 256> counts = {};
+        for (uint8_t b : output) counts[b]++;
+        assert(*std::min_element(counts.begin(), counts.end()) > 150);
+        assert(*std::max_element(counts.begin(), counts.end()) < 370);
+    }
+
+    // Separately seeded generators, and reseeding, give different output
+    std::array<uint8_t, 32> a, b, c;
+    RandomGenerator first;
+    RandomGenerator second;
+    first.generate(a.data(), a.size());
+    second.generate(b.data(), b.size());
+    first.reseed();
+    first.generate(c.data(), c.size());
+    assert(a != b && a != c && b != c);
+
+    // IVs differ from call to call, and between threads
+    std::array<uint8_t, 16> iv1, iv2, iv3;
+    randomIV(iv1);
+    randomIV(iv2);
+    std::thread other([&] { randomIV(iv3); });
+    other.join();
+    assert(iv1 != iv2 && iv1 != iv3 && iv2 != iv3);
+}
+
+void AES::testChunked()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    assert(keyExpansion(key));
+
+    // Sizes on both sides of the chunk boundaries, and one big enough to spread over the pool
+    for (size_t chunkSize : {16, 1024})
+    {
+        setChunkSize(chunkSize);
+        for (size_t length : std::initializer_list<size_t>{0, 1, 15, 16, 17, 1023, 1024, 1025, 3 * 1024, 3 * MIN_TASK_SIZE + 5})
+        {
+            std::vector<uint8_t> message(length);
+            for (uint8_t& b : message) b = static_cast<uint8_t>(rand() % 256);
+            std::string messageString(message.begin(), message.end());
+
+            std::vector<uint8_t> ciphertext(encryptedSize(length, Mode::Chunked, chunkSize));
+            assert(encrypt(message, ciphertext, Mode::Chunked) == ciphertext.size());
+            assert(decryptedSizeBound(ciphertext) == length);
+            std::vector<uint8_t> decrypted(length);
+            assert(decrypt(ciphertext, decrypted) == length);
+            assert(decrypted == message);
+
+            // The stream API reads and writes the same format
+            std::stringstream plainStream(messageString);
+            std::stringstream cipherStream;
+            encrypt(plainStream, cipherStream, Mode::Chunked);
+            std::string streamCiphertext = cipherStream.str();
+            assert(streamCiphertext.size() == ciphertext.size());
+            std::span<const uint8_t> streamSpan(reinterpret_cast<const uint8_t*>(streamCiphertext.data()), streamCiphertext.size());
+            std::fill(decrypted.begin(), decrypted.end(), 0);
+            assert(decrypt(streamSpan, decrypted) == length);
+            assert(decrypted == message);
+            std::stringstream spanCipherStream(std::string(ciphertext.begin(), ciphertext.end()));
+            std::stringstream decryptedStream;
+            decrypt(spanCipherStream, decryptedStream);
+            assert(decryptedStream.str() == messageString);
+
+            // Ranges that start and end inside chunks, on their edges, and past the end
+            for (int i = 0; i < 20; i++)
+            {
+                uint64_t offset = rand() % (length + 2);
+                size_t rangeLength = rand() % (2 * chunkSize + 2);
+                if (i == 0)
+                {
+                    offset = chunkSize;
+                    rangeLength = chunkSize;
+                }
+                std::vector<uint8_t> range(rangeLength, 0xAA);
+                size_t written = decryptRange(ciphertext, offset, range);
+                size_t expected = offset < length ? std::min<size_t>(rangeLength, length - offset) : 0;
+                assert(written == expected);
+                assert(std::equal(range.begin(), range.begin() + written, message.begin() + offset));
+            }
+
+            // Changing any chunk, or the header, fails authentication of the chunks it touches,
+            // and the output is zeroed
+            std::vector<size_t> positions = {1, 5, CHUNKED_HEADER_SIZE, ciphertext.size() - 1};
+            for (size_t position : positions)
+            {
+                std::vector<uint8_t> tampered = ciphertext;
+                tampered[position] ^= 0x01;
+                std::fill(decrypted.begin(), decrypted.end(), 0xAA);
+                bool foundException = false;
+                try
+                {
+                    std::vector<uint8_t> out(std::max<size_t>(decryptedSizeBound(tampered), length));
+                    decrypt(tampered, out);
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    foundException = true;
+                }
+                assert(foundException);
+                if (length > 0)
+                {
+                    foundException = false;
+                    try
+                    {
+                        decryptRange(tampered, 0, decrypted);
+                    }
+                    catch (const std::invalid_argument& e)
+                    {
+                        foundException = true;
+                    }
+                    assert(foundException);
+                    assert(std::all_of(decrypted.begin(), decrypted.end(), [](uint8_t b) { return b == 0; }));
+                }
+            }
+
+            // Cutting off whole chunks is caught, since the new last chunk wasn't sealed as the last
+            if (length > chunkSize)
+            {
+                std::vector<uint8_t> truncated(ciphertext.begin(), ciphertext.begin() + CHUNKED_HEADER_SIZE + chunkSize + 16);
+                std::vector<uint8_t> out(chunkSize);
+                bool foundException = false;
+                try
+                {
+                    decrypt(truncated, out);
+                }
+                catch (const std::invalid_argument& e)
+                {
+                    foundException = true;
+                }
+                assert(foundException);
+            }
+        }
+    }
+
+    // Chunked ciphertext isn't for the incremental API
+    bool foundException = false;
+    try
+    {
+        Encryptor encryptor(*this, Mode::Chunked);
+    }
+    catch (const std::invalid_argument& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+}
+
+void AES::testXTS()
+{
+    // IEEE 1619 vectors 2, 15, and 18: whole blocks, then ciphertext stealing with 1 and 4
+    // bytes left over
+    auto checkVector = [this](const std::vector<uint8_t>& key, const std::vector<uint8_t>& tweakKey, uint64_t sector,
+                              const std::vector<uint8_t>& plaintext, const std::vector<uint8_t>& ciphertext)
+    {
+        assert(keyExpansion(key));
+        setTweakKey(tweakKey);
+        setSectorSize(512);
+        std::vector<uint8_t> output(plaintext.size());
+        encryptSectors(plaintext, output, sector);
+        assert(output == ciphertext);
+        decryptSectors(output, output, sector);
+        assert(output == plaintext);
+    };
+    checkVector(std::vector<uint8_t>(16, 0x11), std::vector<uint8_t>(16, 0x22), 0x3333333333, std::vector<uint8_t>(32, 0x44),
+        {0xc4,0x54,0x18,0x5e,0x6a,0x16,0x93,0x6e,0x39,0x33,0x40,0x38,0xac,0xef,0x83,0x8b,
+         0xfb,0x18,0x6f,0xff,0x74,0x80,0xad,0xc4,0x28,0x93,0x82,0xec,0xd6,0xd3,0x94,0xf0});
+    const std::vector<uint8_t> key = {0xff,0xfe,0xfd,0xfc,0xfb,0xfa,0xf9,0xf8,0xf7,0xf6,0xf5,0xf4,0xf3,0xf2,0xf1,0xf0};
+    const std::vector<uint8_t> tweakKey = {0xbf,0xbe,0xbd,0xbc,0xbb,0xba,0xb9,0xb8,0xb7,0xb6,0xb5,0xb4,0xb3,0xb2,0xb1,0xb0};
+    std::vector<uint8_t> plaintext(20);
+    for (size_t i = 0; i < plaintext.size(); i++) plaintext[i] = static_cast<uint8_t>(i);
+    checkVector(key, tweakKey, 0x123456789a, std::vector<uint8_t>(plaintext.begin(), plaintext.begin() + 17),
+        {0x6c,0x16,0x25,0xdb,0x46,0x71,0x52,0x2d,0x3d,0x75,0x99,0x60,0x1d,0xe7,0xca,0x09,0xed});
+    checkVector(key, tweakKey, 0x123456789a, plaintext,
+        {0x9d,0x84,0xc8,0x13,0xf7,0x19,0xaa,0x2c,0x7b,0xe3,0xf6,0x61,0x71,0xc7,0xc5,0xc2,0xed,0xbf,0x9d,0xac});
+
+    // Many sectors at once, on the pool, match each sector done on its own, and a short last
+    // sector is stolen from like any other
+    std::vector<uint8_t> dataKey, otherKey;
+    getRandomKey(dataKey, 32);
+    getRandomKey(otherKey, 32);
+    otherKey[0] = dataKey[0] ^ 1;
+    assert(keyExpansion(dataKey));
+    setTweakKey(otherKey);
+    for (size_t sectorSize : {16, 512, 4096})
+    {
+        setSectorSize(sectorSize);
+        for (size_t length : std::initializer_list<size_t>{16, 17, sectorSize + 16, sectorSize + 20, 3 * MIN_TASK_SIZE + 21})
+        {
+            if (length % sectorSize != 0 && length % sectorSize < 16)
+            {
+                continue;
+            }
+            std::vector<uint8_t> message(length);
+            for (uint8_t& b : message) b = static_cast<uint8_t>(rand() % 256);
+            std::vector<uint8_t> ciphertext(length);
+            encryptSectors(message, ciphertext, 7);
+            for (size_t offset = 0; offset < length; offset += sectorSize)
+            {
+                size_t size = std::min(sectorSize, length - offset);
+                std::vector<uint8_t> sector(size);
+                encryptSectors(std::span<const uint8_t>(message.data() + offset, size), sector, 7 + offset / sectorSize);
+                assert(std::equal(sector.begin(), sector.end(), ciphertext.begin() + offset));
+            }
+
+            // In place, through the stream API, and as the XTS mode of encrypt, which has no header
+            std::vector<uint8_t> decrypted = ciphertext;
+            decryptSectors(decrypted, decrypted, 7);
+            assert(decrypted == message);
+            std::vector<uint8_t> fromZero(encryptedSize(length, Mode::XTS));
+            assert(encrypt(message, fromZero, Mode::XTS) == length);
+            std::stringstream cipherStream(std::string(fromZero.begin(), fromZero.end()));
+            std::stringstream plainStream;
+            decryptSectors(cipherStream, plainStream);
+            assert(plainStream.str() == std::string(message.begin(), message.end()));
+        }
+    }
+
+    // A last sector under a block, a mismatched output, a missing tweak key, and reusing the key
+    // as the tweak key are all rejected
+    std::vector<uint8_t> buffer(512 + 15);
+    auto throws = [](const std::function<void()>& operation)
+    {
+        try
+        {
+            operation();
+        }
+        catch (const std::invalid_argument& e)
+        {
+            return true;
+        }
+        return false;
+    };
+    setSectorSize(512);
+    assert(throws([&] { encryptSectors(buffer, buffer, 0); }));
+    assert(throws([&] { encryptSectors(std::span<const uint8_t>(buffer.data(), 32), std::span<uint8_t>(buffer.data(), 48), 0); }));
+    assert(throws([&] { setTweakKey(dataKey); }));
+    assert(throws([&] { setTweakKey(std::vector<uint8_t>(16, 1)); }));
+    assert(throws([&] { setSectorSize(100); }));
+    cleanup();
+    assert(keyExpansion(dataKey));
+    assert(throws([&] { encryptSectors(std::span<const uint8_t>(buffer.data(), 32), std::span<uint8_t>(buffer.data(), 32), 0); }));
+}
+
+void AES::testCBCBatch()
+{
+    // Messages of every key size and a spread of lengths, more of them than there are lanes, so
+    // lanes are handed new messages at different times. Every other message is encrypted in place.
+    // Each must match encrypting that message on its own.
+    const size_t numJobs = 37;
+    std::vector<std::vector<uint8_t>> messages(numJobs);
+    std::vector<std::vector<uint8_t>> outputs(numJobs);
+    std::vector<CBCJob> jobs(numJobs);
+    std::vector<std::vector<uint8_t>> expected(numJobs);
+    std::vector<std::array<uint8_t, 16>> expectedIVs(numJobs);
+    for (size_t i = 0; i < numJobs; i++)
+    {
+        std::vector<uint8_t> key;
+        getRandomKey(key, 16 + 8 * (i % 3));
+        // Schedules from another backend are encrypted one at a time alongside the rest
+        Backend backend = i % 5 == 4 ? Backend::Portable : m_backend;
+        jobs[i].keySchedule = expandKey(key, backend);
+        for (uint8_t& b : jobs[i].iv) b = static_cast<uint8_t>(rand() % 256);
+        messages[i].resize(16 * ((i * 7) % 23));
+        for (uint8_t& b : messages[i]) b = static_cast<uint8_t>(rand() % 256);
+        outputs[i] = i % 2 == 0 ? messages[i] : std::vector<uint8_t>(messages[i].size());
+        jobs[i].in = i % 2 == 0 ? std::span<const uint8_t>(outputs[i]) : std::span<const uint8_t>(messages[i]);
+        jobs[i].out = outputs[i];
+
+        AES single(jobs[i].keySchedule);
+        expected[i].resize(messages[i].size());
+        expectedIVs[i] = jobs[i].iv;
+        single.encryptBlocksCBC(messages[i].data(), expected[i].data(), messages[i].size() / 16, expectedIVs[i]);
+    }
+    encryptCBCBatch(jobs);
+    for (size_t i = 0; i < numJobs; i++)
+    {
+        assert(outputs[i] == expected[i]);
+        assert(jobs[i].iv == expectedIVs[i]);
+    }
+
+    // Partial blocks, mismatched outputs, and missing schedules are rejected up front
+    std::vector<uint8_t> buffer(48);
+    for (int bad = 0; bad < 3; bad++)
+    {
+        std::vector<CBCJob> badJobs(2);
+        for (CBCJob& job : badJobs)
+        {
+            job.keySchedule = jobs[0].keySchedule;
+            job.iv = {};
+            job.in = std::span<const uint8_t>(buffer.data(), 32);
+            job.out = std::span<uint8_t>(buffer.data(), 32);
+        }
+        if (bad == 0) badJobs[1].in = std::span<const uint8_t>(buffer.data(), 31);
+        if (bad == 1) badJobs[1].out = std::span<uint8_t>(buffer.data(), 48);
+        if (bad == 2) badJobs[1].keySchedule.reset();
+        std::vector<uint8_t> before = buffer;
+        bool foundException = false;
+        try
+        {
+            encryptCBCBatch(badJobs);
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+        assert(buffer == before);
+    }
+}
+
+void AES::testBatch()
+{
+    // Nested parallelFor, as when a batch of files splits each file into chunks, runs every task
+    // exactly once, and an exception thrown by a task comes out of parallelFor
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> hits(16 * 100);
+    pool.parallelFor(16, [&](size_t outer)
+    {
+        pool.parallelFor(100, [&](size_t inner) { hits[outer * 100 + inner]++; });
+    });
+    for (const std::atomic<int>& hit : hits) assert(hit == 1);
+    std::atomic<int> ran{0};
+    bool foundException = false;
+    try
+    {
+        pool.parallelFor(50, [&](size_t i)
+        {
+            ran++;
+            if (i == 7) throw std::runtime_error("task failed");
+        });
+    }
+    catch (const std::runtime_error& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+    assert(ran == 50);
+
+    std::vector<uint8_t> key;
+    getRandomKey(key, 16);
+    assert(keyExpansion(key));
+
+    namespace fs = std::filesystem;
+    auto readFile = [](const fs::path& filename)
+    {
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    auto writeFile = [](const fs::path& filename, const std::string& contents)
+    {
+        std::ofstream file(filename, std::ios::out | std::ios::binary);
+        file.write(contents.data(), contents.size());
+    };
+
+    fs::path root = "batch.tmp";
+    fs::remove_all(root);
+    fs::create_directories(root / "in" / "sub" / "deeper");
+    std::vector<std::pair<fs::path, std::string>> files;
+    for (auto [name, length] : {std::pair<const char*, size_t>{"empty", 0}, {"small", 100}, {"sub/large", 300000},
+                                {"sub/deeper/odd", 4097}})
+    {
+        std::string message(length, '\0');
+        for (char& c : message) c = static_cast<char>(rand() % 256);
+        writeFile(root / "in" / name, message);
+        files.emplace_back(name, message);
+    }
+
+    for (Mode mode : {Mode::CBC, Mode::GCM})
+    {
+        fs::remove_all(root / "enc");
+        fs::remove_all(root / "dec");
+        std::stringstream errors;
+        BatchCrypt::Summary summary = BatchCrypt(*this, true, mode, false).run(
+            BatchCrypt::fromDirectory((root / "in").string(), (root / "enc").string()), errors);
+        assert(summary.files == files.size() && summary.failures == 0);
+        assert(errors.str().empty());
+        for (const auto& [name, message] : files)
+        {
+            assert(fs::file_size(root / "enc" / name) == encryptedSize(message.size(), mode));
+        }
+
+        summary = BatchCrypt(*this, false, mode, false).run(
+            BatchCrypt::fromDirectory((root / "enc").string(), (root / "dec").string()), errors);
+        assert(summary.files == files.size() && summary.failures == 0);
+        for (const auto& [name, message] : files)
+        {
+            assert(readFile(root / "dec" / name) == message);
+        }
+
+        // Existing outputs aren't overwritten without force, and are with it
+        summary = BatchCrypt(*this, false, mode, false).run(
+            BatchCrypt::fromDirectory((root / "enc").string(), (root / "dec").string()), errors);
+        assert(summary.failures == files.size());
+        summary = BatchCrypt(*this, false, mode, true).run(
+            BatchCrypt::fromDirectory((root / "enc").string(), (root / "dec").string()), errors);
+        assert(summary.failures == 0);
+    }
+
+    // A manifest picks out files relative to its own directory, and a file that fails to
+    // decrypt is reported and removed without stopping the rest
+    fs::remove_all(root / "dec");
+    std::string tampered = readFile(root / "enc" / "small");
+    tampered.back() ^= 1;
+    writeFile(root / "enc" / "small", tampered);
+    writeFile(root / "manifest.txt", "enc/small\n\nenc/sub/large\r\n");
+    std::stringstream errors;
+    BatchCrypt::Summary summary = BatchCrypt(*this, false, Mode::GCM, false).run(
+        BatchCrypt::fromManifest((root / "manifest.txt").string(), (root / "dec").string()), errors);
+    assert(summary.files == 2 && summary.failures == 1);
+    assert(!errors.str().empty());
+    assert(!fs::exists(root / "dec" / "enc" / "small"));
+    assert(readFile(root / "dec" / "enc" / "sub" / "large") == files[2].second);
+
+    // A file the cipher rejects leaves no output behind when encrypting either, rather than a
+    // zero-filled file that looks like ciphertext
+    std::vector<uint8_t> tweakKey;
+    do getRandomKey(tweakKey, 16); while (tweakKey == key);
+    setTweakKey(tweakKey);
+    fs::create_directories(root / "tiny");
+    writeFile(root / "tiny" / "tiny", std::string(10, 'x'));
+    summary = BatchCrypt(*this, true, Mode::XTS, false).run(
+        BatchCrypt::fromDirectory((root / "tiny").string(), (root / "tinyEnc").string()), errors);
+    assert(summary.files == 1 && summary.failures == 1);
+    assert(!fs::exists(root / "tinyEnc" / "tiny"));
+    m_tweakCipher.reset();
+
+    for (const std::string& manifest : {std::string("../escape\n"), std::string("enc/small\nenc/../enc/small\n")})
+    {
+        writeFile(root / "manifest.txt", manifest);
+        foundException = false;
+        try
+        {
+            BatchCrypt::fromManifest((root / "manifest.txt").string(), (root / "dec").string());
+        }
+        catch (const std::invalid_argument& e)
+        {
+            foundException = true;
+        }
+        assert(foundException);
+    }
+    fs::remove_all(root);
+}
+
+void AES::testPipeline()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    assert(keyExpansion(key));
+
+    // Every mode gives the same result through the pipeline as without it, however the buffer
+    // size lines up with the chunk size and the message
+    for (size_t bufferSize : {1, 100, 4096})
+    {
+        StreamPipeline pipeline(bufferSize, 2);
+        for (size_t length : {0, 1, 16, 5000, 100000})
+        {
+            std::string message(length, '\0');
+            for (char& c : message) c = static_cast<char>(rand() % 256);
+            for (Mode mode : {Mode::ECB, Mode::CBC, Mode::CTR, Mode::GCM, Mode::Chunked})
+            {
+                std::stringstream plainStream(message);
+                std::stringstream encrypted;
+                pipeline.run(plainStream, encrypted, [&](std::istream& in, std::ostream& out) { encrypt(in, out, mode); });
+                assert(encrypted.str().size() == encryptedSize(length, mode, m_chunkSize));
+
+                std::stringstream decrypted;
+                pipeline.run(encrypted, decrypted, [&](std::istream& in, std::ostream& out) { decrypt(in, out); });
+                assert(decrypted.str() == message);
+            }
+        }
+    }
+
+    // What the cipher throws comes out of run, like a tag that doesn't match
+    StreamPipeline pipeline(1000);
+    std::string message(10000, 'a');
+    std::stringstream plainStream(message);
+    std::stringstream encrypted;
+    pipeline.run(plainStream, encrypted, [&](std::istream& in, std::ostream& out) { encrypt(in, out, Mode::GCM); });
+    std::string tampered = encrypted.str();
+    tampered[20] ^= 1;
+    std::stringstream tamperedStream(tampered);
+    std::stringstream decrypted;
+    bool foundException = false;
+    try
+    {
+        pipeline.run(tamperedStream, decrypted, [&](std::istream& in, std::ostream& out) { decrypt(in, out); });
+    }
+    catch (const std::invalid_argument& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+
+    // An output that can't be written to fails with a runtime_error
+    std::stringstream input(message);
+    std::ostream broken(nullptr);
+    foundException = false;
+    try
+    {
+        pipeline.run(input, broken, [&](std::istream& in, std::ostream& out) { encrypt(in, out, Mode::CBC); });
+    }
+    catch (const std::runtime_error& e)
+    {
+        foundException = true;
+    }
+    assert(foundException);
+}
+
+void AES::testParallelDecrypt()
+{
+    std::vector<uint8_t> key;
+    getRandomKey(key, 32);
+    assert(keyExpansion(key));
+
+    // decryptBlocksParallel splits anything over MIN_TASK_SIZE into one range per pool thread,
+    // seeding each CBC range with the ciphertext block before it, so the ranges' edges have to
+    // match decrypting one block at a time. (On a single-core machine there's only one range.)
+    size_t numBlocks = 5 * MIN_TASK_SIZE / 16 + 3;
+    std::vector<uint8_t> ciphertext(16 * numBlocks);
+    for (uint8_t& b : ciphertext) b = static_cast<uint8_t>(rand() % 256);
+    for (Mode mode : {Mode::ECB, Mode::CBC})
+    {
+        std::array<uint8_t, 16> iv;
+        for (uint8_t& b : iv) b = static_cast<uint8_t>(rand() % 256);
+        std::vector<uint8_t> expected(ciphertext.size());
+        for (size_t i = 0; i < numBlocks; i++)
+        {
+            decryptBlock(ciphertext.data() + 16 * i, expected.data() + 16 * i);
+            const uint8_t* previous = i == 0 ? iv.data() : ciphertext.data() + 16 * (i - 1);
+            for (int j = 0; mode == Mode::CBC && j < 16; j++) expected[16 * i + j] ^= previous[j];
+        }
+
+        std::array<uint8_t, 16> vector = iv;
+        std::vector<uint8_t> decrypted(ciphertext.size());
+        decryptBlocksParallel(ciphertext.data(), decrypted.data(), numBlocks, mode, vector);
+        assert(decrypted == expected);
+        // In place, too, and CBC carries the last ciphertext block on to whatever comes next
+        std::vector<uint8_t> inPlace = ciphertext;
+        std::array<uint8_t, 16> inPlaceVector = iv;
+        decryptBlocksParallel(inPlace.data(), inPlace.data(), numBlocks, mode, inPlaceVector);
+        assert(inPlace == expected);
+        if (mode == Mode::CBC)
+        {
+            assert(std::equal(vector.begin(), vector.end(), ciphertext.end() - 16));
+            assert(inPlaceVector == vector);
+        }
+    }
+
+    // Round trips through the stream and span APIs, with stream chunks that each split into
+    // several ranges. Only the last chunk has padding; random-looking blocks at the end of the
+    // other chunks mustn't be mistaken for it.
+    setChunkSize(3 * MIN_TASK_SIZE);
+    for (size_t length : {5 * MIN_TASK_SIZE + 37, 6 * MIN_TASK_SIZE, 6 * MIN_TASK_SIZE - 16})
+    {
+        std::string message(length, '\0');
+        for (char& c : message) c = static_cast<char>(rand() % 256);
+        for (Mode mode : {Mode::ECB, Mode::CBC})
+        {
+            std::stringstream plainStream(message);
+            std::stringstream encrypted;
+            encrypt(plainStream, encrypted, mode);
+            std::string ciphertextString = encrypted.str();
+
+            std::stringstream decrypted;
+            decrypt(encrypted, decrypted);
+            assert(decrypted.str() == message);
+            std::vector<uint8_t> plaintext(ciphertextString.size());
+            size_t size = decrypt(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(ciphertextString.data()),
+                                                           ciphertextString.size()), plaintext);
+            assert(std::string(plaintext.begin(), plaintext.begin() + size) == message);
+
+            if (mode == Mode::ECB)
+            {
+                // The span API splits ECB encryption into ranges too, and ECB has no IV, so it
+                // has to match the stream API byte for byte
+                std::vector<uint8_t> spanCiphertext(encryptedSize(length, mode));
+                encrypt(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(message.data()), length),
+                        spanCiphertext, mode);
+                assert(std::string(spanCiphertext.begin(), spanCiphertext.end()) == ciphertextString);
+                continue;
+            }
+            // Flipping the top bit of the second-to-last block's last byte flips the top bit of
+            // the padding length, which makes it invalid, so both APIs must throw
+            std::string tampered = ciphertextString;
+            tampered[tampered.size() - 17] ^= 0x80;
+            bool foundException = false;
+            try
+            {
+                std::stringstream tamperedStream(tampered);
+                std::stringstream output;
+                decrypt(tamperedStream, output);
+            }
+            catch (const std::invalid_argument& e)
+            {
+                foundException = true;
+            }
+            assert(foundException);
+            foundException = false;
+            try
+            {
+                decrypt(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(tampered.data()), tampered.size()), plaintext);
+            }
+            catch (const std::invalid_argument& e)
+            {
+                foundException = true;
+            }
+            assert(foundException);
+        }
+    }
+    setChunkSize(DEFAULT_CHUNK_SIZE);
+}
@@ -0,0 +1,467 @@
+#include "aes.h"
+#include <algorithm>
+
+// The constant-time bitsliced backend for AES is implemented here, rather than in aes.cpp.
+//
+// Instead of looking bytes up in tables (which leaks the bytes through cache timing), the state
+// of 4 blocks is transposed so that q[i] holds bit i of all 64 bytes, and each AES step is done
+// with nothing but AND, XOR, NOT, shifts, and rotations on those eight 64-bit words.
+// The layout follows Thomas Pornin's "ct64" implementation in BearSSL: within each word, each
+// block's bytes are spread out so that ShiftRows and MixColumns become shifts and rotations.
+// The S-box is the 113-gate circuit of Boyar and Peralta, "A new combinational logic minimization
+// technique with applications to cryptology" (https://eprint.iacr.org/2009/191.pdf).
+
+// Applies the S-box to all 64 bytes held in q. q[0] holds the low bit of each byte.
+static void bitslicedSbox(uint64_t* q)
+{
+    // Boyar and Peralta number the bits the other way around: x0 is the high bit
+    uint64_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    uint64_t x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // Top linear transformation
+    uint64_t y14 = x3 ^ x5;
+    uint64_t y13 = x0 ^ x6;
+    uint64_t y9 = x0 ^ x3;
+    uint64_t y8 = x0 ^ x5;
+    uint64_t t0 = x1 ^ x2;
+    uint64_t y1 = t0 ^ x7;
+    uint64_t y4 = y1 ^ x3;
+    uint64_t y12 = y13 ^ y14;
+    uint64_t y2 = y1 ^ x0;
+    uint64_t y5 = y1 ^ x6;
+    uint64_t y3 = y5 ^ y8;
+    uint64_t t1 = x4 ^ y12;
+    uint64_t y15 = t1 ^ x5;
+    uint64_t y20 = t1 ^ x1;
+    uint64_t y6 = y15 ^ x7;
+    uint64_t y10 = y15 ^ t0;
+    uint64_t y11 = y20 ^ y9;
+    uint64_t y7 = x7 ^ y11;
+    uint64_t y17 = y10 ^ y11;
+    uint64_t y19 = y10 ^ y8;
+    uint64_t y16 = t0 ^ y11;
+    uint64_t y21 = y13 ^ y16;
+    uint64_t y18 = x0 ^ y16;
+
+    // Non-linear section (the inversion in GF(2^8))
+    uint64_t t2 = y12 & y15;
+    uint64_t t3 = y3 & y6;
+    uint64_t t4 = t3 ^ t2;
+    uint64_t t5 = y4 & x7;
+    uint64_t t6 = t5 ^ t2;
+    uint64_t t7 = y13 & y16;
+    uint64_t t8 = y5 & y1;
+    uint64_t t9 = t8 ^ t7;
+    uint64_t t10 = y2 & y7;
+    uint64_t t11 = t10 ^ t7;
+    uint64_t t12 = y9 & y11;
+    uint64_t t13 = y14 & y17;
+    uint64_t t14 = t13 ^ t12;
+    uint64_t t15 = y8 & y10;
+    uint64_t t16 = t15 ^ t12;
+    uint64_t t17 = t4 ^ t14;
+    uint64_t t18 = t6 ^ t16;
+    uint64_t t19 = t9 ^ t14;
+    uint64_t t20 = t11 ^ t16;
+    uint64_t t21 = t17 ^ y20;
+    uint64_t t22 = t18 ^ y19;
+    uint64_t t23 = t19 ^ y21;
+    uint64_t t24 = t20 ^ y18;
+
+    uint64_t t25 = t21 ^ t22;
+    uint64_t t26 = t21 & t23;
+    uint64_t t27 = t24 ^ t26;
+    uint64_t t28 = t25 & t27;
+    uint64_t t29 = t28 ^ t22;
+    uint64_t t30 = t23 ^ t24;
+    uint64_t t31 = t22 ^ t26;
+    uint64_t t32 = t31 & t30;
+    uint64_t t33 = t32 ^ t24;
+    uint64_t t34 = t23 ^ t33;
+    uint64_t t35 = t27 ^ t33;
+    uint64_t t36 = t24 & t35;
+    uint64_t t37 = t36 ^ t34;
+    uint64_t t38 = t27 ^ t36;
+    uint64_t t39 = t29 & t38;
+    uint64_t t40 = t25 ^ t39;
+
+    uint64_t t41 = t40 ^ t37;
+    uint64_t t42 = t29 ^ t33;
+    uint64_t t43 = t29 ^ t40;
+    uint64_t t44 = t33 ^ t37;
+    uint64_t t45 = t42 ^ t41;
+    uint64_t z0 = t44 & y15;
+    uint64_t z1 = t37 & y6;
+    uint64_t z2 = t33 & x7;
+    uint64_t z3 = t43 & y16;
+    uint64_t z4 = t40 & y1;
+    uint64_t z5 = t29 & y7;
+    uint64_t z6 = t42 & y11;
+    uint64_t z7 = t45 & y17;
+    uint64_t z8 = t41 & y10;
+    uint64_t z9 = t44 & y12;
+    uint64_t z10 = t37 & y3;
+    uint64_t z11 = t33 & y4;
+    uint64_t z12 = t43 & y13;
+    uint64_t z13 = t40 & y5;
+    uint64_t z14 = t29 & y2;
+    uint64_t z15 = t42 & y9;
+    uint64_t z16 = t45 & y14;
+    uint64_t z17 = t41 & y8;
+
+    // Bottom linear transformation
+    uint64_t t46 = z15 ^ z16;
+    uint64_t t47 = z10 ^ z11;
+    uint64_t t48 = z5 ^ z13;
+    uint64_t t49 = z9 ^ z10;
+    uint64_t t50 = z2 ^ z12;
+    uint64_t t51 = z2 ^ z5;
+    uint64_t t52 = z7 ^ z8;
+    uint64_t t53 = z0 ^ z3;
+    uint64_t t54 = z6 ^ z7;
+    uint64_t t55 = z16 ^ z17;
+    uint64_t t56 = z12 ^ t48;
+    uint64_t t57 = t50 ^ t53;
+    uint64_t t58 = z4 ^ t46;
+    uint64_t t59 = z3 ^ t54;
+    uint64_t t60 = t46 ^ t57;
+    uint64_t t61 = z14 ^ t57;
+    uint64_t t62 = t52 ^ t58;
+    uint64_t t63 = t49 ^ t58;
+    uint64_t t64 = z4 ^ t59;
+    uint64_t t65 = t61 ^ t62;
+    uint64_t t66 = z1 ^ t63;
+    uint64_t s0 = t59 ^ t63;
+    uint64_t s6 = t56 ^ ~t62;
+    uint64_t s7 = t48 ^ ~t60;
+    uint64_t t67 = t64 ^ t65;
+    uint64_t s3 = t53 ^ t66;
+    uint64_t s4 = t51 ^ t66;
+    uint64_t s5 = t47 ^ t65;
+    uint64_t s1 = t64 ^ ~s3;
+    uint64_t s2 = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+// The inverse of the S-box's affine transformation. Since S(x) = A(x^-1), the inverse S-box is
+// S^-1(x) = A^-1(S(A^-1(x))), which lets decryption reuse the forward circuit.
+static void bitslicedInvAffine(uint64_t* q)
+{
+    uint64_t q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+    uint64_t q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+static void bitslicedInvSbox(uint64_t* q)
+{
+    bitslicedInvAffine(q);
+    bitslicedSbox(q);
+    bitslicedInvAffine(q);
+}
+
+// Swaps bit groups between two words; applied three times, it transposes 8x8 bit matrices
+static inline void swapBits(uint64_t& x, uint64_t& y, uint64_t lowMask, int shift)
+{
+    uint64_t a = x;
+    uint64_t b = y;
+    x = (a & lowMask) | ((b & lowMask) << shift);
+    y = ((a & ~lowMask) >> shift) | (b & ~lowMask);
+}
+
+// Converts between "each word holds some bytes" and "each word holds one bit of every byte".
+// This is its own inverse.
+static void orthogonalize(uint64_t* q)
+{
+    const uint64_t m1 = 0x5555555555555555ULL;
+    const uint64_t m2 = 0x3333333333333333ULL;
+    const uint64_t m4 = 0x0F0F0F0F0F0F0F0FULL;
+    swapBits(q[0], q[1], m1, 1);
+    swapBits(q[2], q[3], m1, 1);
+    swapBits(q[4], q[5], m1, 1);
+    swapBits(q[6], q[7], m1, 1);
+    swapBits(q[0], q[2], m2, 2);
+    swapBits(q[1], q[3], m2, 2);
+    swapBits(q[4], q[6], m2, 2);
+    swapBits(q[5], q[7], m2, 2);
+    swapBits(q[0], q[4], m4, 4);
+    swapBits(q[1], q[5], m4, 4);
+    swapBits(q[2], q[6], m4, 4);
+    swapBits(q[3], q[7], m4, 4);
+}
+
+static inline uint32_t loadLittleEndian(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void storeLittleEndian(uint8_t* p, uint32_t w)
+{
+    p[0] = static_cast<uint8_t>(w);
+    p[1] = static_cast<uint8_t>(w >> 8);
+    p[2] = static_cast<uint8_t>(w >> 16);
+    p[3] = static_cast<uint8_t>(w >> 24);
+}
+
+// Spreads one 16-byte block over two words, so that after orthogonalize() the bytes of each row
+// of the AES state sit next to each other.
+static void interleaveIn(uint64_t& q0, uint64_t& q1, const uint8_t* block)
+{
+    uint64_t x[4];
+    for (int i = 0; i < 4; i++)
+    {
+        x[i] = loadLittleEndian(block + 4*i);
+        x[i] |= (x[i] << 16);
+        x[i] &= 0x0000FFFF0000FFFFULL;
+        x[i] |= (x[i] << 8);
+        x[i] &= 0x00FF00FF00FF00FFULL;
+    }
+    q0 = x[0] | (x[2] << 8);
+    q1 = x[1] | (x[3] << 8);
+}
+
+static void interleaveOut(uint8_t* block, uint64_t q0, uint64_t q1)
+{
+    uint64_t x[4];
+    x[0] = q0 & 0x00FF00FF00FF00FFULL;
+    x[1] = q1 & 0x00FF00FF00FF00FFULL;
+    x[2] = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+    x[3] = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+    for (int i = 0; i < 4; i++)
+    {
+        x[i] |= (x[i] >> 8);
+        x[i] &= 0x0000FFFF0000FFFFULL;
+        storeLittleEndian(block + 4*i, static_cast<uint32_t>(x[i]) | static_cast<uint32_t>(x[i] >> 16));
+    }
+}
+
+// Loads 4 blocks into bitsliced form
+static void loadBlocks(uint64_t* q, const uint8_t* blocks)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        interleaveIn(q[i], q[i + 4], blocks + 16*i);
+    }
+    orthogonalize(q);
+}
+
+static void storeBlocks(uint8_t* blocks, uint64_t* q)
+{
+    orthogonalize(q);
+    for (int i = 0; i < 4; i++)
+    {
+        interleaveOut(blocks + 16*i, q[i], q[i + 4]);
+    }
+}
+
+static inline void addRoundKey(uint64_t* q, const uint64_t* roundKey)
+{
+    for (int i = 0; i < 8; i++) q[i] ^= roundKey[i];
+}
+
+// Each 64-bit word holds 16 bits of each row; within a row, each block's 4 bytes are 4-bit groups
+static inline void shiftRows(uint64_t* q)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+             | ((x & 0x00000000FFF00000ULL) >> 4)
+             | ((x & 0x00000000000F0000ULL) << 12)
+             | ((x & 0x0000FF0000000000ULL) >> 8)
+             | ((x & 0x000000FF00000000ULL) << 8)
+             | ((x & 0xF000000000000000ULL) >> 12)
+             | ((x & 0x0FFF000000000000ULL) << 4);
+    }
+}
+
+static inline void invShiftRows(uint64_t* q)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+             | ((x & 0x000000000FFF0000ULL) << 4)
+             | ((x & 0x00000000F0000000ULL) >> 12)
+             | ((x & 0x000000FF00000000ULL) << 8)
+             | ((x & 0x0000FF0000000000ULL) >> 8)
+             | ((x & 0x000F000000000000ULL) << 12)
+             | ((x & 0xFFF0000000000000ULL) >> 4);
+    }
+}
+
+static inline uint64_t rotr32(uint64_t x)
+{
+    return (x << 32) | (x >> 32);
+}
+
+// Rotating a word by 16 bits moves every byte one row down in its column. Multiplying by 2 is a
+// shift from bit i to bit i+1, with q7 (the carry) folded back in at bits 0, 1, 3, and 4 (0x1b).
+static inline void mixColumns(uint64_t* q)
+{
+    uint64_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    uint64_t q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    uint64_t r0 = (q0 >> 16) | (q0 << 48);
+    uint64_t r1 = (q1 >> 16) | (q1 << 48);
+    uint64_t r2 = (q2 >> 16) | (q2 << 48);
+    uint64_t r3 = (q3 >> 16) | (q3 << 48);
+    uint64_t r4 = (q4 >> 16) | (q4 << 48);
+    uint64_t r5 = (q5 >> 16) | (q5 << 48);
+    uint64_t r6 = (q6 >> 16) | (q6 << 48);
+    uint64_t r7 = (q7 >> 16) | (q7 << 48);
+
+    q[0] = q7 ^ r7 ^ r0 ^ rotr32(q0 ^ r0);
+    q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ rotr32(q1 ^ r1);
+    q[2] = q1 ^ r1 ^ r2 ^ rotr32(q2 ^ r2);
+    q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ rotr32(q3 ^ r3);
+    q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ rotr32(q4 ^ r4);
+    q[5] = q4 ^ r4 ^ r5 ^ rotr32(q5 ^ r5);
+    q[6] = q5 ^ r5 ^ r6 ^ rotr32(q6 ^ r6);
+    q[7] = q6 ^ r6 ^ r7 ^ rotr32(q7 ^ r7);
+}
+
+static inline void invMixColumns(uint64_t* q)
+{
+    uint64_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+    uint64_t q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+    uint64_t r0 = (q0 >> 16) | (q0 << 48);
+    uint64_t r1 = (q1 >> 16) | (q1 << 48);
+    uint64_t r2 = (q2 >> 16) | (q2 << 48);
+    uint64_t r3 = (q3 >> 16) | (q3 << 48);
+    uint64_t r4 = (q4 >> 16) | (q4 << 48);
+    uint64_t r5 = (q5 >> 16) | (q5 << 48);
+    uint64_t r6 = (q6 >> 16) | (q6 << 48);
+    uint64_t r7 = (q7 >> 16) | (q7 << 48);
+
+    q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ rotr32(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+    q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^ rotr32(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+    q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^ rotr32(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+    q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5 ^ rotr32(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+    q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7 ^ rotr32(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+    q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7 ^ rotr32(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+    q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7 ^ rotr32(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+    q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^ rotr32(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+static void bitslicedEncrypt(uint64_t* q, const uint64_t* roundKeys, int numRounds)
+{
+    addRoundKey(q, roundKeys);
+    for (int round = 1; round < numRounds; round++)
+    {
+        bitslicedSbox(q);
+        shiftRows(q);
+        mixColumns(q);
+        addRoundKey(q, roundKeys + 8*round);
+    }
+    bitslicedSbox(q);
+    shiftRows(q);
+    addRoundKey(q, roundKeys + 8*numRounds);
+}
+
+static void bitslicedDecrypt(uint64_t* q, const uint64_t* roundKeys, int numRounds)
+{
+    addRoundKey(q, roundKeys + 8*numRounds);
+    for (int round = numRounds - 1; round > 0; round--)
+    {
+        invShiftRows(q);
+        bitslicedInvSbox(q);
+        addRoundKey(q, roundKeys + 8*round);
+        invMixColumns(q);
+    }
+    invShiftRows(q);
+    bitslicedInvSbox(q);
+    addRoundKey(q, roundKeys);
+}
+
+uint8_t AES::subByteBitsliced(uint8_t x)
+{
+    // Put the byte's bits in the low bit of each word, and run the whole circuit for it
+    uint64_t q[8];
+    for (int i = 0; i < 8; i++) q[i] = (x >> i) & 1;
+    bitslicedSbox(q);
+    uint8_t result = 0;
+    for (int i = 0; i < 8; i++) result |= static_cast<uint8_t>((q[i] & 1) << i);
+    return result;
+}
+
+void AES::KeySchedule::bitslice()
+{
+    // Each round key is loaded as if it were 4 copies of a block, so that AddRoundKey
+    // is a plain XOR against the bitsliced state.
+    for (int k = 0; k <= m_rounds; k++)
+    {
+        uint8_t copies[64];
+        for (int i = 0; i < 4; i++)
+        {
+            std::copy(m_roundKeys[k].begin(), m_roundKeys[k].end(), copies + 16*i);
+        }
+        loadBlocks(&m_bitslicedKeys[8*k], copies);
+        std::fill(copies, copies + 64, 0);
+    }
+}
+
+void AES::encryptBlocksBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    int numRounds = m_keys->m_rounds;
+    uint64_t q[8];
+    for (size_t b = 0; b < numBlocks; b += 4)
+    {
+        // A partial batch at the end still runs as 4 blocks, padded out with zeros
+        size_t count = std::min<size_t>(4, numBlocks - b);
+        uint8_t blocks[64] = {0};
+        std::copy(in + 16*b, in + 16*(b + count), blocks);
+        loadBlocks(q, blocks);
+        bitslicedEncrypt(q, m_keys->m_bitslicedKeys.data(), numRounds);
+        storeBlocks(blocks, q);
+        std::copy(blocks, blocks + 16*count, out + 16*b);
+    }
+}
+
+void AES::decryptBlocksBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    int numRounds = m_keys->m_rounds;
+    uint64_t q[8];
+    for (size_t b = 0; b < numBlocks; b += 4)
+    {
+        size_t count = std::min<size_t>(4, numBlocks - b);
+        uint8_t blocks[64] = {0};
+        std::copy(in + 16*b, in + 16*(b + count), blocks);
+        loadBlocks(q, blocks);
+        bitslicedDecrypt(q, m_keys->m_bitslicedKeys.data(), numRounds);
+        storeBlocks(blocks, q);
+        std::copy(blocks, blocks + 16*count, out + 16*b);
+    }
+}
+
+void AES::decryptBlocksCBCBitsliced(const uint8_t* in, uint8_t* out, size_t numBlocks,
+                                    std::array<uint8_t, 16>& iv) const
+{
+    int numRounds = m_keys->m_rounds;
+    uint64_t q[8];
+    for (size_t b = 0; b < numBlocks; b += 4)
+    {
+        // Keep the ciphertext, since it's the chaining value and 'out' may overwrite it
+        size_t count = std::min<size_t>(4, numBlocks - b);
+        uint8_t ciphertext[64] = {0};
+        uint8_t blocks[64];
+        std::copy(in + 16*b, in + 16*(b + count), ciphertext);
+        loadBlocks(q, ciphertext);
+        bitslicedDecrypt(q, m_keys->m_bitslicedKeys.data(), numRounds);
+        storeBlocks(blocks, q);
+        for (size_t i = 0; i < 16*count; i++)
+        {
+            uint8_t prev = (i < 16) ? iv[i] : ciphertext[i - 16];
+            out[16*b + i] = blocks[i] ^ prev;
+        }
+        std::copy(ciphertext + 16*(count - 1), ciphertext + 16*count, iv.begin());
+    }
+}
@@ -0,0 +1,313 @@
+#include "aes.h"
+#include "threadpool.h"
+#include "mappedfile.h"
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+
+// Chunked mode: the message is split into fixed-size chunks, and each is sealed with GCM on its
+// own, so a byte range can be decrypted by opening just the chunks it overlaps. The GHASH and
+// CTR work is done by the GCM code in aesgcm.cpp.
+
+static inline uint32_t loadBigEndian32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// The chunk size from a Chunked header, which must be one that could have been encrypted with
+static size_t headerChunkSize(const uint8_t* header, size_t maxChunkSize)
+{
+    size_t chunkSize = loadBigEndian32(header + 1);
+    if (chunkSize == 0 || chunkSize > maxChunkSize)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Unrecognized header of ciphertext.");
+    }
+    return chunkSize;
+}
+
+AES::ChunkLayout AES::chunkLayout(std::span<const uint8_t> ciphertext)
+{
+    if (ciphertext.empty() || ciphertext[0] != static_cast<uint8_t>(Mode::Chunked))
+    {
+        throw std::invalid_argument("Error: Decryption failed. The ciphertext isn't in chunked mode.");
+    }
+    if (ciphertext.size() < CHUNKED_HEADER_SIZE)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
+    }
+    ChunkLayout layout;
+    layout.chunkSize = headerChunkSize(ciphertext.data(), MAX_CHUNKED_CHUNK_SIZE);
+
+    // Every chunk but the last is the chunk size plus its tag. The last is at least a tag.
+    uint64_t body = ciphertext.size() - CHUNKED_HEADER_SIZE;
+    uint64_t sealedSize = layout.chunkSize + 16;
+    layout.numChunks = std::max<uint64_t>(1, (body + sealedSize - 1) / sealedSize);
+    uint64_t lastSealedSize = body - (layout.numChunks - 1) * sealedSize;
+    if (lastSealedSize < 16)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext is truncated.");
+    }
+    layout.lastChunkSize = static_cast<size_t>(lastSealedSize - 16);
+    layout.plaintextSize = (layout.numChunks - 1) * layout.chunkSize + layout.lastChunkSize;
+    return layout;
+}
+
+void AES::startChunked(uint8_t* header) const
+{
+    if (m_chunkSize > MAX_CHUNKED_CHUNK_SIZE)
+    {
+        throw std::invalid_argument("Error: The chunk size is too large for chunked mode.");
+    }
+    header[0] = static_cast<uint8_t>(Mode::Chunked);
+    for (int i = 0; i < 4; i++) header[1 + i] = static_cast<uint8_t>(m_chunkSize >> (24 - 8 * i));
+    std::array<uint8_t, 16> nonce;
+    randomIV(nonce);
+    std::copy(nonce.begin(), nonce.begin() + 12, header + 5);
+}
+
+void AES::cryptChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                     size_t size, uint8_t* out, uint8_t* tag, bool decrypting) const
+{
+    // The additional data is the header, and whether this is the last chunk
+    std::array<uint8_t, CHUNKED_HEADER_SIZE + 1> aad;
+    std::copy(header, header + CHUNKED_HEADER_SIZE, aad.begin());
+    aad.back() = last ? 1 : 0;
+    std::array<uint8_t, 16> x = {};
+    ghash(key, x, aad.data(), aad.size());
+
+    // The chunk's nonce is the file nonce with the index XORed into its last 8 bytes. As for
+    // GCM, J0 is the nonce followed by a 32-bit 1, and the text starts from J0 + 1.
+    std::array<uint8_t, 16> j0;
+    std::copy(header + 5, header + CHUNKED_HEADER_SIZE, j0.begin());
+    for (int i = 0; i < 8; i++) j0[11 - i] ^= static_cast<uint8_t>(index >> (8 * i));
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+    std::array<uint8_t, 16> counter = j0;
+    addToCounter(counter, 1);
+
+    cryptGCM(in, out, size, counter, x, key, decrypting);
+    finishGCM(key, x, aad.size(), size, j0, tag);
+}
+
+void AES::sealChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                    size_t size, uint8_t* out) const
+{
+    cryptChunk(key, header, index, last, in, size, out, out + size, false);
+}
+
+void AES::openChunk(const GHashKey& key, const uint8_t* header, uint64_t index, bool last, const uint8_t* in,
+                    size_t size, uint8_t* out) const
+{
+    // Keep the expected tag, in case 'out' runs on past 'in + size'
+    std::array<uint8_t, 16> expected, tag;
+    std::copy(in + size, in + size + 16, expected.begin());
+    cryptChunk(key, header, index, last, in, size, out, tag.data(), true);
+    try
+    {
+        checkTag(tag.data(), expected.data());
+    }
+    catch (const std::invalid_argument&)
+    {
+        // Don't hand back plaintext that failed authentication
+        std::fill(out, out + size, 0);
+        throw;
+    }
+}
+
+void AES::forEachChunkRange(uint64_t numChunks, size_t chunkSize, const std::function<void(uint64_t, uint64_t)>& task)
+{
+    ThreadPool& pool = ThreadPool::shared();
+    uint64_t totalBytes = numChunks * chunkSize;
+    if (numChunks <= 1 || totalBytes <= MIN_TASK_SIZE || pool.size() <= 1)
+    {
+        task(0, numChunks);
+        return;
+    }
+    // Give each thread a contiguous range of whole chunks
+    uint64_t numTasks = std::min<uint64_t>({pool.size(), numChunks, (totalBytes + MIN_TASK_SIZE - 1) / MIN_TASK_SIZE});
+    uint64_t chunksPerTask = (numChunks + numTasks - 1) / numTasks;
+    pool.parallelFor(static_cast<size_t>(numTasks), [&](size_t t)
+    {
+        uint64_t first = t * chunksPerTask;
+        if (first >= numChunks) return;
+        task(first, std::min(chunksPerTask, numChunks - first));
+    });
+}
+
+void AES::encryptChunkedBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const
+{
+    startChunked(out);
+    GHashKey key;
+    initGHash(key);
+
+    // An empty message is still one (empty) last chunk, so that it's authenticated
+    size_t chunkSize = m_chunkSize;
+    uint64_t numChunks = std::max<uint64_t>(1, (inSize + chunkSize - 1) / chunkSize);
+    forEachChunkRange(numChunks, chunkSize, [&](uint64_t first, uint64_t count)
+    {
+        for (uint64_t c = first; c < first + count; c++)
+        {
+            size_t offset = static_cast<size_t>(c * chunkSize);
+            size_t size = std::min(chunkSize, inSize - offset);
+            sealChunk(key, out, c, c == numChunks - 1, in + offset, size,
+                      out + CHUNKED_HEADER_SIZE + c * (chunkSize + 16));
+        }
+    });
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+}
+
+size_t AES::decryptRange(std::span<const uint8_t> ciphertext, uint64_t offset, std::span<uint8_t> plaintext) const
+{
+    ChunkLayout layout = chunkLayout(ciphertext);
+    if (offset >= layout.plaintextSize || plaintext.empty())
+    {
+        return 0;
+    }
+    uint64_t end = offset + std::min<uint64_t>(plaintext.size(), layout.plaintextSize - offset);
+    size_t length = static_cast<size_t>(end - offset);
+
+    // The chunks that overlap [offset, end). A range that runs to the end of the plaintext also
+    // takes in the last chunk, even if it's empty, so truncation is always caught.
+    uint64_t firstChunk = offset / layout.chunkSize;
+    uint64_t lastChunk = end == layout.plaintextSize ? layout.numChunks - 1 : (end - 1) / layout.chunkSize;
+    const uint8_t* header = ciphertext.data();
+    GHashKey key;
+    initGHash(key);
+    try
+    {
+        forEachChunkRange(lastChunk - firstChunk + 1, layout.chunkSize, [&](uint64_t first, uint64_t count)
+        {
+            // Chunks that are only partly in the range are decrypted to the side
+            std::vector<uint8_t> partial;
+            for (uint64_t c = firstChunk + first; c < firstChunk + first + count; c++)
+            {
+                bool last = c == layout.numChunks - 1;
+                size_t size = last ? layout.lastChunkSize : layout.chunkSize;
+                uint64_t chunkStart = c * layout.chunkSize;
+                const uint8_t* sealed = header + CHUNKED_HEADER_SIZE + c * (layout.chunkSize + 16);
+                uint64_t from = std::max(offset, chunkStart);
+                uint64_t to = std::min(end, chunkStart + size);
+                uint8_t* dest = plaintext.data() + (from - offset);
+                if (from == chunkStart && to == chunkStart + size)
+                {
+                    openChunk(key, header, c, last, sealed, size, dest);
+                }
+                else
+                {
+                    partial.resize(size);
+                    openChunk(key, header, c, last, sealed, size, partial.data());
+                    std::copy(partial.begin() + (from - chunkStart), partial.begin() + (to - chunkStart), dest);
+                    std::fill(partial.begin(), partial.end(), 0);
+                }
+            }
+        });
+    }
+    catch (...)
+    {
+        std::fill(plaintext.begin(), plaintext.begin() + length, 0);
+        std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+        throw;
+    }
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+    return length;
+}
+
+size_t AES::decryptChunkedBuffer(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext) const
+{
+    ChunkLayout layout = chunkLayout(ciphertext);
+    if (layout.plaintextSize > 0)
+    {
+        return decryptRange(ciphertext, 0, plaintext);
+    }
+    // An empty message has no range to decrypt, but its one empty chunk must still be checked
+    GHashKey key;
+    initGHash(key);
+    openChunk(key, ciphertext.data(), 0, true, ciphertext.data() + CHUNKED_HEADER_SIZE, 0, plaintext.data());
+    return 0;
+}
+
+void AES::encryptChunkedStream(std::istream& in, std::ostream& out) const
+{
+    std::array<uint8_t, CHUNKED_HEADER_SIZE> header;
+    startChunked(header.data());
+    out.write(reinterpret_cast<char*>(header.data() + 1), CHUNKED_HEADER_SIZE - 1);
+    GHashKey key;
+    initGHash(key);
+
+    // A chunk is the last one if it's short, or nothing follows it
+    std::vector<uint8_t> buffer(m_chunkSize + 16);
+    for (uint64_t index = 0; ; index++)
+    {
+        in.read(reinterpret_cast<char*>(buffer.data()), m_chunkSize);
+        size_t numBytes = in.gcount();
+        bool last = numBytes < m_chunkSize || in.peek() == EOF;
+        sealChunk(key, header.data(), index, last, buffer.data(), numBytes, buffer.data());
+        out.write(reinterpret_cast<char*>(buffer.data()), numBytes + 16);
+        if (last)
+        {
+            break;
+        }
+    }
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+}
+
+void AES::decryptChunkedStream(std::istream& in, std::ostream& out) const
+{
+    std::array<uint8_t, CHUNKED_HEADER_SIZE> header;
+    header[0] = static_cast<uint8_t>(Mode::Chunked);
+    in.read(reinterpret_cast<char*>(header.data() + 1), CHUNKED_HEADER_SIZE - 1);
+    if (static_cast<size_t>(in.gcount()) != CHUNKED_HEADER_SIZE - 1)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
+    }
+    size_t chunkSize = headerChunkSize(header.data(), MAX_CHUNKED_CHUNK_SIZE);
+    GHashKey key;
+    initGHash(key);
+
+    // Each chunk's plaintext is only written once its tag has been checked
+    std::vector<uint8_t> buffer(chunkSize + 16);
+    try
+    {
+        for (uint64_t index = 0; ; index++)
+        {
+            in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+            size_t numBytes = in.gcount();
+            bool last = numBytes < buffer.size() || in.peek() == EOF;
+            if (numBytes < 16)
+            {
+                throw std::invalid_argument("Error: Decryption failed. Ciphertext is truncated.");
+            }
+            openChunk(key, header.data(), index, last, buffer.data(), numBytes - 16, buffer.data());
+            out.write(reinterpret_cast<char*>(buffer.data()), numBytes - 16);
+            if (last)
+            {
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+        throw;
+    }
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+}
+
+bool AES::decryptFileRange(const std::string& inputPath, const std::string& outputPath, uint64_t offset,
+                           uint64_t length) const
+{
+    std::error_code error;
+    if (!MappedFile::isMappable(inputPath) ||
+        (std::filesystem::exists(outputPath, error) && !MappedFile::isMappable(outputPath)))
+    {
+        return false;
+    }
+    // Only the chunks in the range are read, which may be a small part of a large file
+    MappedFile input(inputPath, MappedFile::Access::Random);
+    std::span<const uint8_t> ciphertext(input.data(), input.size());
+    uint64_t plaintextSize = chunkLayout(ciphertext).plaintextSize;
+    uint64_t size = offset < plaintextSize ? std::min(length, plaintextSize - offset) : 0;
+    MappedFile output(outputPath, size);
+    decryptRange(ciphertext, offset, std::span<uint8_t>(output.data(), static_cast<size_t>(size)));
+    return true;
+}
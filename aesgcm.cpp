@@ -0,0 +1,430 @@
+#include "aes.h"
+#include <algorithm>
+#include <stdexcept>
+
+// GCM mode (NIST SP 800-38D): CTR encryption with a 32-bit block counter, authenticated by GHASH.
+// The portable GHASH and the stream handling live here; the PCLMULQDQ GHASH and the stitched
+// AES-NI kernel are in aesni.cpp.
+
+// The reductions modulo the GHASH polynomial of the 4 bits shifted off the low end of a product
+static const std::array<uint64_t, 16> GHASH_LAST4 =
+{0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+ 0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0};
+
+static inline uint64_t loadBigEndian64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void storeBigEndian64(uint8_t* p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = static_cast<uint8_t>(v);
+}
+
+void AES::initGHash(GHashKey& key) const
+{
+    std::array<uint8_t, 16> h = {};
+    encryptBlock(h.data(), h.data());
+
+    // GHASH's bit order is reflected: the first bit of H is the coefficient of x^0. So the entry
+    // for the 4-bit value 8 (x^0) is H itself, 4 is H*x, 2 is H*x^2, and 1 is H*x^3, where
+    // multiplying by x is a right shift, reducing by the polynomial when a bit falls off.
+    uint64_t high = loadBigEndian64(h.data());
+    uint64_t low = loadBigEndian64(h.data() + 8);
+    key.tableHigh[0] = key.tableLow[0] = 0;
+    key.tableHigh[8] = high;
+    key.tableLow[8] = low;
+    for (int i = 4; i > 0; i >>= 1)
+    {
+        uint64_t reduce = (low & 1) * 0xe100000000000000ull;
+        low = (high << 63) | (low >> 1);
+        high = (high >> 1) ^ reduce;
+        key.tableHigh[i] = high;
+        key.tableLow[i] = low;
+    }
+    // The rest are sums of those
+    for (int i = 2; i <= 8; i *= 2)
+    {
+        for (int j = 1; j < i; j++)
+        {
+            key.tableHigh[i + j] = key.tableHigh[i] ^ key.tableHigh[j];
+            key.tableLow[i + j] = key.tableLow[i] ^ key.tableLow[j];
+        }
+    }
+
+    key.hHigh = loadBigEndian64(h.data());
+    key.hLow = loadBigEndian64(h.data() + 8);
+    key.useCLMUL = usesAESNIRoundKeys() && cpuSupportsPCLMUL();
+    key.constantTime = m_backend == Backend::Bitsliced;
+    if (key.useCLMUL)
+    {
+        initGHashCLMUL(key, h.data());
+    }
+    std::fill(h.begin(), h.end(), 0);
+}
+
+void AES::ghash(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes)
+{
+    if (key.useCLMUL)
+    {
+        ghashCLMUL(key, x, data, numBytes);
+    }
+    else if (key.constantTime)
+    {
+        ghashConstantTime(key, x, data, numBytes);
+    }
+    else
+    {
+        ghashPortable(key, x, data, numBytes);
+    }
+}
+
+void AES::ghashPortable(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes)
+{
+    while (numBytes > 0)
+    {
+        size_t length = std::min<size_t>(numBytes, 16);
+        for (size_t i = 0; i < length; i++) x[i] ^= data[i];
+
+        // Multiply x by H a nibble at a time, from the last (highest degree) nibble down: shift
+        // the product by x^4, folding the 4 bits that fall off back in, then add H times the nibble.
+        uint64_t high = 0;
+        uint64_t low = 0;
+        for (int i = 15; i >= 0; i--)
+        {
+            for (int nibble : {x[i] & 0xf, x[i] >> 4})
+            {
+                uint64_t rem = low & 0xf;
+                low = (high << 60) | (low >> 4);
+                high = (high >> 4) ^ (GHASH_LAST4[rem] << 48);
+                high ^= key.tableHigh[nibble];
+                low ^= key.tableLow[nibble];
+            }
+        }
+        storeBigEndian64(x.data(), high);
+        storeBigEndian64(x.data() + 8, low);
+
+        data += length;
+        numBytes -= length;
+    }
+}
+
+// Carry-less multiply of the low 64 bits of a and b, without branches or lookups. Each operand is
+// split into four parts holding every fourth bit, so each integer product of two parts has 3 zero
+// bits between its terms, which is enough room that no carry can reach the next term: masking
+// keeps only the bits of the carry-less product.
+static inline uint64_t clmulLow64(uint64_t a, uint64_t b)
+{
+    const uint64_t m0 = 0x1111111111111111ull;
+    const uint64_t m1 = 0x2222222222222222ull;
+    const uint64_t m2 = 0x4444444444444444ull;
+    const uint64_t m3 = 0x8888888888888888ull;
+    uint64_t a0 = a & m0, a1 = a & m1, a2 = a & m2, a3 = a & m3;
+    uint64_t b0 = b & m0, b1 = b & m1, b2 = b & m2, b3 = b & m3;
+    uint64_t z0 = (a0 * b0) ^ (a1 * b3) ^ (a2 * b2) ^ (a3 * b1);
+    uint64_t z1 = (a0 * b1) ^ (a1 * b0) ^ (a2 * b3) ^ (a3 * b2);
+    uint64_t z2 = (a0 * b2) ^ (a1 * b1) ^ (a2 * b0) ^ (a3 * b3);
+    uint64_t z3 = (a0 * b3) ^ (a1 * b2) ^ (a2 * b1) ^ (a3 * b0);
+    return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static inline uint64_t reverseBits64(uint64_t x)
+{
+    x = ((x & 0x5555555555555555ull) << 1) | ((x >> 1) & 0x5555555555555555ull);
+    x = ((x & 0x3333333333333333ull) << 2) | ((x >> 2) & 0x3333333333333333ull);
+    x = ((x & 0x0f0f0f0f0f0f0f0full) << 4) | ((x >> 4) & 0x0f0f0f0f0f0f0f0full);
+    x = ((x & 0x00ff00ff00ff00ffull) << 8) | ((x >> 8) & 0x00ff00ff00ff00ffull);
+    x = ((x & 0x0000ffff0000ffffull) << 16) | ((x >> 16) & 0x0000ffff0000ffffull);
+    return (x << 32) | (x >> 32);
+}
+
+void AES::ghashConstantTime(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes)
+{
+    // After BearSSL's ghash_ctmul64. The 128-bit product is built by Karatsuba from three 64-bit
+    // carry-less products, each done twice: once as is for its low half, and once on bit-reversed
+    // operands for its high half. It's then shifted by one bit for GHASH's reflected bit order and
+    // reduced modulo x^128 + x^7 + x^2 + x + 1.
+    const uint64_t h1 = key.hHigh;
+    const uint64_t h0 = key.hLow;
+    const uint64_t h2 = h0 ^ h1;
+    const uint64_t h0r = reverseBits64(h0);
+    const uint64_t h1r = reverseBits64(h1);
+    const uint64_t h2r = h0r ^ h1r;
+    uint64_t y1 = loadBigEndian64(x.data());
+    uint64_t y0 = loadBigEndian64(x.data() + 8);
+    while (numBytes > 0)
+    {
+        std::array<uint8_t, 16> block = {};
+        size_t length = std::min<size_t>(numBytes, 16);
+        std::copy(data, data + length, block.begin());
+        y1 ^= loadBigEndian64(block.data());
+        y0 ^= loadBigEndian64(block.data() + 8);
+
+        uint64_t y0r = reverseBits64(y0);
+        uint64_t y1r = reverseBits64(y1);
+        uint64_t y2 = y0 ^ y1;
+        uint64_t y2r = y0r ^ y1r;
+
+        uint64_t z0 = clmulLow64(y0, h0);
+        uint64_t z1 = clmulLow64(y1, h1);
+        uint64_t z2 = clmulLow64(y2, h2);
+        uint64_t z0h = clmulLow64(y0r, h0r);
+        uint64_t z1h = clmulLow64(y1r, h1r);
+        uint64_t z2h = clmulLow64(y2r, h2r);
+        z2 ^= z0 ^ z1;
+        z2h ^= z0h ^ z1h;
+        z0h = reverseBits64(z0h) >> 1;
+        z1h = reverseBits64(z1h) >> 1;
+        z2h = reverseBits64(z2h) >> 1;
+
+        uint64_t v0 = z0;
+        uint64_t v1 = z0h ^ z2;
+        uint64_t v2 = z1 ^ z2h;
+        uint64_t v3 = z1h;
+
+        v3 = (v3 << 1) | (v2 >> 63);
+        v2 = (v2 << 1) | (v1 >> 63);
+        v1 = (v1 << 1) | (v0 >> 63);
+        v0 = (v0 << 1);
+
+        v2 ^= v0 ^ (v0 >> 1) ^ (v0 >> 2) ^ (v0 >> 7);
+        v1 ^= (v0 << 63) ^ (v0 << 62) ^ (v0 << 57);
+        v3 ^= v1 ^ (v1 >> 1) ^ (v1 >> 2) ^ (v1 >> 7);
+        v2 ^= (v1 << 63) ^ (v1 << 62) ^ (v1 << 57);
+        y0 = v2;
+        y1 = v3;
+
+        data += length;
+        numBytes -= length;
+    }
+    storeBigEndian64(x.data(), y1);
+    storeBigEndian64(x.data() + 8, y0);
+}
+
+void AES::cryptGCM(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                   std::array<uint8_t, 16>& x, const GHashKey& key, bool decrypting) const
+{
+    if (key.useCLMUL)
+    {
+        size_t done = cryptGCMAESNI(in, out, numBytes, counter, x, key, decrypting);
+        in += done;
+        out += done;
+        numBytes -= done;
+    }
+
+    // Otherwise, go a cache-sized batch at a time: GHASH always reads the ciphertext, so that's
+    // before decrypting and after encrypting.
+    const size_t batchSize = 64 * 16;
+    while (numBytes > 0)
+    {
+        size_t length = std::min(numBytes, batchSize);
+        if (decrypting)
+        {
+            ghash(key, x, in, length);
+        }
+        cryptCTR(in, out, length, counter);
+        if (!decrypting)
+        {
+            ghash(key, x, out, length);
+        }
+        // The counter can't carry out of its low 32 bits, since messages are limited to GCM_MAX_BYTES
+        addToCounter(counter, (length + 15) / 16);
+        in += length;
+        out += length;
+        numBytes -= length;
+    }
+}
+
+void AES::finishGCM(const GHashKey& key, std::array<uint8_t, 16>& x, uint64_t aadBytes, uint64_t textBytes,
+                    const std::array<uint8_t, 16>& j0, uint8_t* tag) const
+{
+    // The last block hashed holds the bit lengths of the additional data and the text
+    std::array<uint8_t, 16> lengths;
+    storeBigEndian64(lengths.data(), aadBytes * 8);
+    storeBigEndian64(lengths.data() + 8, textBytes * 8);
+    ghash(key, x, lengths.data(), 16);
+
+    // The tag is the hash encrypted with the nonce's first counter block
+    encryptBlock(j0.data(), tag);
+    for (int i = 0; i < 16; i++) tag[i] ^= x[i];
+}
+
+void AES::startGCM(const uint8_t* nonce, GHashKey& key, std::array<uint8_t, 16>& x,
+                   std::array<uint8_t, 16>& j0, std::array<uint8_t, 16>& counter) const
+{
+    std::array<uint8_t, GCM_HEADER_SIZE> header;
+    header[0] = static_cast<uint8_t>(Mode::GCM);
+    std::copy(nonce, nonce + 12, header.begin() + 1);
+    initGHash(key);
+    x.fill(0);
+    ghash(key, x, header.data(), header.size());
+
+    // J0 is the nonce followed by a 32-bit 1, and the text is encrypted starting from J0 + 1
+    std::copy(nonce, nonce + 12, j0.begin());
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+    counter = j0;
+    addToCounter(counter, 1);
+}
+
+void AES::checkTag(const uint8_t* computed, const uint8_t* expected)
+{
+    uint8_t difference = 0;
+    for (int i = 0; i < 16; i++) difference |= computed[i] ^ expected[i];
+    if (difference != 0)
+    {
+        throw std::invalid_argument("Error: Decryption failed. The ciphertext or its header has been modified, or the key is wrong.");
+    }
+}
+
+void AES::encryptGCMStream(std::istream& in, std::ostream& out) const
+{
+    // A 96-bit nonce must never repeat under the same key. A random one, from the first 12 of
+    // the 16 random bytes randomIV gives, is fine for far more messages than anyone will
+    // encrypt with one key file.
+    std::array<uint8_t, 16> nonce;
+    randomIV(nonce);
+    out.write(reinterpret_cast<char*>(nonce.data()), 12);
+    GHashKey key;
+    std::array<uint8_t, 16> x, j0, counter;
+    startGCM(nonce.data(), key, x, j0, counter);
+
+    std::vector<uint8_t> buffer(m_chunkSize);
+    uint64_t totalBytes = 0;
+    for (;;)
+    {
+        in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t numBytes = in.gcount();
+        totalBytes += numBytes;
+        if (totalBytes > GCM_MAX_BYTES)
+        {
+            throw std::invalid_argument("Error: The input is too large for GCM mode.");
+        }
+        // Every read but the last is a whole number of blocks, so the hash stays aligned
+        cryptGCM(buffer.data(), buffer.data(), numBytes, counter, x, key, false);
+        out.write(reinterpret_cast<char*>(buffer.data()), numBytes);
+        if (numBytes < buffer.size())
+        {
+            break;
+        }
+    }
+
+    std::array<uint8_t, 16> tag;
+    finishGCM(key, x, GCM_HEADER_SIZE, totalBytes, j0, tag.data());
+    out.write(reinterpret_cast<char*>(tag.data()), 16);
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+}
+
+void AES::decryptGCMStream(std::istream& in, std::ostream& out) const
+{
+    std::array<uint8_t, 12> nonce;
+    in.read(reinterpret_cast<char*>(nonce.data()), 12);
+    if (in.gcount() != 12)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
+    }
+    GHashKey key;
+    std::array<uint8_t, 16> x, j0, counter;
+    startGCM(nonce.data(), key, x, j0, counter);
+
+    // The last 16 bytes of the stream are the tag, not ciphertext, so hold back 16 bytes from
+    // every read until we know we've hit the end. 'pending' bytes at the start of the buffer are
+    // left over from the previous read.
+    std::vector<uint8_t> buffer(m_chunkSize + 32);
+    size_t pending = 0;
+    uint64_t totalBytes = 0;
+    for (;;)
+    {
+        size_t request = m_chunkSize;
+        in.read(reinterpret_cast<char*>(buffer.data() + pending), request);
+        size_t available = pending + in.gcount();
+        bool lastRead = static_cast<size_t>(in.gcount()) < request;
+        if (available < 16)
+        {
+            throw std::invalid_argument("Error: Decryption failed. Ciphertext is truncated.");
+        }
+
+        // Decrypt everything but the possible tag, keeping the hash aligned to whole blocks
+        // until the end
+        size_t numBytes = available - 16;
+        if (!lastRead)
+        {
+            numBytes -= numBytes % 16;
+        }
+        totalBytes += numBytes;
+        if (totalBytes > GCM_MAX_BYTES)
+        {
+            throw std::invalid_argument("Error: Decryption failed. Ciphertext is too large for GCM mode.");
+        }
+        cryptGCM(buffer.data(), buffer.data(), numBytes, counter, x, key, true);
+        out.write(reinterpret_cast<char*>(buffer.data()), numBytes);
+
+        pending = available - numBytes;
+        std::copy(buffer.begin() + numBytes, buffer.begin() + available, buffer.begin());
+        if (lastRead)
+        {
+            break;
+        }
+    }
+
+    std::array<uint8_t, 16> tag;
+    finishGCM(key, x, GCM_HEADER_SIZE, totalBytes, j0, tag.data());
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+    checkTag(tag.data(), buffer.data());
+}
+
+void AES::encryptGCMBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const
+{
+    if (inSize > GCM_MAX_BYTES)
+    {
+        throw std::invalid_argument("Error: The input is too large for GCM mode.");
+    }
+    std::array<uint8_t, 16> nonce;
+    randomIV(nonce);
+    std::copy(nonce.begin(), nonce.begin() + 12, out);
+    GHashKey key;
+    std::array<uint8_t, 16> x, j0, counter;
+    startGCM(nonce.data(), key, x, j0, counter);
+
+    cryptGCM(in, out + 12, inSize, counter, x, key, false);
+    finishGCM(key, x, GCM_HEADER_SIZE, inSize, j0, out + 12 + inSize);
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+}
+
+size_t AES::decryptGCMBuffer(const uint8_t* in, size_t inSize, uint8_t* out) const
+{
+    if (inSize < 12)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext header is truncated.");
+    }
+    if (inSize < 12 + 16)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext is truncated.");
+    }
+    size_t numBytes = inSize - 12 - 16;
+    if (numBytes > GCM_MAX_BYTES)
+    {
+        throw std::invalid_argument("Error: Decryption failed. Ciphertext is too large for GCM mode.");
+    }
+    GHashKey key;
+    std::array<uint8_t, 16> x, j0, counter;
+    startGCM(in, key, x, j0, counter);
+
+    cryptGCM(in + 12, out, numBytes, counter, x, key, true);
+    std::array<uint8_t, 16> tag;
+    finishGCM(key, x, GCM_HEADER_SIZE, numBytes, j0, tag.data());
+    std::fill(reinterpret_cast<uint8_t*>(&key), reinterpret_cast<uint8_t*>(&key + 1), 0);
+    try
+    {
+        checkTag(tag.data(), in + 12 + numBytes);
+    }
+    catch (const std::invalid_argument&)
+    {
+        // Don't hand back plaintext that failed authentication
+        std::fill(out, out + numBytes, 0);
+        throw;
+    }
+    return numBytes;
+}
@@ -0,0 +1,386 @@
+#include "aes.h"
+#include <algorithm>
+#include <stdexcept>
+
+// Passes the input to 'process' a whole block at a time, in order, after the 'pending' bytes
+// left over from earlier calls. The last 'holdBack' bytes (0 or 16) and any partial block are
+// kept in 'pending' for next time. Returns the number of bytes 'process' wrote to 'out'.
+template <size_t N, typename Process>
+static size_t feedBlocks(std::array<uint8_t, N>& pending, size_t& pendingSize, size_t holdBack,
+                         std::span<const uint8_t> in, uint8_t* out, Process process)
+{
+    size_t written = 0;
+    while (!in.empty())
+    {
+        if (pendingSize % 16 == 0 && in.size() >= holdBack + 16)
+        {
+            // The pending blocks are followed by enough input that they can go, and so can every
+            // whole block of 'in' up to what has to be held back. This is where nearly all of a
+            // large update goes, straight from 'in' to 'out' without copying.
+            if (pendingSize > 0)
+            {
+                process(pending.data(), out + written, pendingSize / 16);
+                written += pendingSize;
+                pendingSize = 0;
+            }
+            size_t numBlocks = (in.size() - holdBack) / 16;
+            process(in.data(), out + written, numBlocks);
+            written += 16 * numBlocks;
+            in = in.subspan(16 * numBlocks);
+        }
+
+        // Top up the pending bytes, and once there are enough, the first block of them can go
+        size_t take = std::min(in.size(), holdBack + 16 - pendingSize);
+        std::copy(in.begin(), in.begin() + take, pending.begin() + pendingSize);
+        pendingSize += take;
+        in = in.subspan(take);
+        if (pendingSize == holdBack + 16)
+        {
+            process(pending.data(), out + written, 1);
+            written += 16;
+            std::copy(pending.begin() + 16, pending.begin() + pendingSize, pending.begin());
+            pendingSize -= 16;
+        }
+    }
+    return written;
+}
+
+AES::Encryptor::Encryptor(const AES& aes, Mode mode)
+    : m_aes(aes), m_mode(mode)
+{
+    // A chunk is only sealed once it's known whether it's the last, which a stream of pieces
+    // doesn't say
+    if (mode == Mode::Chunked)
+    {
+        throw std::invalid_argument("Error: Chunked mode can't be encrypted incrementally; use encrypt.");
+    }
+    if (mode == Mode::XTS)
+    {
+        throw std::invalid_argument("Error: XTS mode can't be encrypted incrementally; use encryptSectors.");
+    }
+    if (mode == Mode::CBC || mode == Mode::CTR)
+    {
+        randomIV(m_vector);
+    }
+    else if (mode == Mode::GCM)
+    {
+        // The counter lives in m_vector, as it does for CTR
+        randomIV(m_nonce);
+        m_aes.startGCM(m_nonce.data(), m_key, m_x, m_j0, m_vector);
+    }
+}
+
+AES::Encryptor::~Encryptor()
+{
+    std::fill(m_vector.begin(), m_vector.end(), 0);
+    std::fill(m_pending.begin(), m_pending.end(), 0);
+    std::fill(reinterpret_cast<uint8_t*>(&m_key), reinterpret_cast<uint8_t*>(&m_key + 1), 0);
+    std::fill(m_x.begin(), m_x.end(), 0);
+}
+
+size_t AES::Encryptor::update(std::span<const uint8_t> in, std::span<uint8_t> out)
+{
+    if (m_finalized)
+    {
+        throw std::logic_error("Error: The Encryptor has already been finalized.");
+    }
+    if (out.size() < in.size() + MAX_OVERHEAD)
+    {
+        throw std::invalid_argument("Error: The ciphertext buffer is too small.");
+    }
+    size_t written = writeHeader(out.data());
+    written += feedBlocks(m_pending, m_pendingSize, 0, in, out.data() + written,
+                          [this](const uint8_t* blocksIn, uint8_t* blocksOut, size_t numBlocks)
+                          {
+                              encryptBlocks(blocksIn, blocksOut, numBlocks);
+                          });
+    return written;
+}
+
+size_t AES::Encryptor::finalize(std::span<uint8_t> out)
+{
+    if (m_finalized)
+    {
+        throw std::logic_error("Error: The Encryptor has already been finalized.");
+    }
+    if (out.size() < MAX_OVERHEAD)
+    {
+        throw std::invalid_argument("Error: The ciphertext buffer is too small.");
+    }
+    m_finalized = true;
+    size_t written = writeHeader(out.data());
+    uint8_t* tail = out.data() + written;
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+        case Mode::CBC:
+        {
+            // Pad out the final block. If the input ended on a block boundary, the padding is a
+            // whole block.
+            uint8_t padBytes = static_cast<uint8_t>(16 - m_pendingSize);
+            std::fill(m_pending.begin() + m_pendingSize, m_pending.end(), padBytes);
+            encryptBlocks(m_pending.data(), tail, 1);
+            written += 16;
+            break;
+        }
+        case Mode::CTR:
+            m_aes.cryptCTR(m_pending.data(), tail, m_pendingSize, m_vector);
+            written += m_pendingSize;
+            break;
+        case Mode::GCM:
+            m_totalBytes += m_pendingSize;
+            if (m_totalBytes > GCM_MAX_BYTES)
+            {
+                throw std::invalid_argument("Error: The input is too large for GCM mode.");
+            }
+            m_aes.cryptGCM(m_pending.data(), tail, m_pendingSize, m_vector, m_x, m_key, false);
+            m_aes.finishGCM(m_key, m_x, GCM_HEADER_SIZE, m_totalBytes, m_j0, tail + m_pendingSize);
+            written += m_pendingSize + 16;
+            break;
+    }
+    m_pendingSize = 0;
+    return written;
+}
+
+size_t AES::Encryptor::writeHeader(uint8_t* out)
+{
+    if (m_wroteHeader)
+    {
+        return 0;
+    }
+    m_wroteHeader = true;
+    out[0] = static_cast<uint8_t>(m_mode);
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+            return 1;
+        case Mode::CBC:
+        case Mode::CTR:
+            // Nothing has been encrypted yet, so this is still the IV or initial counter block
+            std::copy(m_vector.begin(), m_vector.end(), out + 1);
+            return 17;
+        case Mode::GCM:
+            std::copy(m_nonce.begin(), m_nonce.begin() + 12, out + 1);
+            return 13;
+    }
+    return 1;
+}
+
+void AES::Encryptor::encryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+            m_aes.encryptBlocks(in, out, numBlocks);
+            break;
+        case Mode::CBC:
+            m_aes.encryptBlocksCBC(in, out, numBlocks, m_vector);
+            break;
+        case Mode::CTR:
+            m_aes.cryptCTRParallel(in, out, 16 * numBlocks, m_vector);
+            addToCounter(m_vector, numBlocks);
+            break;
+        case Mode::GCM:
+            m_totalBytes += 16 * numBlocks;
+            if (m_totalBytes > GCM_MAX_BYTES)
+            {
+                throw std::invalid_argument("Error: The input is too large for GCM mode.");
+            }
+            m_aes.cryptGCM(in, out, 16 * numBlocks, m_vector, m_x, m_key, false);
+            break;
+    }
+}
+
+AES::Decryptor::Decryptor(const AES& aes)
+    : m_aes(aes)
+{
+}
+
+AES::Decryptor::~Decryptor()
+{
+    std::fill(m_vector.begin(), m_vector.end(), 0);
+    std::fill(m_pending.begin(), m_pending.end(), 0);
+    std::fill(reinterpret_cast<uint8_t*>(&m_key), reinterpret_cast<uint8_t*>(&m_key + 1), 0);
+    std::fill(m_x.begin(), m_x.end(), 0);
+}
+
+size_t AES::Decryptor::update(std::span<const uint8_t> in, std::span<uint8_t> out)
+{
+    if (m_finalized)
+    {
+        throw std::logic_error("Error: The Decryptor has already been finalized.");
+    }
+    if (out.size() < in.size() + Encryptor::MAX_OVERHEAD)
+    {
+        throw std::invalid_argument("Error: The plaintext buffer is too small.");
+    }
+
+    // Gather the header, which is short enough to take a byte at a time
+    while (!m_started && !in.empty())
+    {
+        m_header[m_headerBytes++] = in[0];
+        in = in.subspan(1);
+        if (m_headerBytes == headerSize())
+        {
+            startMode();
+        }
+    }
+    return feedBlocks(m_pending, m_pendingSize, m_holdBack, in, out.data(),
+                      [this](const uint8_t* blocksIn, uint8_t* blocksOut, size_t numBlocks)
+                      {
+                          decryptBlocks(blocksIn, blocksOut, numBlocks);
+                      });
+}
+
+size_t AES::Decryptor::finalize(std::span<uint8_t> out)
+{
+    if (m_finalized)
+    {
+        throw std::logic_error("Error: The Decryptor has already been finalized.");
+    }
+    if (out.size() < Encryptor::MAX_OVERHEAD)
+    {
+        throw std::invalid_argument("Error: The plaintext buffer is too small.");
+    }
+    m_finalized = true;
+    if (!m_started)
+    {
+        throw std::invalid_argument(m_headerBytes == 0 ?
+            "Error: Decryption failed. Unrecognized header of ciphertext." :
+            "Error: Decryption failed. Ciphertext header is truncated.");
+    }
+
+    size_t written = 0;
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+        case Mode::CBC:
+            // All that's left should be the last block, which holds the padding
+            if (m_pendingSize % 16 != 0)
+            {
+                throw std::invalid_argument("Error: Decryption failed.");
+            }
+            if (m_pendingSize > 0)
+            {
+                decryptBlocks(m_pending.data(), out.data(), 1);
+                written = 16 - paddingLength(out.data());
+            }
+            break;
+        case Mode::CTR:
+            m_aes.cryptCTR(m_pending.data(), out.data(), m_pendingSize, m_vector);
+            written = m_pendingSize;
+            break;
+        case Mode::GCM:
+        {
+            if (m_pendingSize < 16)
+            {
+                throw std::invalid_argument("Error: Decryption failed. Ciphertext is truncated.");
+            }
+            size_t numBytes = m_pendingSize - 16;
+            m_totalBytes += numBytes;
+            if (m_totalBytes > GCM_MAX_BYTES)
+            {
+                throw std::invalid_argument("Error: Decryption failed. Ciphertext is too large for GCM mode.");
+            }
+            // Hand over the last of the plaintext only if the tag matches
+            std::array<uint8_t, 16> last, tag;
+            m_aes.cryptGCM(m_pending.data(), last.data(), numBytes, m_vector, m_x, m_key, true);
+            m_aes.finishGCM(m_key, m_x, GCM_HEADER_SIZE, m_totalBytes, m_j0, tag.data());
+            checkTag(tag.data(), m_pending.data() + numBytes);
+            std::copy(last.begin(), last.begin() + numBytes, out.data());
+            written = numBytes;
+            break;
+        }
+    }
+    m_pendingSize = 0;
+    return written;
+}
+
+size_t AES::Decryptor::headerSize() const
+{
+    switch (m_header[0])
+    {
+        case static_cast<uint8_t>(Mode::ECB):
+            return 1;
+        case static_cast<uint8_t>(Mode::CBC):
+        case static_cast<uint8_t>(Mode::CTR):
+            return 17;
+        case static_cast<uint8_t>(Mode::GCM):
+            return 13;
+        case static_cast<uint8_t>(Mode::Chunked):
+            throw std::invalid_argument("Error: Chunked ciphertext can't be decrypted incrementally; use decrypt or decryptRange.");
+        default:
+            throw std::invalid_argument("Error: Decryption failed. Unrecognized header of ciphertext.");
+    }
+}
+
+void AES::Decryptor::startMode()
+{
+    m_mode = static_cast<Mode>(m_header[0]);
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+            m_holdBack = 16;
+            break;
+        case Mode::CBC:
+            std::copy(m_header.begin() + 1, m_header.end(), m_vector.begin());
+            m_holdBack = 16;
+            break;
+        case Mode::CTR:
+            std::copy(m_header.begin() + 1, m_header.end(), m_vector.begin());
+            m_holdBack = 0;
+            break;
+        case Mode::GCM:
+            m_aes.startGCM(m_header.data() + 1, m_key, m_x, m_j0, m_vector);
+            m_holdBack = 16;
+            break;
+    }
+    m_started = true;
+}
+
+void AES::Decryptor::decryptBlocks(const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    switch (m_mode)
+    {
+        case Mode::Chunked:
+        case Mode::XTS:
+            // Turned away before anything is encrypted or decrypted
+            break;
+        case Mode::ECB:
+        case Mode::CBC:
+            m_aes.decryptBlocksParallel(in, out, numBlocks, m_mode, m_vector);
+            break;
+        case Mode::CTR:
+            m_aes.cryptCTRParallel(in, out, 16 * numBlocks, m_vector);
+            addToCounter(m_vector, numBlocks);
+            break;
+        case Mode::GCM:
+            m_totalBytes += 16 * numBlocks;
+            if (m_totalBytes > GCM_MAX_BYTES)
+            {
+                throw std::invalid_argument("Error: Decryption failed. Ciphertext is too large for GCM mode.");
+            }
+            m_aes.cryptGCM(in, out, 16 * numBlocks, m_vector, m_x, m_key, true);
+            break;
+    }
+}
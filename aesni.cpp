@@ -0,0 +1,728 @@
+#include "aes.h"
+#include <algorithm>
+#include <stdexcept>
+
+// The x86 AES-NI backend for AES, the PCLMULQDQ half of GCM, and the CPUID checks used to pick
+// a backend, are implemented here rather than in aes.cpp. The AES-NI functions are only ever
+// called when cpuSupportsAESNI() returns true.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AESNI_TARGET
+#define GCM_TARGET
+#else
+#include <cpuid.h>
+// GCC and Clang only emit AES instructions in functions compiled for a target that has them
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+// GCM also needs PCLMULQDQ, and PSHUFB (SSSE3) to reverse the bytes of a block
+#define GCM_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#endif
+
+// Runs CPUID for the given leaf (and subleaf), filling in EAX, EBX, ECX, EDX
+static void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4])
+{
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#ifdef _MSC_VER
+    __cpuidex(reinterpret_cast<int*>(regs), leaf, subleaf);
+#else
+    __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+}
+
+// Runs CPUID leaf 7 (subleaf 0), the extended feature flags. If the CPU's highest basic leaf is
+// below 7, it would answer with the highest leaf's data instead, so leave regs zeroed and return
+// false. The highest leaf comes from leaf 0, which is only queried once.
+static bool cpuidLeaf7(unsigned int regs[4])
+{
+    static const unsigned int maxLeaf = []
+    {
+        unsigned int leaf0[4];
+        cpuid(0, 0, leaf0);
+        return leaf0[0];
+    }();
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    if (maxLeaf < 7)
+    {
+        return false;
+    }
+    cpuid(7, 0, regs);
+    return true;
+}
+
+// Returns the mask of register states the OS saves on context switches (XCR0), or 0 if the OS
+// doesn't support XSAVE. Using ymm/zmm registers is only safe if the OS saves them.
+static uint64_t osSavedRegisterStates()
+{
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    if ((regs[2] & (1u << 27)) == 0) // OSXSAVE
+    {
+        return 0;
+    }
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+bool AES::cpuSupportsAESNI()
+{
+    // CPUID leaf 1: ECX bit 25 is AES-NI
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    return (regs[2] & (1u << 25)) != 0;
+}
+
+bool AES::cpuSupportsVAES256()
+{
+    // CPUID leaf 7: EBX bit 5 is AVX2, ECX bit 9 is VAES.
+    // XCR0 bits 1 and 2 mean the OS saves the xmm and ymm registers.
+    unsigned int regs[4];
+    return cpuidLeaf7(regs) &&
+           cpuSupportsAESNI() &&
+           (regs[1] & (1u << 5)) != 0 &&
+           (regs[2] & (1u << 9)) != 0 &&
+           (osSavedRegisterStates() & 0x06) == 0x06;
+}
+
+bool AES::cpuSupportsVAES512()
+{
+    // CPUID leaf 7: EBX bit 16 is AVX-512F, ECX bit 9 is VAES.
+    // XCR0 bits 5-7 mean the OS also saves the opmask and upper zmm registers.
+    unsigned int regs[4];
+    return cpuidLeaf7(regs) &&
+           cpuSupportsAESNI() &&
+           (regs[1] & (1u << 16)) != 0 &&
+           (regs[2] & (1u << 9)) != 0 &&
+           (osSavedRegisterStates() & 0xe6) == 0xe6;
+}
+
+bool AES::cpuSupportsPCLMUL()
+{
+    // CPUID leaf 1: ECX bit 1 is PCLMULQDQ, bit 9 is SSSE3
+    unsigned int regs[4];
+    cpuid(1, 0, regs);
+    return cpuSupportsAESNI() && (regs[2] & (1u << 1)) != 0 && (regs[2] & (1u << 9)) != 0;
+}
+
+// One step of the AES key schedule: XORs a 16-byte chunk of the previous round key with its own
+// prefixes (w0, w0^w1, w0^w1^w2, ...) and then with 'assist', the AESKEYGENASSIST word broadcast
+// to all four lanes.
+AESNI_TARGET static inline __m128i expandStep(__m128i prev, __m128i assist)
+{
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    return _mm_xor_si128(prev, assist);
+}
+
+// AESKEYGENASSIST needs its round constant as an immediate, hence the macros.
+#define AES128_STEP(k, rcon) expandStep(k, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, rcon), 0xff))
+
+// For AES-192, the round keys don't line up with the 24-byte chunks of the key schedule.
+// This derives the next 24 bytes: the next 16 go in 'lo', and the remaining 8 in the low half of 'hi'.
+AESNI_TARGET static inline void expand192Step(__m128i& lo, __m128i& hi, __m128i assist)
+{
+    lo = expandStep(lo, _mm_shuffle_epi32(assist, 0x55));
+    __m128i last = _mm_shuffle_epi32(lo, 0xff);
+    hi = _mm_xor_si128(hi, _mm_slli_si128(hi, 4));
+    hi = _mm_xor_si128(hi, last);
+}
+#define AES192_STEP(lo, hi, rcon) expand192Step(lo, hi, _mm_aeskeygenassist_si128(hi, rcon))
+
+// Combines the low halves of a and b into one round key, or the high half of a with the low half of b
+AESNI_TARGET static inline __m128i lowHalves(__m128i a, __m128i b)
+{
+    return _mm_unpacklo_epi64(a, b);
+}
+AESNI_TARGET static inline __m128i highLowHalves(__m128i a, __m128i b)
+{
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b), 1));
+}
+
+AESNI_TARGET void AES::KeySchedule::expandAESNI(const std::vector<uint8_t>& key)
+{
+    __m128i rk[15];
+    int numRounds = 0;
+    const __m128i* keyData = reinterpret_cast<const __m128i*>(key.data());
+
+    if (key.size() == 16)
+    {
+        numRounds = 10;
+        rk[0] = _mm_loadu_si128(keyData);
+        rk[1] = AES128_STEP(rk[0], 0x01);
+        rk[2] = AES128_STEP(rk[1], 0x02);
+        rk[3] = AES128_STEP(rk[2], 0x04);
+        rk[4] = AES128_STEP(rk[3], 0x08);
+        rk[5] = AES128_STEP(rk[4], 0x10);
+        rk[6] = AES128_STEP(rk[5], 0x20);
+        rk[7] = AES128_STEP(rk[6], 0x40);
+        rk[8] = AES128_STEP(rk[7], 0x80);
+        rk[9] = AES128_STEP(rk[8], 0x1b);
+        rk[10] = AES128_STEP(rk[9], 0x36);
+    }
+    else if (key.size() == 24)
+    {
+        // Each step yields 1.5 round keys, so the round keys alternate between being
+        // spliced together from two steps and lining up with a step.
+        numRounds = 12;
+        __m128i lo = _mm_loadu_si128(keyData);
+        __m128i hi = _mm_loadl_epi64(keyData + 1);
+        rk[0] = lo;
+        __m128i prevHi = hi;
+        AES192_STEP(lo, hi, 0x01);
+        rk[1] = lowHalves(prevHi, lo);
+        rk[2] = highLowHalves(lo, hi);
+        AES192_STEP(lo, hi, 0x02);
+        rk[3] = lo;
+        prevHi = hi;
+        AES192_STEP(lo, hi, 0x04);
+        rk[4] = lowHalves(prevHi, lo);
+        rk[5] = highLowHalves(lo, hi);
+        AES192_STEP(lo, hi, 0x08);
+        rk[6] = lo;
+        prevHi = hi;
+        AES192_STEP(lo, hi, 0x10);
+        rk[7] = lowHalves(prevHi, lo);
+        rk[8] = highLowHalves(lo, hi);
+        AES192_STEP(lo, hi, 0x20);
+        rk[9] = lo;
+        prevHi = hi;
+        AES192_STEP(lo, hi, 0x40);
+        rk[10] = lowHalves(prevHi, lo);
+        rk[11] = highLowHalves(lo, hi);
+        AES192_STEP(lo, hi, 0x80);
+        rk[12] = lo;
+    }
+    else
+    {
+        // AES-256: even round keys use RotWord+SubWord+Rcon, odd round keys use SubWord only,
+        // which is the third word of AESKEYGENASSIST with a zero round constant.
+        numRounds = 14;
+        rk[0] = _mm_loadu_si128(keyData);
+        rk[1] = _mm_loadu_si128(keyData + 1);
+#define AES256_STEP(i, rcon) \
+        rk[i]   = expandStep(rk[i-2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i-1], rcon), 0xff)); \
+        rk[i+1] = expandStep(rk[i-1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0x00), 0xaa))
+        AES256_STEP(2, 0x01);
+        AES256_STEP(4, 0x02);
+        AES256_STEP(6, 0x04);
+        AES256_STEP(8, 0x08);
+        AES256_STEP(10, 0x10);
+        AES256_STEP(12, 0x20);
+#undef AES256_STEP
+        rk[14] = expandStep(rk[12], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[13], 0x40), 0xff));
+    }
+
+    for (int i = 0; i <= numRounds; i++)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(m_roundKeys[i].data()), rk[i]);
+
+        __m128i inv = rk[numRounds - i];
+        if (i != 0 && i != numRounds)
+        {
+            inv = _mm_aesimc_si128(inv);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(m_invRoundKeys[i].data()), inv);
+    }
+
+    // Don't leave key material lying around on the stack
+    for (int i = 0; i <= numRounds; i++)
+    {
+        rk[i] = _mm_setzero_si128();
+    }
+}
+
+// Loads the round keys into registers
+template <int Rounds>
+AESNI_TARGET static inline void loadRoundKeys(const std::array<uint8_t, 16>* roundKeys, __m128i* rk)
+{
+    for (int i = 0; i <= Rounds; i++)
+    {
+        rk[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(roundKeys[i].data()));
+    }
+}
+
+// Runs rounds Round..Rounds-1 of N independent blocks. The recursion unrolls into straight-line
+// code, with nothing but AESENC/AESDEC and the round keys' loads.
+template <int Round, int Rounds, int N, bool Decrypt>
+AESNI_TARGET static inline void middleRounds(__m128i* b, const __m128i* rk)
+{
+    if constexpr (Round < Rounds)
+    {
+        for (int j = 0; j < N; j++) b[j] = Decrypt ? _mm_aesdec_si128(b[j], rk[Round]) : _mm_aesenc_si128(b[j], rk[Round]);
+        middleRounds<Round + 1, Rounds, N, Decrypt>(b, rk);
+    }
+}
+
+// Runs N independent blocks through the cipher together. AESENC has a latency of several cycles
+// but can start a new instruction every cycle, so interleaving blocks keeps the AES unit busy.
+template <int Rounds, int N>
+AESNI_TARGET static inline void encryptLanes(__m128i* b, const __m128i* rk)
+{
+    for (int j = 0; j < N; j++) b[j] = _mm_xor_si128(b[j], rk[0]);
+    middleRounds<1, Rounds, N, false>(b, rk);
+    for (int j = 0; j < N; j++) b[j] = _mm_aesenclast_si128(b[j], rk[Rounds]);
+}
+
+template <int Rounds, int N>
+AESNI_TARGET static inline void decryptLanes(__m128i* b, const __m128i* rk)
+{
+    for (int j = 0; j < N; j++) b[j] = _mm_xor_si128(b[j], rk[0]);
+    middleRounds<1, Rounds, N, true>(b, rk);
+    for (int j = 0; j < N; j++) b[j] = _mm_aesdeclast_si128(b[j], rk[Rounds]);
+}
+
+// ECB: load N blocks, run them through the cipher, and store them
+template <int Rounds, int N, bool Decrypt>
+AESNI_TARGET static inline void ecbLanes(const uint8_t* in, uint8_t* out, const __m128i* rk)
+{
+    __m128i b[N];
+    for (int j = 0; j < N; j++) b[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in) + j);
+    if constexpr (Decrypt)
+    {
+        decryptLanes<Rounds, N>(b, rk);
+    }
+    else
+    {
+        encryptLanes<Rounds, N>(b, rk);
+    }
+    for (int j = 0; j < N; j++) _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + j, b[j]);
+}
+
+// CBC decryption: each plaintext block is the decrypted block XORed with the previous ciphertext
+// block. All N ciphertext blocks are loaded before anything is stored, so in-place works.
+template <int Rounds, int N>
+AESNI_TARGET static inline void cbcDecryptLanes(const uint8_t* in, uint8_t* out, __m128i& prev, const __m128i* rk)
+{
+    __m128i c[N];
+    __m128i b[N];
+    for (int j = 0; j < N; j++)
+    {
+        c[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in) + j);
+        b[j] = c[j];
+    }
+    decryptLanes<Rounds, N>(b, rk);
+    b[0] = _mm_xor_si128(b[0], prev);
+    for (int j = 1; j < N; j++) b[j] = _mm_xor_si128(b[j], c[j-1]);
+    prev = c[N-1];
+    for (int j = 0; j < N; j++) _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + j, b[j]);
+}
+
+// ECB over any number of blocks, 8 at a time, then 4, then 1
+template <int Rounds, bool Decrypt>
+AESNI_TARGET static void ecbKernel(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    __m128i rk[Rounds + 1];
+    loadRoundKeys<Rounds>(roundKeys, rk);
+    size_t b = 0;
+    for (; b + 8 <= numBlocks; b += 8) ecbLanes<Rounds, 8, Decrypt>(in + 16*b, out + 16*b, rk);
+    for (; b + 4 <= numBlocks; b += 4) ecbLanes<Rounds, 4, Decrypt>(in + 16*b, out + 16*b, rk);
+    for (; b < numBlocks; b++)         ecbLanes<Rounds, 1, Decrypt>(in + 16*b, out + 16*b, rk);
+}
+
+template <int Rounds>
+AESNI_TARGET static void encryptKernel(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    ecbKernel<Rounds, false>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+AESNI_TARGET static void decryptKernel(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    ecbKernel<Rounds, true>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+AESNI_TARGET static void cbcDecryptKernel(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out,
+                                          size_t numBlocks, std::array<uint8_t, 16>& iv)
+{
+    __m128i rk[Rounds + 1];
+    loadRoundKeys<Rounds>(roundKeys, rk);
+    __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(iv.data()));
+    size_t b = 0;
+    for (; b + 8 <= numBlocks; b += 8) cbcDecryptLanes<Rounds, 8>(in + 16*b, out + 16*b, prev, rk);
+    for (; b + 4 <= numBlocks; b += 4) cbcDecryptLanes<Rounds, 4>(in + 16*b, out + 16*b, prev, rk);
+    for (; b < numBlocks; b++)         cbcDecryptLanes<Rounds, 1>(in + 16*b, out + 16*b, prev, rk);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv.data()), prev);
+}
+
+AESNI_TARGET void AES::encryptBlockAESNI(const uint8_t* in, uint8_t* out) const
+{
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, encryptKernel, m_keys->m_roundKeys.data(), in, out, 1);
+}
+
+AESNI_TARGET void AES::decryptBlockAESNI(const uint8_t* in, uint8_t* out) const
+{
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, decryptKernel, m_keys->m_invRoundKeys.data(), in, out, 1);
+}
+
+AESNI_TARGET void AES::encryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, encryptKernel, m_keys->m_roundKeys.data(), in, out, numBlocks);
+}
+
+AESNI_TARGET void AES::decryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, decryptKernel, m_keys->m_invRoundKeys.data(), in, out, numBlocks);
+}
+
+AESNI_TARGET void AES::decryptBlocksCBCAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks,
+                                             std::array<uint8_t, 16>& iv) const
+{
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, cbcDecryptKernel, m_keys->m_invRoundKeys.data(), in, out, numBlocks, iv);
+}
+
+//////////////// Multi-buffer CBC ////////////////
+
+// The number of messages encryptCBCBatch keeps in flight, one block of each per step. CBC
+// encryption of one message can't start a block until the one before is done, so it leaves the
+// AES unit idle for most of AESENC's latency; blocks of other messages fill in those gaps.
+static constexpr int CBC_BATCH_LANES = 8;
+
+// Runs rounds Round..Rounds-1 of each lane's block, with each lane's own round keys
+template <int Round, int Rounds>
+AESNI_TARGET static inline void laneRounds(__m128i* b, const __m128i* const* rk)
+{
+    if constexpr (Round < Rounds)
+    {
+        for (int j = 0; j < CBC_BATCH_LANES; j++) b[j] = _mm_aesenc_si128(b[j], _mm_loadu_si128(rk[j] + Round));
+        laneRounds<Round + 1, Rounds>(b, rk);
+    }
+}
+
+// CBC-encrypts jobs[indices[0..count)], whose round keys are roundKeys[0..count), a lane per message.
+// Each pass runs every lane for as many blocks as the shortest message in a lane has left, and
+// then gives each lane that finished the next message. Lanes with nothing left to do encrypt a
+// scratch block with zero round keys, so every step runs all of them without branching.
+template <int Rounds>
+AESNI_TARGET static void cbcBatchKernel(AES::CBCJob* jobs, const size_t* indices,
+                                        const std::array<uint8_t, 16>* const* roundKeys, size_t count)
+{
+    __m128i zeroKeys[Rounds + 1] = {};
+    alignas(16) uint8_t scratch[16] = {};
+    const __m128i* rk[CBC_BATCH_LANES];
+    const uint8_t* in[CBC_BATCH_LANES];
+    uint8_t* out[CBC_BATCH_LANES];
+    size_t stride[CBC_BATCH_LANES];
+    size_t blocksLeft[CBC_BATCH_LANES] = {};
+    AES::CBCJob* job[CBC_BATCH_LANES] = {};
+    __m128i iv[CBC_BATCH_LANES];
+
+    size_t next = 0;
+    for (;;)
+    {
+        size_t steps = SIZE_MAX;
+        for (int j = 0; j < CBC_BATCH_LANES; j++)
+        {
+            if (blocksLeft[j] == 0)
+            {
+                if (job[j] != nullptr)
+                {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(job[j]->iv.data()), iv[j]);
+                    job[j] = nullptr;
+                }
+                // Empty messages keep their IV, and don't need a lane
+                while (next < count && jobs[indices[next]].in.empty()) next++;
+                if (next < count)
+                {
+                    job[j] = &jobs[indices[next]];
+                    rk[j] = reinterpret_cast<const __m128i*>(roundKeys[next]);
+                    in[j] = job[j]->in.data();
+                    out[j] = job[j]->out.data();
+                    stride[j] = 16;
+                    blocksLeft[j] = job[j]->in.size() / 16;
+                    iv[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(job[j]->iv.data()));
+                    next++;
+                }
+                else
+                {
+                    rk[j] = zeroKeys;
+                    in[j] = out[j] = scratch;
+                    stride[j] = 0;
+                    iv[j] = _mm_setzero_si128();
+                }
+            }
+            if (blocksLeft[j] > 0) steps = std::min(steps, blocksLeft[j]);
+        }
+        if (steps == SIZE_MAX)
+        {
+            break;
+        }
+
+        for (size_t s = 0; s < steps; s++)
+        {
+            __m128i b[CBC_BATCH_LANES];
+            for (int j = 0; j < CBC_BATCH_LANES; j++)
+            {
+                b[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in[j])), iv[j]), _mm_loadu_si128(rk[j]));
+            }
+            laneRounds<1, Rounds>(b, rk);
+            for (int j = 0; j < CBC_BATCH_LANES; j++)
+            {
+                iv[j] = _mm_aesenclast_si128(b[j], _mm_loadu_si128(rk[j] + Rounds));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out[j]), iv[j]);
+                in[j] += stride[j];
+                out[j] += stride[j];
+            }
+        }
+        for (int j = 0; j < CBC_BATCH_LANES; j++)
+        {
+            if (blocksLeft[j] > 0) blocksLeft[j] -= steps;
+        }
+    }
+}
+
+AESNI_TARGET void AES::encryptCBCBatchAESNI(CBCJob* jobs, const size_t* indices,
+                                            const std::array<uint8_t, 16>* const* roundKeys, size_t count, int rounds)
+{
+    return AES_DISPATCH_ROUNDS(rounds, cbcBatchKernel, jobs, indices, roundKeys, count);
+}
+
+//////////////// GCM ////////////////
+
+// GHASH's bits are reflected: the first bit of a block is the coefficient of x^0. Reversing the
+// bytes of a block puts the bits of each byte in the right order for PCLMULQDQ, with the
+// coefficients of the product coming out shifted by one bit, which ghashReduce fixes up.
+GCM_TARGET static inline __m128i byteReverse(__m128i v)
+{
+    return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Adds the 256-bit carry-less product of a and b into (lo, hi)
+GCM_TARGET static inline void clmulAccumulate(__m128i a, __m128i b, __m128i& lo, __m128i& hi)
+{
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    lo = _mm_xor_si128(lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(middle, 8)));
+    hi = _mm_xor_si128(hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(middle, 8)));
+}
+
+// Reduces a 256-bit product modulo the GHASH polynomial x^128 + x^7 + x^2 + x + 1, after
+// shifting it left by one bit to undo the reflection (Intel's "Carry-Less Multiplication and Its
+// Usage for Computing the GCM Mode", algorithm 5). Since the reduction is linear, several
+// products can be added together first and reduced once.
+GCM_TARGET static inline __m128i ghashReduce(__m128i lo, __m128i hi)
+{
+    // Shift (hi, lo) left by one bit
+    __m128i carryLo = _mm_srli_epi32(lo, 31);
+    __m128i carryHi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i carryAcross = _mm_srli_si128(carryLo, 12);
+    lo = _mm_or_si128(lo, _mm_slli_si128(carryLo, 4));
+    hi = _mm_or_si128(hi, _mm_slli_si128(carryHi, 4));
+    hi = _mm_or_si128(hi, carryAcross);
+
+    // Fold the low half into the high half: first by x^63, x^62, and x^57...
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i spill = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    // ...then by x^127, x^126, and x^121
+    __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    b = _mm_xor_si128(b, spill);
+    lo = _mm_xor_si128(lo, b);
+    return _mm_xor_si128(hi, lo);
+}
+
+GCM_TARGET static inline __m128i ghashMultiply(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    clmulAccumulate(a, b, lo, hi);
+    return ghashReduce(lo, hi);
+}
+
+// Hashes 8 byte-reversed blocks into x: ((x ^ y0) * H^8) ^ (y1 * H^7) ^ ... ^ (y7 * H),
+// which equals 8 rounds of x = (x ^ y) * H, with a single reduction.
+GCM_TARGET static inline __m128i ghash8(__m128i x, const __m128i* y, const __m128i* h)
+{
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    clmulAccumulate(_mm_xor_si128(x, y[0]), h[7], lo, hi);
+    for (int j = 1; j < 8; j++) clmulAccumulate(y[j], h[7 - j], lo, hi);
+    return ghashReduce(lo, hi);
+}
+
+GCM_TARGET static inline void loadPowers(const std::array<std::array<uint8_t, 16>, 8>& powers, __m128i* h)
+{
+    for (int i = 0; i < 8; i++) h[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(powers[i].data()));
+}
+
+GCM_TARGET void AES::initGHashCLMUL(GHashKey& key, const uint8_t* h)
+{
+    __m128i h1 = byteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h)));
+    __m128i power = h1;
+    for (int i = 0; i < 8; i++)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(key.powers[i].data()), power);
+        power = ghashMultiply(power, h1);
+    }
+}
+
+GCM_TARGET void AES::ghashCLMUL(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes)
+{
+    __m128i h[8];
+    loadPowers(key.powers, h);
+    __m128i xr = byteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x.data())));
+    for (; numBytes >= 128; numBytes -= 128, data += 128)
+    {
+        __m128i y[8];
+        for (int j = 0; j < 8; j++) y[j] = byteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + j));
+        xr = ghash8(xr, y, h);
+    }
+    while (numBytes > 0)
+    {
+        // Pad a partial final block with zeroes
+        alignas(16) uint8_t block[16] = {};
+        size_t length = numBytes < 16 ? numBytes : 16;
+        std::copy(data, data + length, block);
+        xr = ghashMultiply(_mm_xor_si128(xr, byteReverse(_mm_load_si128(reinterpret_cast<const __m128i*>(block)))), h[0]);
+        data += length;
+        numBytes -= length;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(x.data()), byteReverse(xr));
+}
+
+template <int Rounds>
+GCM_TARGET static size_t cryptGCMKernel(const std::array<uint8_t, 16>* roundKeys, const __m128i* h, const uint8_t* in,
+                                        uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                                        std::array<uint8_t, 16>& x, bool decrypting)
+{
+    __m128i rk[Rounds + 1];
+    loadRoundKeys<Rounds>(roundKeys, rk);
+    __m128i xr = byteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x.data())));
+    // Byte-reversed, the counter's low 32 bits are in lane 0, where _mm_add_epi32 increments
+    // them without carrying into the nonce, just like GCM's counter
+    __m128i ctr = byteReverse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(counter.data())));
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+
+    // Each iteration encrypts 8 counter blocks while hashing the previous iteration's 8
+    // ciphertext blocks. The two don't depend on each other, so AESENC and PCLMULQDQ run side by side.
+    __m128i hashPending[8];
+    size_t done = 0;
+    for (; done + 128 <= numBytes; done += 128)
+    {
+        __m128i ks[8];
+        for (int j = 0; j < 8; j++)
+        {
+            ks[j] = byteReverse(ctr);
+            ctr = _mm_add_epi32(ctr, one);
+        }
+        encryptLanes<Rounds, 8>(ks, rk);
+        if (done > 0)
+        {
+            xr = ghash8(xr, hashPending, h);
+        }
+
+        const __m128i* src = reinterpret_cast<const __m128i*>(in + done);
+        __m128i* dst = reinterpret_cast<__m128i*>(out + done);
+        for (int j = 0; j < 8; j++)
+        {
+            __m128i data = _mm_loadu_si128(src + j);
+            __m128i result = _mm_xor_si128(data, ks[j]);
+            _mm_storeu_si128(dst + j, result);
+            hashPending[j] = byteReverse(decrypting ? data : result);
+        }
+    }
+    xr = ghash8(xr, hashPending, h);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(x.data()), byteReverse(xr));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(counter.data()), byteReverse(ctr));
+    return done;
+}
+
+GCM_TARGET size_t AES::cryptGCMAESNI(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                                     std::array<uint8_t, 16>& x, const GHashKey& key, bool decrypting) const
+{
+    if (numBytes < 128)
+    {
+        return 0;
+    }
+    __m128i h[8];
+    loadPowers(key.powers, h);
+    return AES_DISPATCH_ROUNDS(m_keys->m_rounds, cryptGCMKernel, m_keys->m_roundKeys.data(), h, in, out, numBytes, counter, x, decrypting);
+}
+
+#else // not x86
+
+bool AES::cpuSupportsAESNI()
+{
+    return false;
+}
+
+bool AES::cpuSupportsVAES256()
+{
+    return false;
+}
+
+bool AES::cpuSupportsVAES512()
+{
+    return false;
+}
+
+bool AES::cpuSupportsPCLMUL()
+{
+    return false;
+}
+
+void AES::KeySchedule::expandAESNI(const std::vector<uint8_t>& key)
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::encryptBlockAESNI(const uint8_t* in, uint8_t* out) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::decryptBlockAESNI(const uint8_t* in, uint8_t* out) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::encryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::decryptBlocksAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::decryptBlocksCBCAESNI(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::encryptCBCBatchAESNI(CBCJob* jobs, const size_t* indices, const std::array<uint8_t, 16>* const* roundKeys,
+                               size_t count, int rounds)
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+void AES::initGHashCLMUL(GHashKey& key, const uint8_t* h)
+{
+    throw std::logic_error("PCLMULQDQ is not available on this architecture.");
+}
+
+void AES::ghashCLMUL(const GHashKey& key, std::array<uint8_t, 16>& x, const uint8_t* data, size_t numBytes)
+{
+    throw std::logic_error("PCLMULQDQ is not available on this architecture.");
+}
+
+size_t AES::cryptGCMAESNI(const uint8_t* in, uint8_t* out, size_t numBytes, std::array<uint8_t, 16>& counter,
+                          std::array<uint8_t, 16>& x, const GHashKey& key, bool decrypting) const
+{
+    throw std::logic_error("AES-NI is not available on this architecture.");
+}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+// Generates AES's lookup tables at compile time from the definitions in FIPS-197, rather than
+// pasting them in as hex. Every table the cipher uses is built from three pieces: multiplication
+// in GF(2^8), the S-box (the multiplicative inverse followed by an affine transform), and the
+// MixColumns coefficients. A new layout for a faster kernel only needs a new generator here.
+namespace AESTables
+{
+    // Multiplies by x (i.e. 2) in GF(2^8), reducing by the AES polynomial x^8 + x^4 + x^3 + x + 1
+    constexpr uint8_t xtime(uint8_t a)
+    {
+        return static_cast<uint8_t>((a << 1) ^ ((a & 0x80) ? 0x1b : 0x00));
+    }
+
+    // Multiplies a and b in GF(2^8) by shifting and adding
+    constexpr uint8_t gmul(uint8_t a, uint8_t b)
+    {
+        uint8_t product = 0;
+        while (b != 0)
+        {
+            if (b & 1) product ^= a;
+            a = xtime(a);
+            b >>= 1;
+        }
+        return product;
+    }
+
+    // The multiplicative inverse in GF(2^8), which is a^254 since a^255 = 1. 0 maps to 0.
+    constexpr uint8_t ginverse(uint8_t a)
+    {
+        uint8_t result = 1;
+        uint8_t power = a;
+        for (int exponent = 254; exponent != 0; exponent >>= 1)
+        {
+            if (exponent & 1) result = gmul(result, power);
+            power = gmul(power, power);
+        }
+        return a == 0 ? 0 : result;
+    }
+
+    constexpr uint8_t rotateLeft8(uint8_t a, int n)
+    {
+        return static_cast<uint8_t>((a << n) | (a >> (8 - n)));
+    }
+
+    constexpr uint32_t rotateRight32(uint32_t a, int n)
+    {
+        return n == 0 ? a : (a >> n) | (a << (32 - n));
+    }
+
+    // SubBytes: the inverse, then the affine transform b ^ (b <<< 1) ^ (b <<< 2) ^ (b <<< 3) ^ (b <<< 4) ^ 0x63
+    constexpr std::array<uint8_t, 256> makeSBox()
+    {
+        std::array<uint8_t, 256> box = {};
+        for (int x = 0; x < 256; x++)
+        {
+            uint8_t b = ginverse(static_cast<uint8_t>(x));
+            box[x] = b ^ rotateLeft8(b, 1) ^ rotateLeft8(b, 2) ^ rotateLeft8(b, 3) ^ rotateLeft8(b, 4) ^ 0x63;
+        }
+        return box;
+    }
+
+    constexpr std::array<uint8_t, 256> makeInvSBox()
+    {
+        std::array<uint8_t, 256> sbox = makeSBox();
+        std::array<uint8_t, 256> box = {};
+        for (int x = 0; x < 256; x++) box[sbox[x]] = static_cast<uint8_t>(x);
+        return box;
+    }
+
+    // Every byte multiplied by a constant, as MixColumns and InvMixColumns need
+    constexpr std::array<uint8_t, 256> makeMulTable(uint8_t factor)
+    {
+        std::array<uint8_t, 256> table = {};
+        for (int x = 0; x < 256; x++) table[x] = gmul(static_cast<uint8_t>(x), factor);
+        return table;
+    }
+
+    // The key schedule's round constants: successive powers of x
+    constexpr std::array<uint8_t, 10> makeRoundConstants()
+    {
+        std::array<uint8_t, 10> rc = {};
+        uint8_t value = 1;
+        for (uint8_t& r : rc)
+        {
+            r = value;
+            value = xtime(value);
+        }
+        return rc;
+    }
+
+    // A T-table: each entry is a byte substituted through 'box' and then multiplied by a column
+    // of the (Inv)MixColumns matrix, packed big-endian into a word and rotated right by
+    // 8 * 'rotation' bits. The encryption tables use the column (2, 1, 1, 3) and the decryption
+    // tables (14, 9, 13, 11).
+    constexpr std::array<uint32_t, 256> makeTTable(const std::array<uint8_t, 256>& box,
+                                                   const std::array<uint8_t, 4>& column, int rotation)
+    {
+        std::array<uint32_t, 256> table = {};
+        for (int x = 0; x < 256; x++)
+        {
+            uint8_t s = box[x];
+            uint32_t word = (static_cast<uint32_t>(gmul(s, column[0])) << 24) |
+                            (static_cast<uint32_t>(gmul(s, column[1])) << 16) |
+                            (static_cast<uint32_t>(gmul(s, column[2])) << 8) |
+                             static_cast<uint32_t>(gmul(s, column[3]));
+            table[x] = rotateRight32(word, 8 * rotation);
+        }
+        return table;
+    }
+
+    constexpr std::array<uint8_t, 4> ENCRYPT_COLUMN = {2, 1, 1, 3};
+    constexpr std::array<uint8_t, 4> DECRYPT_COLUMN = {14, 9, 13, 11};
+}
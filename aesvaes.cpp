@@ -0,0 +1,302 @@
+#include "aes.h"
+#include <stdexcept>
+
+// The x86 VAES backends for AES are implemented here, rather than in aes.cpp.
+// VAES runs AESENC/AESDEC on every 128-bit lane of a ymm (2 blocks) or zmm (4 blocks) register.
+// Only the parallelizable multi-block kernels live here; everything else uses AES-NI.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define VAES256_TARGET
+#define VAES512_TARGET
+#else
+#define VAES256_TARGET __attribute__((target("vaes,avx2")))
+#define VAES512_TARGET __attribute__((target("vaes,avx512f")))
+#endif
+
+//////////////// 256-bit (AVX2) ////////////////
+
+// Loads the round keys, broadcasting each one to both lanes
+template <int Rounds>
+VAES256_TARGET static inline void loadRoundKeys256(const std::array<uint8_t, 16>* roundKeys, __m256i* rk)
+{
+    for (int i = 0; i <= Rounds; i++)
+    {
+        rk[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(roundKeys[i].data())));
+    }
+}
+
+// Runs rounds Round..Rounds-1, unrolled by the recursion
+template <int Round, int Rounds, int N, bool Decrypt>
+VAES256_TARGET static inline void middleRounds256(__m256i* b, const __m256i* rk)
+{
+    if constexpr (Round < Rounds)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            if constexpr (Decrypt) b[j] = _mm256_aesdec_epi128(b[j], rk[Round]);
+            else                   b[j] = _mm256_aesenc_epi128(b[j], rk[Round]);
+        }
+        middleRounds256<Round + 1, Rounds, N, Decrypt>(b, rk);
+    }
+}
+
+template <int Rounds, int N, bool Decrypt>
+VAES256_TARGET static inline void cipherLanes256(__m256i* b, const __m256i* rk)
+{
+    for (int j = 0; j < N; j++) b[j] = _mm256_xor_si256(b[j], rk[0]);
+    middleRounds256<1, Rounds, N, Decrypt>(b, rk);
+    for (int j = 0; j < N; j++)
+    {
+        if constexpr (Decrypt) b[j] = _mm256_aesdeclast_epi128(b[j], rk[Rounds]);
+        else                   b[j] = _mm256_aesenclast_epi128(b[j], rk[Rounds]);
+    }
+}
+
+// ECB on N registers (2N blocks)
+template <int Rounds, int N, bool Decrypt>
+VAES256_TARGET static inline void ecbLanes256(const uint8_t* in, uint8_t* out, const __m256i* rk)
+{
+    __m256i b[N];
+    for (int j = 0; j < N; j++) b[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in) + j);
+    cipherLanes256<Rounds, N, Decrypt>(b, rk);
+    for (int j = 0; j < N; j++) _mm256_storeu_si256(reinterpret_cast<__m256i*>(out) + j, b[j]);
+}
+
+// CBC decryption on N registers (2N blocks). The upper lane of 'prev' holds the ciphertext block
+// before 'in'. Each register's chaining values are the ciphertext shifted up by one lane, with the
+// upper lane of the register before it shifted in.
+template <int Rounds, int N>
+VAES256_TARGET static inline void cbcDecryptLanes256(const uint8_t* in, uint8_t* out, __m256i& prev, const __m256i* rk)
+{
+    __m256i c[N];
+    __m256i b[N];
+    for (int j = 0; j < N; j++)
+    {
+        c[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in) + j);
+        b[j] = c[j];
+    }
+    cipherLanes256<Rounds, N, true>(b, rk);
+    b[0] = _mm256_xor_si256(b[0], _mm256_permute2x128_si256(prev, c[0], 0x21));
+    for (int j = 1; j < N; j++) b[j] = _mm256_xor_si256(b[j], _mm256_permute2x128_si256(c[j-1], c[j], 0x21));
+    prev = c[N-1];
+    for (int j = 0; j < N; j++) _mm256_storeu_si256(reinterpret_cast<__m256i*>(out) + j, b[j]);
+}
+
+// ECB over as many whole registers as fit, returning the number of blocks done
+template <int Rounds, bool Decrypt>
+VAES256_TARGET static size_t ecbKernel256(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    __m256i rk[Rounds + 1];
+    loadRoundKeys256<Rounds>(roundKeys, rk);
+    size_t b = 0;
+    for (; b + 8 <= numBlocks; b += 8) ecbLanes256<Rounds, 4, Decrypt>(in + 16*b, out + 16*b, rk);
+    for (; b + 2 <= numBlocks; b += 2) ecbLanes256<Rounds, 1, Decrypt>(in + 16*b, out + 16*b, rk);
+    return b;
+}
+
+template <int Rounds>
+VAES256_TARGET static size_t encryptKernel256(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    return ecbKernel256<Rounds, false>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+VAES256_TARGET static size_t decryptKernel256(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    return ecbKernel256<Rounds, true>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+VAES256_TARGET static size_t cbcDecryptKernel256(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out,
+                                         size_t numBlocks, std::array<uint8_t, 16>& iv)
+{
+    __m256i rk[Rounds + 1];
+    loadRoundKeys256<Rounds>(roundKeys, rk);
+    __m256i prev = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(iv.data())));
+    size_t b = 0;
+    for (; b + 8 <= numBlocks; b += 8) cbcDecryptLanes256<Rounds, 4>(in + 16*b, out + 16*b, prev, rk);
+    for (; b + 2 <= numBlocks; b += 2) cbcDecryptLanes256<Rounds, 1>(in + 16*b, out + 16*b, prev, rk);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv.data()), _mm256_extracti128_si256(prev, 1));
+    return b;
+}
+
+VAES256_TARGET void AES::encryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, encryptKernel256, m_keys->m_roundKeys.data(), in, out, numBlocks);
+    if (b < numBlocks) encryptBlocksAESNI(in + 16*b, out + 16*b, numBlocks - b);
+}
+
+VAES256_TARGET void AES::decryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, decryptKernel256, m_keys->m_invRoundKeys.data(), in, out, numBlocks);
+    if (b < numBlocks) decryptBlocksAESNI(in + 16*b, out + 16*b, numBlocks - b);
+}
+
+VAES256_TARGET void AES::decryptBlocksCBCVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks,
+                                                 std::array<uint8_t, 16>& iv) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, cbcDecryptKernel256, m_keys->m_invRoundKeys.data(), in, out, numBlocks, iv);
+    if (b < numBlocks) decryptBlocksCBCAESNI(in + 16*b, out + 16*b, numBlocks - b, iv);
+}
+
+//////////////// 512-bit (AVX-512) ////////////////
+
+// Loads the round keys, broadcasting each one to all four lanes
+template <int Rounds>
+VAES512_TARGET static inline void loadRoundKeys512(const std::array<uint8_t, 16>* roundKeys, __m512i* rk)
+{
+    for (int i = 0; i <= Rounds; i++)
+    {
+        rk[i] = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(roundKeys[i].data())));
+    }
+}
+
+// Runs rounds Round..Rounds-1, unrolled by the recursion
+template <int Round, int Rounds, int N, bool Decrypt>
+VAES512_TARGET static inline void middleRounds512(__m512i* b, const __m512i* rk)
+{
+    if constexpr (Round < Rounds)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            if constexpr (Decrypt) b[j] = _mm512_aesdec_epi128(b[j], rk[Round]);
+            else                   b[j] = _mm512_aesenc_epi128(b[j], rk[Round]);
+        }
+        middleRounds512<Round + 1, Rounds, N, Decrypt>(b, rk);
+    }
+}
+
+template <int Rounds, int N, bool Decrypt>
+VAES512_TARGET static inline void cipherLanes512(__m512i* b, const __m512i* rk)
+{
+    for (int j = 0; j < N; j++) b[j] = _mm512_xor_si512(b[j], rk[0]);
+    middleRounds512<1, Rounds, N, Decrypt>(b, rk);
+    for (int j = 0; j < N; j++)
+    {
+        if constexpr (Decrypt) b[j] = _mm512_aesdeclast_epi128(b[j], rk[Rounds]);
+        else                   b[j] = _mm512_aesenclast_epi128(b[j], rk[Rounds]);
+    }
+}
+
+// ECB on N registers (4N blocks)
+template <int Rounds, int N, bool Decrypt>
+VAES512_TARGET static inline void ecbLanes512(const uint8_t* in, uint8_t* out, const __m512i* rk)
+{
+    __m512i b[N];
+    for (int j = 0; j < N; j++) b[j] = _mm512_loadu_si512(in + 64*j);
+    cipherLanes512<Rounds, N, Decrypt>(b, rk);
+    for (int j = 0; j < N; j++) _mm512_storeu_si512(out + 64*j, b[j]);
+}
+
+// CBC decryption on N registers (4N blocks). Lane 3 of 'prev' holds the ciphertext block before
+// 'in'. VALIGNQ by 6 qwords shifts each register up one lane, shifting in lane 3 of the one before.
+template <int Rounds, int N>
+VAES512_TARGET static inline void cbcDecryptLanes512(const uint8_t* in, uint8_t* out, __m512i& prev, const __m512i* rk)
+{
+    __m512i c[N];
+    __m512i b[N];
+    for (int j = 0; j < N; j++)
+    {
+        c[j] = _mm512_loadu_si512(in + 64*j);
+        b[j] = c[j];
+    }
+    cipherLanes512<Rounds, N, true>(b, rk);
+    b[0] = _mm512_xor_si512(b[0], _mm512_alignr_epi64(c[0], prev, 6));
+    for (int j = 1; j < N; j++) b[j] = _mm512_xor_si512(b[j], _mm512_alignr_epi64(c[j], c[j-1], 6));
+    prev = c[N-1];
+    for (int j = 0; j < N; j++) _mm512_storeu_si512(out + 64*j, b[j]);
+}
+
+// ECB over as many whole registers as fit, returning the number of blocks done
+template <int Rounds, bool Decrypt>
+VAES512_TARGET static size_t ecbKernel512(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    __m512i rk[Rounds + 1];
+    loadRoundKeys512<Rounds>(roundKeys, rk);
+    size_t b = 0;
+    for (; b + 16 <= numBlocks; b += 16) ecbLanes512<Rounds, 4, Decrypt>(in + 16*b, out + 16*b, rk);
+    for (; b + 4 <= numBlocks; b += 4) ecbLanes512<Rounds, 1, Decrypt>(in + 16*b, out + 16*b, rk);
+    return b;
+}
+
+template <int Rounds>
+VAES512_TARGET static size_t encryptKernel512(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    return ecbKernel512<Rounds, false>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+VAES512_TARGET static size_t decryptKernel512(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out, size_t numBlocks)
+{
+    return ecbKernel512<Rounds, true>(roundKeys, in, out, numBlocks);
+}
+
+template <int Rounds>
+VAES512_TARGET static size_t cbcDecryptKernel512(const std::array<uint8_t, 16>* roundKeys, const uint8_t* in, uint8_t* out,
+                                         size_t numBlocks, std::array<uint8_t, 16>& iv)
+{
+    __m512i rk[Rounds + 1];
+    loadRoundKeys512<Rounds>(roundKeys, rk);
+    __m512i prev = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(iv.data())));
+    size_t b = 0;
+    for (; b + 16 <= numBlocks; b += 16) cbcDecryptLanes512<Rounds, 4>(in + 16*b, out + 16*b, prev, rk);
+    for (; b + 4 <= numBlocks; b += 4) cbcDecryptLanes512<Rounds, 1>(in + 16*b, out + 16*b, prev, rk);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(iv.data()), _mm512_extracti32x4_epi32(prev, 3));
+    return b;
+}
+
+VAES512_TARGET void AES::encryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, encryptKernel512, m_keys->m_roundKeys.data(), in, out, numBlocks);
+    if (b < numBlocks) encryptBlocksAESNI(in + 16*b, out + 16*b, numBlocks - b);
+}
+
+VAES512_TARGET void AES::decryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, decryptKernel512, m_keys->m_invRoundKeys.data(), in, out, numBlocks);
+    if (b < numBlocks) decryptBlocksAESNI(in + 16*b, out + 16*b, numBlocks - b);
+}
+
+VAES512_TARGET void AES::decryptBlocksCBCVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks,
+                                                 std::array<uint8_t, 16>& iv) const
+{
+    size_t b = AES_DISPATCH_ROUNDS(m_keys->m_rounds, cbcDecryptKernel512, m_keys->m_invRoundKeys.data(), in, out, numBlocks, iv);
+    if (b < numBlocks) decryptBlocksCBCAESNI(in + 16*b, out + 16*b, numBlocks - b, iv);
+}
+
+#else // not x86
+
+void AES::encryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+void AES::decryptBlocksVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+void AES::decryptBlocksCBCVAES256(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+void AES::encryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+void AES::decryptBlocksVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+void AES::decryptBlocksCBCVAES512(const uint8_t* in, uint8_t* out, size_t numBlocks, std::array<uint8_t, 16>& iv) const
+{
+    throw std::logic_error("VAES is not available on this architecture.");
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include "aes.h"
+#include "mappedfile.h"
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+// XTS mode (IEEE 1619 / NIST SP 800-38E). Each sector's tweak is its number, as a 16-byte
+// little-endian value, encrypted with the tweak key. Block j of the sector is encrypted as
+// E(P ^ T_j) ^ T_j, where T_j is the tweak multiplied by x^j in GF(2^128). All of a sector's
+// tweaks are worked out first, so the blocks themselves go through the backend's multi-block
+// kernels like ECB.
+
+// Multiplies a tweak by x in GF(2^128). XTS stores it little-endian: shift left by one bit, and
+// fold the bit that falls off the top back in with the polynomial x^128 + x^7 + x^2 + x + 1.
+static inline void multiplyTweak(const uint8_t* in, uint8_t* out)
+{
+    uint8_t carry = in[15] >> 7;
+    for (int i = 15; i > 0; i--)
+    {
+        out[i] = static_cast<uint8_t>((in[i] << 1) | (in[i - 1] >> 7));
+    }
+    out[0] = static_cast<uint8_t>((in[0] << 1) ^ (carry * 0x87));
+}
+
+static inline void xorBlocks(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t numBytes)
+{
+    for (size_t i = 0; i < numBytes; i++) out[i] = a[i] ^ b[i];
+}
+
+void AES::setTweakKey(const std::vector<uint8_t>& key)
+{
+    std::unique_ptr<AES> tweakCipher(new AES());
+    tweakCipher->m_backend = m_backend;
+    if (!tweakCipher->keyExpansion(key))
+    {
+        throw std::invalid_argument("Error: The tweak key is invalid. Key must be 128, 192, or 256 bits.");
+    }
+    if (tweakCipher->m_keys->m_rounds != m_keys->m_rounds)
+    {
+        throw std::invalid_argument("Error: The tweak key must be the same size as the key.");
+    }
+    // Equal keys would make the tweak of sector 0 the encryption of an all-zero block, which
+    // an attacker can get at
+    if (tweakCipher->m_keys->m_roundKeys == m_keys->m_roundKeys)
+    {
+        throw std::invalid_argument("Error: The tweak key must be different from the key.");
+    }
+    m_tweakCipher = std::move(tweakCipher);
+}
+
+void AES::setSectorSize(size_t sectorSize)
+{
+    if (sectorSize == 0 || sectorSize % 16 != 0)
+    {
+        throw std::invalid_argument("Error: The sector size must be a positive multiple of 16 bytes.");
+    }
+    m_sectorSize = sectorSize;
+}
+
+void AES::cryptSector(const uint8_t* in, uint8_t* out, size_t size, uint64_t sector, uint8_t* tweaks,
+                      bool decrypting) const
+{
+    // With a partial last block, the last whole block is done separately for ciphertext
+    // stealing, which takes two tweaks
+    size_t numBlocks = size / 16;
+    size_t leftover = size % 16;
+    size_t bulkBlocks = leftover != 0 ? numBlocks - 1 : numBlocks;
+
+    std::array<uint8_t, 16> tweak = {};
+    for (int i = 0; i < 8; i++) tweak[i] = static_cast<uint8_t>(sector >> (8 * i));
+    m_tweakCipher->encryptBlock(tweak.data(), tweaks);
+    for (size_t j = 1; j < numBlocks; j++)
+    {
+        multiplyTweak(tweaks + 16 * (j - 1), tweaks + 16 * j);
+    }
+
+    xorBlocks(in, tweaks, out, 16 * bulkBlocks);
+    if (decrypting)
+    {
+        decryptBlocks(out, out, bulkBlocks);
+    }
+    else
+    {
+        encryptBlocks(out, out, bulkBlocks);
+    }
+    xorBlocks(out, tweaks, out, 16 * bulkBlocks);
+    if (leftover == 0)
+    {
+        return;
+    }
+
+    // Ciphertext stealing. The last whole block is done with the tweak after its own; its first
+    // 'leftover' bytes become the short last block, and the rest fill out the last block, which
+    // is done with the last whole block's tweak and goes in its place. Decryption undoes that in
+    // the same order, so the tweaks swap places.
+    const uint8_t* lastWholeTweak = tweaks + 16 * bulkBlocks;
+    std::array<uint8_t, 16> stealTweak;
+    multiplyTweak(lastWholeTweak, stealTweak.data());
+    const uint8_t* firstTweak = decrypting ? stealTweak.data() : lastWholeTweak;
+    const uint8_t* secondTweak = decrypting ? lastWholeTweak : stealTweak.data();
+
+    auto cryptOneBlock = [&](uint8_t* b)
+    {
+        if (decrypting)
+        {
+            decryptBlock(b, b);
+        }
+        else
+        {
+            encryptBlock(b, b);
+        }
+    };
+    std::array<uint8_t, 16> block;
+    const uint8_t* lastWholeIn = in + 16 * bulkBlocks;
+    xorBlocks(lastWholeIn, firstTweak, block.data(), 16);
+    cryptOneBlock(block.data());
+    xorBlocks(block.data(), firstTweak, block.data(), 16);
+
+    // Read the short block before anything is written, since 'in' may be 'out'
+    std::array<uint8_t, 16> stolen;
+    std::copy(lastWholeIn + 16, lastWholeIn + 16 + leftover, stolen.begin());
+    std::copy(block.begin() + leftover, block.end(), stolen.begin() + leftover);
+    std::copy(block.begin(), block.begin() + leftover, out + 16 * bulkBlocks + 16);
+
+    xorBlocks(stolen.data(), secondTweak, block.data(), 16);
+    cryptOneBlock(block.data());
+    xorBlocks(block.data(), secondTweak, out + 16 * bulkBlocks, 16);
+    std::fill(block.begin(), block.end(), 0);
+    std::fill(stolen.begin(), stolen.end(), 0);
+}
+
+void AES::cryptSectors(std::span<const uint8_t> in, std::span<uint8_t> out, uint64_t firstSector,
+                       bool decrypting) const
+{
+    if (!m_tweakCipher)
+    {
+        throw std::invalid_argument("Error: XTS mode needs a tweak key.");
+    }
+    if (out.size() != in.size())
+    {
+        throw std::invalid_argument("Error: XTS output must be the same size as the input.");
+    }
+    if (in.empty())
+    {
+        return;
+    }
+    size_t sectorSize = m_sectorSize;
+    uint64_t numSectors = (in.size() + sectorSize - 1) / sectorSize;
+    if (in.size() - (numSectors - 1) * sectorSize < 16)
+    {
+        throw std::invalid_argument("Error: XTS needs at least 16 bytes in every sector, including the last.");
+    }
+
+    forEachChunkRange(numSectors, sectorSize, [&](uint64_t first, uint64_t count)
+    {
+        std::vector<uint8_t> tweaks(sectorSize);
+        for (uint64_t s = first; s < first + count; s++)
+        {
+            size_t offset = static_cast<size_t>(s * sectorSize);
+            size_t size = std::min(sectorSize, in.size() - offset);
+            cryptSector(in.data() + offset, out.data() + offset, size, firstSector + s, tweaks.data(), decrypting);
+        }
+        std::fill(tweaks.begin(), tweaks.end(), 0);
+    });
+}
+
+void AES::encryptSectors(std::span<const uint8_t> plaintext, std::span<uint8_t> ciphertext, uint64_t firstSector) const
+{
+    cryptSectors(plaintext, ciphertext, firstSector, false);
+}
+
+void AES::decryptSectors(std::span<const uint8_t> ciphertext, std::span<uint8_t> plaintext, uint64_t firstSector) const
+{
+    cryptSectors(ciphertext, plaintext, firstSector, true);
+}
+
+void AES::cryptSectorsStream(std::istream& in, std::ostream& out, uint64_t firstSector, bool decrypting) const
+{
+    // Read whole sectors at a time, so only the last read can end in a short sector
+    size_t sectorsPerChunk = std::max<size_t>(1, m_chunkSize / m_sectorSize);
+    std::vector<uint8_t> buffer(sectorsPerChunk * m_sectorSize);
+    for (uint64_t sector = firstSector; ; sector += sectorsPerChunk)
+    {
+        in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+        size_t numBytes = in.gcount();
+        if (numBytes == 0)
+        {
+            break;
+        }
+        std::span<uint8_t> chunk(buffer.data(), numBytes);
+        cryptSectors(chunk, chunk, sector, decrypting);
+        out.write(reinterpret_cast<char*>(buffer.data()), numBytes);
+        if (numBytes < buffer.size())
+        {
+            break;
+        }
+    }
+}
+
+void AES::encryptSectors(std::istream& plaintext, std::ostream& ciphertext, uint64_t firstSector) const
+{
+    cryptSectorsStream(plaintext, ciphertext, firstSector, false);
+}
+
+void AES::decryptSectors(std::istream& ciphertext, std::ostream& plaintext, uint64_t firstSector) const
+{
+    cryptSectorsStream(ciphertext, plaintext, firstSector, true);
+}
+
+bool AES::decryptSectorsFile(const std::string& inputPath, const std::string& outputPath) const
+{
+    std::error_code error;
+    if (!MappedFile::isMappable(inputPath) ||
+        (std::filesystem::exists(outputPath, error) && !MappedFile::isMappable(outputPath)))
+    {
+        return false;
+    }
+    MappedFile input(inputPath);
+    MappedFile output(outputPath, input.size());
+    decryptSectors(std::span<const uint8_t>(input.data(), input.size()), std::span<uint8_t>(output.data(), output.size()), 0);
+    return true;
+}
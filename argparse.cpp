@@ -206,6 +206,13 @@ void ArgumentParser::addMutuallyExclusiveArguments(const vector<Argument>& args,
 //////////////////// Parsing Command Line Arguments /////////////////////
 /////////////////////////////////////////////////////////////////////////
 
+// Whether a command-line argument looks like an option. A lone "-" doesn't, since it
+// conventionally stands for stdin or stdout.
+static bool looksLikeOption(const string& arg)
+{
+    return arg.length() > 1 && arg[0] == '-';
+}
+
 void ArgumentParser::parse(int argc, char** argv)
 {
     vector<string> args(argv, argv + argc);
@@ -236,7 +243,7 @@ void ArgumentParser::parse(const vector<string>& args)
         string baseArg = expArgs[argsIndex];
         argsIndex++;
 
-        if ((baseArg[0] == '-') && !foundEndOfOptions) // Is this an option or the end-of-options delimiter?
+        if (looksLikeOption(baseArg) && !foundEndOfOptions) // Is this an option or the end-of-options delimiter?
         {
             if (readingPositionals)
             {
@@ -378,7 +385,7 @@ int ArgumentParser::getNArgs(const vector<string>& args,
     if (nargs == NARGS_AT_LEAST_ONE || nargs == NARGS_AT_LEAST_ZERO)
     {
         int numArgs = 0;
-        while (argsIndex < args.size() && (args[argsIndex][0] != '-' || ignoreFlags))
+        while (argsIndex < args.size() && (!looksLikeOption(args[argsIndex]) || ignoreFlags))
         {
             outArgs.push_back(args[argsIndex]);
             numArgs++;
@@ -394,7 +401,7 @@ int ArgumentParser::getNArgs(const vector<string>& args,
     {
         for (int n = 0; n < nargs; n++)
         {
-            if (argsIndex < args.size() && (args[argsIndex][0] != '-' || ignoreFlags))
+            if (argsIndex < args.size() && (!looksLikeOption(args[argsIndex]) || ignoreFlags))
             {
                 outArgs.push_back(args[argsIndex]);
                 argsIndex++;
@@ -0,0 +1,195 @@
+#include "batchcrypt.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+std::vector<BatchCrypt::File> BatchCrypt::fromDirectory(const std::string& inputDir, const std::string& outputDir)
+{
+    if (!fs::is_directory(inputDir))
+    {
+        throw std::invalid_argument("Error: Not a directory: " + inputDir);
+    }
+    std::vector<File> files;
+    std::error_code error;
+    for (auto it = fs::recursive_directory_iterator(inputDir, fs::directory_options::skip_permission_denied);
+         it != fs::recursive_directory_iterator(); ++it)
+    {
+        // Don't encrypt our own output when the output tree is inside the input tree
+        if (it->is_directory() && fs::equivalent(it->path(), outputDir, error))
+        {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (!it->is_regular_file())
+        {
+            continue;
+        }
+        File file;
+        file.input = it->path().string();
+        file.output = (fs::path(outputDir) / it->path().lexically_relative(inputDir)).string();
+        file.size = it->file_size();
+        files.push_back(std::move(file));
+    }
+    return files;
+}
+
+std::vector<BatchCrypt::File> BatchCrypt::fromManifest(const std::string& manifest, const std::string& outputDir)
+{
+    std::ifstream in(manifest);
+    if (!in)
+    {
+        throw std::invalid_argument("Error: Failed to open manifest: " + manifest);
+    }
+    fs::path base = fs::path(manifest).parent_path();
+    std::vector<File> files;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+        fs::path path = fs::path(line).lexically_normal();
+        fs::path relative = path.relative_path();
+        if (!relative.empty() && *relative.begin() == "..")
+        {
+            throw std::invalid_argument("Error: Manifest paths can't go up out of their directory: " + line);
+        }
+        File file;
+        file.input = (path.is_absolute() ? path : base / path).string();
+        file.output = (fs::path(outputDir) / relative).string();
+        // A missing file is left to fail when it's encrypted, like any other unreadable file
+        std::error_code error;
+        uint64_t size = fs::file_size(file.input, error);
+        file.size = error ? 0 : size;
+        files.push_back(std::move(file));
+    }
+
+    std::vector<const File*> byOutput;
+    for (const File& file : files) byOutput.push_back(&file);
+    std::sort(byOutput.begin(), byOutput.end(), [](const File* a, const File* b) { return a->output < b->output; });
+    for (size_t i = 1; i < byOutput.size(); i++)
+    {
+        if (byOutput[i]->output == byOutput[i - 1]->output)
+        {
+            throw std::invalid_argument("Error: The manifest lists a file twice: " + byOutput[i]->input);
+        }
+    }
+    return files;
+}
+
+BatchCrypt::BatchCrypt(const AES& aes, bool encrypt, AES::Mode mode, bool force)
+    : m_aes(aes), m_encrypt(encrypt), m_mode(mode), m_force(force)
+{
+}
+
+uint64_t BatchCrypt::cryptFile(const File& file) const
+{
+    std::error_code error;
+    if (fs::exists(file.output, error) && !m_force)
+    {
+        throw std::invalid_argument("Error: Force option (-f) isn't used, and output file already exists: " + file.output);
+    }
+    if (fs::exists(file.output, error) && fs::equivalent(file.input, file.output, error))
+    {
+        throw std::invalid_argument("Error: The input and output files must be different files.");
+    }
+    fs::path parent = fs::path(file.output).parent_path();
+    if (!parent.empty())
+    {
+        fs::create_directories(parent);
+    }
+
+    bool xts = m_mode == AES::Mode::XTS;
+    try
+    {
+        cryptContents(file, xts);
+    }
+    catch (...)
+    {
+        // Don't leave behind plaintext that failed authentication, or a partial or zero-filled
+        // file that looks like ciphertext
+        fs::remove(file.output, error);
+        throw;
+    }
+    return fs::file_size(file.output);
+}
+
+void BatchCrypt::cryptContents(const File& file, bool xts) const
+{
+    bool mapped = m_encrypt ? m_aes.encryptFile(file.input, file.output, m_mode)
+                : xts ? m_aes.decryptSectorsFile(file.input, file.output)
+                : m_aes.decryptFile(file.input, file.output);
+    if (!mapped)
+    {
+        std::ifstream input(file.input, std::ios::in | std::ios::binary);
+        if (!input)
+        {
+            throw std::runtime_error("Error: Failed to open input file: " + file.input);
+        }
+        std::ofstream output(file.output, std::ios::out | std::ios::binary);
+        if (!output)
+        {
+            throw std::runtime_error("Error: Failed to open output file: " + file.output);
+        }
+        if (m_encrypt)
+        {
+            m_aes.encrypt(input, output, m_mode);
+        }
+        else if (xts)
+        {
+            m_aes.decryptSectors(input, output);
+        }
+        else
+        {
+            m_aes.decrypt(input, output);
+        }
+    }
+}
+
+BatchCrypt::Summary BatchCrypt::run(std::vector<File> files, std::ostream& errors) const
+{
+    // Largest first, so the big files start early instead of leaving one thread at the end with
+    // the biggest file while the others sit idle
+    std::stable_sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.size > b.size; });
+
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> failures{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::mutex errorsMutex;
+    ThreadPool::shared().parallelFor(files.size(), [&](size_t i)
+    {
+        const File& file = files[i];
+        try
+        {
+            bytesOut += cryptFile(file);
+            bytesIn += file.size;
+        }
+        catch (const std::exception& e)
+        {
+            failures++;
+            std::lock_guard<std::mutex> lock(errorsMutex);
+            errors << file.input << ": " << e.what() << "\n";
+        }
+    });
+
+    Summary summary;
+    summary.files = files.size();
+    summary.failures = failures;
+    summary.bytesIn = bytesIn;
+    summary.bytesOut = bytesOut;
+    summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return summary;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "aes.h"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Encrypts or decrypts many files with one AES object, for jobs over whole directory trees.
+// Files are spread over the shared thread pool, largest first. In the modes whose blocks can be
+// processed independently (ECB, CTR, Chunked, and XTS, and CBC decryption), encryptFile and
+// friends also split each large file into chunks on the same pool, so idle threads steal chunks
+// of big files once the small files run out. CBC encryption chains every block, and GCM hashes
+// the whole file as one chain, so those run each file on a single thread; Chunked mode is the
+// authenticated mode for batches with large files.
+class BatchCrypt
+{
+public:
+    // A file to encrypt or decrypt, and where its output goes
+    struct File
+    {
+        std::string input;
+        std::string output;
+        uint64_t size = 0;
+    };
+
+    struct Summary
+    {
+        uint64_t files = 0;
+        uint64_t failures = 0;
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+        double seconds = 0;
+    };
+
+    // Every regular file under 'inputDir', with its output at the same path under 'outputDir'.
+    // Throws std::invalid_argument if 'inputDir' isn't a directory.
+    static std::vector<File> fromDirectory(const std::string& inputDir, const std::string& outputDir);
+    // The files listed in 'manifest', one path per line, with blank lines skipped. Relative
+    // paths are relative to the manifest's directory, and each file's output goes at the same
+    // path under 'outputDir' (an absolute path drops its root). Throws std::invalid_argument for
+    // a path with "..", which would land outside 'outputDir', or a file listed twice.
+    static std::vector<File> fromManifest(const std::string& manifest, const std::string& outputDir);
+
+    // 'aes' must already have anything the mode needs, like a tweak key for XTS, and must
+    // outlive the BatchCrypt. It's shared by all the threads.
+    BatchCrypt(const AES& aes, bool encrypt, AES::Mode mode, bool force);
+
+    // Encrypts or decrypts every file, creating the directories the outputs go in. A file that
+    // fails is reported to 'errors' and counted, and the rest carry on; a failed decryption's
+    // output is removed, as it is for a single file.
+    Summary run(std::vector<File> files, std::ostream& errors) const;
+
+private:
+    const AES& m_aes;
+    bool m_encrypt;
+    AES::Mode m_mode;
+    bool m_force;
+
+    // Returns the size of the output
+    uint64_t cryptFile(const File& file) const;
+    // Maps the files if they're regular files, or else streams them
+    void cryptContents(const File& file, bool xts) const;
+};
@@ -0,0 +1,135 @@
+#include "keyschedulecache.h"
+#include "randomgenerator.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+KeyScheduleCache::KeyScheduleCache(size_t capacity, AES::Backend backend)
+    : m_capacity(std::max<size_t>(capacity, 1)), m_backend(backend)
+{
+    if (!AES::backendSupported(backend))
+    {
+        throw std::invalid_argument(std::string("Error: This CPU doesn't support the ") + AES::backendName(backend) + " backend.");
+    }
+    std::vector<uint8_t> macKey(16);
+    RandomGenerator::threadLocal().generate(macKey.data(), macKey.size());
+    m_hashCipher = std::make_unique<AES>(macKey, backend);
+    std::fill(macKey.begin(), macKey.end(), 0);
+}
+
+KeyScheduleCache::~KeyScheduleCache()
+{
+    clear();
+}
+
+std::shared_ptr<const AES::KeySchedule> KeyScheduleCache::get(const std::vector<uint8_t>& key)
+{
+    size_t hash = hashKey(key);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto entry = find(key, hash);
+        if (entry != m_entries.end())
+        {
+            m_hits++;
+            return entry->schedule;
+        }
+    }
+
+    // Expand outside the lock, so other threads' hits don't wait on it. This also checks the
+    // key's size before it's copied into an entry.
+    std::shared_ptr<const AES::KeySchedule> schedule = AES::expandKey(key, m_backend);
+    m_misses++;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // Another thread may have cached the same key in the meantime
+    auto entry = find(key, hash);
+    if (entry != m_entries.end())
+    {
+        return entry->schedule;
+    }
+    if (m_entries.size() >= m_capacity)
+    {
+        evict(std::prev(m_entries.end()));
+    }
+    m_entries.emplace_front();
+    Entry& added = m_entries.front();
+    std::copy(key.begin(), key.end(), added.key.begin());
+    added.keySize = key.size();
+    added.hash = hash;
+    added.schedule = schedule;
+    m_index.emplace(hash, m_entries.begin());
+    return schedule;
+}
+
+void KeyScheduleCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (!m_entries.empty())
+    {
+        evict(m_entries.begin());
+    }
+}
+
+size_t KeyScheduleCache::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+size_t KeyScheduleCache::hashKey(const std::vector<uint8_t>& key) const
+{
+    // Too long to be an AES key, so it'll never be cached, and expandKey will turn it away
+    if (key.size() > 32)
+    {
+        return 0;
+    }
+    // CBC-MAC of a block holding the key's size followed by the key, zero-padded to 32 bytes.
+    // Every input is the same 3 blocks long, which CBC-MAC needs to be secure.
+    std::array<uint8_t, 48> blocks = {};
+    blocks[0] = static_cast<uint8_t>(key.size());
+    std::copy(key.begin(), key.end(), blocks.begin() + 16);
+    std::array<uint8_t, 16> mac = {};
+    m_hashCipher->encryptBlocksCBC(blocks.data(), blocks.data(), 3, mac);
+    size_t hash;
+    std::memcpy(&hash, mac.data(), sizeof(hash));
+    std::fill(blocks.begin(), blocks.end(), 0);
+    std::fill(mac.begin(), mac.end(), 0);
+    return hash;
+}
+
+std::list<KeyScheduleCache::Entry>::iterator KeyScheduleCache::find(const std::vector<uint8_t>& key, size_t hash)
+{
+    auto range = m_index.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        Entry& entry = *it->second;
+        if (entry.keySize != key.size())
+        {
+            continue;
+        }
+        // Compare every byte, so the time taken doesn't reveal how much of a key matched
+        uint8_t difference = 0;
+        for (size_t i = 0; i < key.size(); i++) difference |= entry.key[i] ^ key[i];
+        if (difference == 0)
+        {
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return m_entries.begin();
+        }
+    }
+    return m_entries.end();
+}
+
+void KeyScheduleCache::evict(std::list<Entry>::iterator entry)
+{
+    auto range = m_index.equal_range(entry->hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second == entry)
+        {
+            m_index.erase(it);
+            break;
+        }
+    }
+    std::fill(entry->key.begin(), entry->key.end(), 0);
+    m_entries.erase(entry);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "aes.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// A bounded cache of expanded keys, for services that encrypt small messages under many
+// different keys and would otherwise spend most of their time expanding the same keys again.
+// When it's full, the least recently used schedule is evicted. Safe to use from many threads.
+class KeyScheduleCache
+{
+public:
+    // Holds at most 'capacity' schedules (at least 1), expanded for 'backend'. Throws if the CPU
+    // doesn't support the backend.
+    explicit KeyScheduleCache(size_t capacity, AES::Backend backend = AES::detectBackend());
+    ~KeyScheduleCache();
+
+    KeyScheduleCache(const KeyScheduleCache&) = delete;
+    KeyScheduleCache& operator=(const KeyScheduleCache&) = delete;
+
+    // Returns the schedule for 'key', expanding it and caching it if it isn't cached already.
+    // Throws, as AES::expandKey does, if the key isn't 128, 192, or 256 bits.
+    std::shared_ptr<const AES::KeySchedule> get(const std::vector<uint8_t>& key);
+
+    // Evicts every schedule
+    void clear();
+
+    // How many calls to get found their key cached, and how many had to expand it
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+    size_t size() const;
+    size_t capacity() const { return m_capacity; }
+
+private:
+    // The copy of the key is kept to check that a hash match really is the same key. Evicting
+    // an entry zeroes the copy and drops the cache's reference to the schedule, which zeroes
+    // itself as soon as no AES object is using it.
+    struct Entry
+    {
+        std::array<uint8_t, 32> key;
+        size_t keySize;
+        size_t hash;
+        std::shared_ptr<const AES::KeySchedule> schedule;
+    };
+
+    const size_t m_capacity;
+    const AES::Backend m_backend;
+    // Keys are bucketed by a MAC under this cipher's random key, rather than by a plain hash of
+    // the key bytes, so the buckets, which stay in memory, don't give away anything about the keys
+    std::unique_ptr<const AES> m_hashCipher;
+    // Most recently used first
+    std::list<Entry> m_entries;
+    std::unordered_multimap<size_t, std::list<Entry>::iterator> m_index;
+    mutable std::mutex m_mutex;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+
+    size_t hashKey(const std::vector<uint8_t>& key) const;
+    // Finds the entry for 'key' and moves it to the front, or returns m_entries.end()
+    std::list<Entry>::iterator find(const std::vector<uint8_t>& key, size_t hash);
+    void evict(std::list<Entry>::iterator entry);
+};
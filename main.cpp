@@ -1,5 +1,8 @@
 #include "aes.h"
 #include "argparse.h"
+#include "batchcrypt.h"
+#include "pipeline.h"
+#include "threadpool.h"
 #include <iostream>
 #include <algorithm>
 #include <vector>
@@ -7,6 +10,10 @@
 #include <fstream>
 #include <filesystem>
 #include <string>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 using argparse::Argument;
 using argparse::ArgumentParser;
@@ -16,20 +23,34 @@ int main(int argc, char** argv)
 {
     ArgumentParser ap;
 
+    // The benchmarks don't read a key or any files, so they don't need -k, -e/-d, or the input
+    // and output. Look for them before parsing, which would otherwise insist on those.
+    bool benchmarkOnly = false;
+    for (int i = 1; i < argc && string(argv[i]) != "--"; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--benchmark" || arg == "--benchmark-latency" || arg == "--benchmark-batch")
+        {
+            benchmarkOnly = true;
+        }
+    }
+
     Argument inArg("input");
-    inArg.help = "The file to encrypt/decrypt";
+    inArg.required = !benchmarkOnly;
+    inArg.help = "The file to encrypt/decrypt, or - for stdin";
     ap.addArgument(inArg);
     string input;
 
     Argument outArg("output");
-    outArg.help = "Indicates where the output of the encrypt/decrypt operation should be written. Will not overwrite existing file unless the -f option is used.";
+    outArg.required = !benchmarkOnly;
+    outArg.help = "Indicates where the output of the encrypt/decrypt operation should be written, or - for stdout. Will not overwrite existing file unless the -f option is used.";
     ap.addArgument(outArg);
     string output;
 
     Argument keyArg("--key");
     keyArg.shortName = "-k";
-    keyArg.required = true;
-    keyArg.help = "The file containing AES key. The file must contain exactly 16, 24, or 32 bytes.";
+    keyArg.required = !benchmarkOnly;
+    keyArg.help = "The file containing AES key. The file must contain exactly 16, 24, or 32 bytes, or for xts, 32 or 64 bytes: the key followed by the tweak key.";
     keyArg.metavar = "KeyFilepath";
     ap.addArgument(keyArg);
     string key;
@@ -44,16 +65,59 @@ int main(int argc, char** argv)
     decryptArg.nargs = 0;
     decryptArg.help = "Decrypt the input file. (Mutually exclusive with --encrypt.)";
     bool decrypt;
-    ap.addMutuallyExclusiveArguments({encryptArg, decryptArg}, true);
+    ap.addMutuallyExclusiveArguments({encryptArg, decryptArg}, !benchmarkOnly);
 
     Argument modeArg("--mode");
     modeArg.shortName = "-m";
-    modeArg.help = "The mode of operation to use for AES encryption. Valid modes are cbc and ecb, with the default being cbc. The mode is specified in the header of an encrypted file, so this option is ignored when -d is specified.";
-    modeArg.choices = {"cbc", "ecb"};
+    modeArg.help = "The mode of operation to use for AES encryption. Valid modes are cbc, ecb, ctr, gcm, chunked, and xts, with the default being cbc. gcm also detects any tampering with the encrypted file. chunked splits the file into chunks of --chunk-size, each sealed with gcm, so that --offset and --length can decrypt part of it. xts encrypts each --sector-size sector of a disk image separately, without changing its size. The mode is specified in the header of an encrypted file, so this option is ignored when -d is specified, except for xts, which has no header.";
+    modeArg.choices = {"cbc", "ecb", "ctr", "gcm", "chunked", "xts"};
     modeArg.defaultValue = "cbc";
     ap.addArgument(modeArg);
     string mode;
 
+    Argument backendArg("--backend");
+    backendArg.shortName = "-b";
+    backendArg.help = "The AES implementation to use. The default, auto, picks the fastest one this CPU supports. portable is a table-driven implementation, bitsliced is a constant-time implementation without lookup tables, and aesni, vaes256, and vaes512 use x86 AES instructions.";
+    backendArg.choices = {"auto", "portable", "bitsliced", "aesni", "vaes256", "vaes512"};
+    backendArg.defaultValue = "auto";
+    ap.addArgument(backendArg);
+    string backend;
+
+    Argument chunkArg("--chunk-size");
+    chunkArg.shortName = "-c";
+    chunkArg.help = "The number of KiB to read, encrypt/decrypt, and write at once. Larger chunks mean fewer I/O calls and more work to spread over the cores. The default is 1024 (1 MiB).";
+    chunkArg.metavar = "KiB";
+    chunkArg.defaultValue = "1024";
+    ap.addArgument(chunkArg);
+    size_t chunkKiB;
+
+    Argument sectorArg("--sector-size");
+    sectorArg.help = "The size of an xts sector, in bytes. Must be a multiple of 16. The default is 512.";
+    sectorArg.metavar = "Bytes";
+    sectorArg.defaultValue = "512";
+    ap.addArgument(sectorArg);
+    size_t sectorSize;
+
+    Argument offsetArg("--offset");
+    offsetArg.help = "With -d, decrypt only the plaintext from this byte on. The input must be a regular file in chunked mode, and only the chunks that hold the range are decrypted and authenticated.";
+    offsetArg.metavar = "Bytes";
+    offsetArg.defaultValue = "0";
+    ap.addArgument(offsetArg);
+    uint64_t offset;
+
+    Argument lengthArg("--length");
+    lengthArg.help = "With -d, decrypt at most this many bytes of plaintext from --offset on. The default is the rest of the file.";
+    lengthArg.metavar = "Bytes";
+    lengthArg.defaultValue = "all";
+    ap.addArgument(lengthArg);
+    string length;
+
+    Argument batchModeArg("--batch");
+    batchModeArg.help = "Encrypt/decrypt many files: input is a directory, or a manifest file listing one path per line, and output is the directory to write the results to, at the same paths. Files are spread over all cores, and so are the chunks of large files in ecb, ctr, chunked, and xts modes, and when decrypting cbc; cbc and gcm encryption, and gcm decryption, run each file on one core, so use chunked mode for large files. A summary of files/sec and bytes/sec is written to cout at the end.";
+    batchModeArg.nargs = 0;
+    ap.addArgument(batchModeArg);
+    bool batch;
+
     Argument forceArg("--force");
     forceArg.shortName = "-f";
     forceArg.help = "Overwrites output file if it already exists.";
@@ -75,6 +139,31 @@ int main(int argc, char** argv)
     ap.addArgument(testArg);
     bool test;
 
+    Argument benchmarkArg("--benchmark");
+    benchmarkArg.help = "Instead of encrypting/decrypting a file, measure the throughput of ECB and CBC encryption and decryption for each key size and message sizes from 16 bytes up, and write the results to cout as JSON. Uses the backend given by -b, or every backend this CPU supports with -b auto. The key, -e/-d, and the input and output can be left out.";
+    benchmarkArg.nargs = 0;
+    ap.addArgument(benchmarkArg);
+    bool benchmark;
+
+    Argument latencyArg("--benchmark-latency");
+    latencyArg.help = "Like --benchmark, but measures the latency in nanoseconds of key setup, encrypting and decrypting one block, and encrypting a small message in each mode, with a histogram of each.";
+    latencyArg.nargs = 0;
+    ap.addArgument(latencyArg);
+    bool benchmarkLatency;
+
+    Argument batchArg("--benchmark-batch");
+    batchArg.help = "Like --benchmark, but compares CBC-encrypting a batch of 256 messages, each with its own key, one message at a time and with the multi-buffer engine, for message sizes from 64 bytes to 16 KiB.";
+    batchArg.nargs = 0;
+    ap.addArgument(batchArg);
+    bool benchmarkBatch;
+
+    Argument benchmarkMaxArg("--benchmark-max-size");
+    benchmarkMaxArg.help = "The largest message size for --benchmark, in KiB. The default is 1048576 (1 GiB).";
+    benchmarkMaxArg.metavar = "KiB";
+    benchmarkMaxArg.defaultValue = "1048576";
+    ap.addArgument(benchmarkMaxArg);
+    uint64_t benchmarkMaxKiB;
+
     try
     {
         ap.parse(argc, argv);
@@ -84,9 +173,19 @@ int main(int argc, char** argv)
         encrypt = ap.get<bool>("--encrypt");
         decrypt = ap.get<bool>("--decrypt");
         mode = ap.get<string>("--mode");
+        backend = ap.get<string>("--backend");
+        chunkKiB = ap.get<size_t>("--chunk-size");
+        sectorSize = ap.get<size_t>("--sector-size");
+        offset = ap.get<uint64_t>("--offset");
+        length = ap.get<string>("--length");
+        batch = ap.get<bool>("--batch");
         force = ap.get<bool>("--force");
         verbose = ap.get<bool>("--verbose");
         test = ap.get<bool>("--test");
+        benchmark = ap.get<bool>("--benchmark");
+        benchmarkLatency = ap.get<bool>("--benchmark-latency");
+        benchmarkBatch = ap.get<bool>("--benchmark-batch");
+        benchmarkMaxKiB = ap.get<uint64_t>("--benchmark-max-size");
     }
     catch(const std::exception& e)
     {
@@ -110,6 +209,124 @@ int main(int argc, char** argv)
     {
         modeOpt = AES::Mode::CBC;
     }
+    else if (mode == "ctr")
+    {
+        modeOpt = AES::Mode::CTR;
+    }
+    else if (mode == "gcm")
+    {
+        modeOpt = AES::Mode::GCM;
+    }
+    else if (mode == "chunked")
+    {
+        modeOpt = AES::Mode::Chunked;
+    }
+    else if (mode == "xts")
+    {
+        modeOpt = AES::Mode::XTS;
+    }
+    bool xts = mode == "xts";
+
+    bool range = offset != 0 || length != "all";
+    uint64_t lengthBytes = UINT64_MAX;
+    if (length != "all")
+    {
+        try
+        {
+            size_t end;
+            lengthBytes = std::stoull(length, &end);
+            if (end != length.size())
+            {
+                throw std::invalid_argument(length);
+            }
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Error: --length must be a number of bytes.\n";
+            return EINVAL;
+        }
+    }
+    if (range && encrypt)
+    {
+        std::cerr << "Error: --offset and --length can only be used with -d.\n";
+        return EINVAL;
+    }
+    if (range && batch)
+    {
+        std::cerr << "Error: --offset and --length can't be used with --batch.\n";
+        return EINVAL;
+    }
+
+    // "-" is stdin or stdout, for use in a shell pipeline
+    bool stdinInput = input == "-";
+    bool stdoutOutput = output == "-";
+    if ((stdinInput || stdoutOutput) && (range || batch))
+    {
+        std::cerr << "Error: - can't be used with --offset, --length, or --batch.\n";
+        return EINVAL;
+    }
+
+    if (chunkKiB == 0 || chunkKiB > (1 << 20))
+    {
+        std::cerr << "Error: Chunk size must be between 1 KiB and 1 GiB (1048576 KiB).\n";
+        return EINVAL;
+    }
+
+    AES::Backend backendOpt = AES::detectBackend();
+    if (backend == "portable")
+    {
+        backendOpt = AES::Backend::Portable;
+    }
+    else if (backend == "bitsliced")
+    {
+        backendOpt = AES::Backend::Bitsliced;
+    }
+    else if (backend == "aesni")
+    {
+        backendOpt = AES::Backend::AESNI;
+    }
+    else if (backend == "vaes256")
+    {
+        backendOpt = AES::Backend::VAES256;
+    }
+    else if (backend == "vaes512")
+    {
+        backendOpt = AES::Backend::VAES512;
+    }
+
+    if (benchmark || benchmarkLatency || benchmarkBatch)
+    {
+        std::vector<AES::Backend> backends;
+        for (AES::Backend candidate : {AES::Backend::Portable, AES::Backend::Bitsliced, AES::Backend::AESNI,
+                                       AES::Backend::VAES256, AES::Backend::VAES512})
+        {
+            if ((backend == "auto" && AES::backendSupported(candidate)) || (backend != "auto" && candidate == backendOpt))
+            {
+                backends.push_back(candidate);
+            }
+        }
+        try
+        {
+            if (benchmark)
+            {
+                AES::benchmark(std::cout, backends, benchmarkMaxKiB * 1024);
+            }
+            else if (benchmarkLatency)
+            {
+                AES::benchmarkLatency(std::cout, backends);
+            }
+            else
+            {
+                AES::benchmarkBatch(std::cout, backends);
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return EINVAL;
+        }
+        return 0;
+    }
 
     // Open keyfile and load key
     std::ifstream keyfile(key, std::ios::in | std::ios::binary);
@@ -118,9 +335,11 @@ int main(int argc, char** argv)
         std::cerr << "Error: Failed to open key file: " << key << "\n";
         return EBADF;
     }
+    // XTS takes two keys of the same size, back to back
+    size_t maxKeySize = xts ? 64 : 32;
     std::vector<uint8_t> keyValue;
-    keyValue.resize(32); // max keysize is 32 bytes, AES-256
-    keyfile.read(reinterpret_cast<char*>(keyValue.data()), 32);
+    keyValue.resize(maxKeySize);
+    keyfile.read(reinterpret_cast<char*>(keyValue.data()), maxKeySize);
     keyValue.resize(keyfile.gcount());
     if (keyfile.gcount() < 16)
     {
@@ -129,61 +348,201 @@ int main(int argc, char** argv)
     }
     if (keyfile.peek() != EOF)
     {
-        std::cerr << "Error: Key is larger than 32 bytes. The AES maximum keysize is 32 bytes.\n";
+        std::cerr << "Error: Key is larger than " << maxKeySize << " bytes. The AES maximum keysize is 32 bytes.\n";
         return EINVAL;
     }
+    std::vector<uint8_t> tweakKeyValue;
+    if (xts)
+    {
+        if (keyValue.size() != 32 && keyValue.size() != 64)
+        {
+            std::cerr << "Error: An xts key file must hold two 16-byte or two 32-byte keys (32 or 64 bytes).\n";
+            return EINVAL;
+        }
+        tweakKeyValue.assign(keyValue.begin() + keyValue.size() / 2, keyValue.end());
+        keyValue.resize(keyValue.size() / 2);
+    }
 
-    // Open plaintext and ciphertext files
-    std::ifstream inputFile(input, std::ios::in | std::ios::binary);
-    if (!inputFile)
+    // Batch mode reads the key once and shares one AES object, and so one key schedule, between
+    // every file
+    if (batch)
     {
-        std::cerr << "Error: Failed to open input file: " << input << "\n";
-        return EBADF;
+        try
+        {
+            AES aes(keyValue, backendOpt);
+            aes.setChunkSize(chunkKiB * 1024);
+            if (xts)
+            {
+                aes.setTweakKey(tweakKeyValue);
+                aes.setSectorSize(sectorSize);
+            }
+            std::vector<BatchCrypt::File> files = std::filesystem::is_directory(input)
+                ? BatchCrypt::fromDirectory(input, output)
+                : BatchCrypt::fromManifest(input, output);
+            if (verbose)
+            {
+                std::cout << "Backend: " << AES::backendName(aes.backend()) << "\n";
+                std::cout << "Calling " << (encrypt ? "encrypt" : "decrypt") << " on " << files.size() << " files\n";
+                std::cout << "Input: " << input << "\n";
+                std::cout << "Output directory: " << output << "\n";
+                std::cout << "Threads: " << ThreadPool::shared().size() << "\n";
+            }
+            BatchCrypt::Summary summary = BatchCrypt(aes, encrypt, modeOpt, force).run(std::move(files), std::cerr);
+            double seconds = std::max(summary.seconds, 1e-9);
+            std::cout << "Files: " << summary.files << " (" << summary.failures << " failed) in " << summary.seconds << " s\n";
+            std::cout << "Read " << summary.bytesIn << " bytes, wrote " << summary.bytesOut << " bytes\n";
+            std::cout << "Throughput: " << (summary.files - summary.failures) / seconds << " files/sec, "
+                      << summary.bytesIn / seconds / 1e6 << " MB/sec\n";
+            return summary.failures == 0 ? 0 : EIO;
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return EINVAL;
+        }
     }
 
-    if (std::filesystem::exists(output) && !force)
+    // Open plaintext and ciphertext files
+    std::ifstream inputFile;
+    if (!stdinInput)
     {
-        std::cerr << "Error: Force option (-f) isn't used, and output file already exists: " << output << "\n";
-        return EINVAL;
+        inputFile.open(input, std::ios::in | std::ios::binary);
+        if (!inputFile)
+        {
+            std::cerr << "Error: Failed to open input file: " << input << "\n";
+            return EBADF;
+        }
     }
-    std::ofstream outputFile(output, std::ios::out | std::ios::binary);
-    if (!outputFile)
+
+    std::error_code error;
+    if (!stdoutOutput)
     {
-        std::cerr << "Error: Failed to open output file: " << output << "\n";
-        return EBADF;
+        if (std::filesystem::exists(output) && !force)
+        {
+            std::cerr << "Error: Force option (-f) isn't used, and output file already exists: " << output << "\n";
+            return EINVAL;
+        }
+        if (std::filesystem::exists(output) && std::filesystem::equivalent(input, output, error))
+        {
+            std::cerr << "Error: The input and output files must be different files.\n";
+            return EINVAL;
+        }
     }
 
-    // Call encrypt/decrypt
+#ifdef _WIN32
+    // Windows opens stdin and stdout in text mode, which would mangle the binary data
+    if (stdinInput) _setmode(_fileno(stdin), _O_BINARY);
+    if (stdoutOutput) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    // When the output is stdout, verbose output goes to cerr so it doesn't end up in the file
+    std::ostream& status = stdoutOutput ? std::cerr : std::cout;
+    bool mappable = !stdinInput && !stdoutOutput;
+
+    // Call encrypt/decrypt. Regular files are mapped into memory and encrypted straight from one
+    // mapping into the other; anything else, like a pipe, is streamed instead.
+    std::ofstream outputFile;
+    // Set once the output may have been created, so a failure before that leaves an existing
+    // file alone
+    bool outputStarted = false;
     try
     {
-        AES aes(keyValue);
+        AES aes(keyValue, backendOpt);
+        aes.setChunkSize(chunkKiB * 1024);
+        if (xts)
+        {
+            aes.setTweakKey(tweakKeyValue);
+            aes.setSectorSize(sectorSize);
+        }
+        if (verbose)
+        {
+            status << "Backend: " << AES::backendName(aes.backend()) << "\n";
+        }
+        outputStarted = !stdoutOutput;
         if (encrypt)
         {
             if (verbose)
             {
-                std::cout << "Calling encrypt\n";
-                std::cout << "Plaintext file: " << input << "\n";
-                std::cout << "Ciphertext file: " << output << "\n";
-                std::cout << "Key file: " << key << "\n";
-                std::cout << "Mode: " << mode << " (" << static_cast<int>(modeOpt) << ")\n";
+                status << "Calling encrypt\n";
+                status << "Plaintext file: " << input << "\n";
+                status << "Ciphertext file: " << output << "\n";
+                status << "Key file: " << key << "\n";
+                status << "Chunk size: " << chunkKiB << " KiB\n";
+                status << "Mode: " << mode << " (" << static_cast<int>(modeOpt) << ")\n";
+            }
+            if (mappable && aes.encryptFile(input, output, modeOpt))
+            {
+                if (verbose) status << "Used memory-mapped files\n";
+                return 0;
             }
-            aes.encrypt(inputFile, outputFile, modeOpt);
         }
         else
         {
             if (verbose)
             {
-                std::cout << "Calling decrypt\n";
-                std::cout << "Ciphertext file: " << input << "\n";
-                std::cout << "Plaintext file: " << output << "\n";
-                std::cout << "Key file: " << key << "\n";
+                status << "Calling decrypt\n";
+                status << "Ciphertext file: " << input << "\n";
+                status << "Plaintext file: " << output << "\n";
+                status << "Key file: " << key << "\n";
+                status << "Chunk size: " << chunkKiB << " KiB\n";
+            }
+            if (range)
+            {
+                if (verbose) status << "Range: " << lengthBytes << " bytes from " << offset << "\n";
+                if (!aes.decryptFileRange(input, output, offset, lengthBytes))
+                {
+                    std::cerr << "Error: With --offset or --length, the input and output must be regular files.\n";
+                    return EINVAL;
+                }
+                return 0;
             }
-            aes.decrypt(inputFile, outputFile);
+            if (mappable && (xts ? aes.decryptSectorsFile(input, output) : aes.decryptFile(input, output)))
+            {
+                if (verbose) status << "Used memory-mapped files\n";
+                return 0;
+            }
+        }
+
+        std::ostream* outputStream = &std::cout;
+        if (!stdoutOutput)
+        {
+            outputFile.open(output, std::ios::out | std::ios::binary);
+            if (!outputFile)
+            {
+                std::cerr << "Error: Failed to open output file: " << output << "\n";
+                return EBADF;
+            }
+            outputStream = &outputFile;
         }
+        // Reading, encrypting, and writing each run on their own thread, so a slow pipe on
+        // either side doesn't hold up the cipher
+        if (verbose) status << "Streaming through a reader/cipher/writer pipeline\n";
+        StreamPipeline pipeline(aes.chunkSize());
+        pipeline.run(stdinInput ? std::cin : inputFile, *outputStream, [&](std::istream& in, std::ostream& out)
+        {
+            if (encrypt)
+            {
+                aes.encrypt(in, out, modeOpt);
+            }
+            else if (xts)
+            {
+                aes.decryptSectors(in, out);
+            }
+            else
+            {
+                aes.decrypt(in, out);
+            }
+        });
     }
     catch (std::exception& e)
     {
         std::cerr << e.what() << "\n";
+        if (outputStarted)
+        {
+            // Don't leave behind plaintext that failed authentication, or a partial or zero-filled
+            // file that looks like ciphertext
+            outputFile.close();
+            std::filesystem::remove(output, error);
+        }
         return EINVAL;
     }
     return 0;
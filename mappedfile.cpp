@@ -0,0 +1,235 @@
+#include "mappedfile.h"
+#include <filesystem>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::isMappable(const std::string& path)
+{
+    std::error_code error;
+    return std::filesystem::is_regular_file(path, error);
+}
+
+#ifdef _WIN32
+
+// The CreateFile flag for how a file will be read
+static DWORD accessFlag(MappedFile::Access access)
+{
+    switch (access)
+    {
+        case MappedFile::Access::Sequential:
+            return FILE_FLAG_SEQUENTIAL_SCAN;
+        case MappedFile::Access::Random:
+            return FILE_FLAG_RANDOM_ACCESS;
+        default:
+            return FILE_ATTRIBUTE_NORMAL;
+    }
+}
+
+MappedFile::MappedFile(const std::string& path, Access access)
+    : m_access(access), m_path(path)
+{
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                         accessFlag(access), nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        m_file = nullptr;
+        throw std::runtime_error("Error: Failed to open file for mapping: " + path);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || static_cast<uint64_t>(size.QuadPart) > std::numeric_limits<size_t>::max())
+    {
+        close();
+        throw std::runtime_error("Error: Failed to get the size of file: " + path);
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+    map();
+}
+
+MappedFile::MappedFile(const std::string& path, uint64_t size, Access access)
+    : m_writable(true), m_access(access), m_path(path)
+{
+    if (size > std::numeric_limits<size_t>::max())
+    {
+        throw std::runtime_error("Error: File is too large to map: " + path);
+    }
+    m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                         accessFlag(access), nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        m_file = nullptr;
+        throw std::runtime_error("Error: Failed to create file for mapping: " + path);
+    }
+    m_size = static_cast<size_t>(size);
+    map();
+}
+
+void MappedFile::map()
+{
+    if (m_size == 0)
+    {
+        return;
+    }
+    // For a writable mapping, CreateFileMapping extends the file to the mapping's size
+    ULARGE_INTEGER size;
+    size.QuadPart = m_size;
+    m_mapping = CreateFileMappingA(m_file, nullptr, m_writable ? PAGE_READWRITE : PAGE_READONLY,
+                                   size.HighPart, size.LowPart, nullptr);
+    if (m_mapping != nullptr)
+    {
+        m_data = static_cast<uint8_t*>(MapViewOfFile(m_mapping, m_writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, m_size));
+    }
+    if (m_data == nullptr)
+    {
+        close();
+        throw std::runtime_error("Error: Failed to map file: " + m_path);
+    }
+}
+
+void MappedFile::unmap()
+{
+    if (m_data != nullptr)
+    {
+        UnmapViewOfFile(m_data);
+        m_data = nullptr;
+    }
+    if (m_mapping != nullptr)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+}
+
+void MappedFile::close()
+{
+    unmap();
+    if (m_file != nullptr)
+    {
+        CloseHandle(m_file);
+        m_file = nullptr;
+    }
+}
+
+void MappedFile::shrink(uint64_t size)
+{
+    unmap();
+    LARGE_INTEGER position;
+    position.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+    {
+        throw std::runtime_error("Error: Failed to resize file: " + m_path);
+    }
+    m_size = static_cast<size_t>(size);
+}
+
+#else // POSIX
+
+MappedFile::MappedFile(const std::string& path, Access access)
+    : m_access(access), m_path(path)
+{
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error("Error: Failed to open file for mapping: " + path);
+    }
+    struct stat info;
+    if (fstat(m_fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+        static_cast<uint64_t>(info.st_size) > std::numeric_limits<size_t>::max())
+    {
+        close();
+        throw std::runtime_error("Error: Failed to get the size of file: " + path);
+    }
+    m_size = static_cast<size_t>(info.st_size);
+    map();
+}
+
+MappedFile::MappedFile(const std::string& path, uint64_t size, Access access)
+    : m_writable(true), m_access(access), m_path(path)
+{
+    if (size > std::numeric_limits<size_t>::max())
+    {
+        throw std::runtime_error("Error: File is too large to map: " + path);
+    }
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error("Error: Failed to create file for mapping: " + path);
+    }
+    // The output size is known up front, so size the file before mapping it
+    if (ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+    {
+        close();
+        throw std::runtime_error("Error: Failed to resize file: " + path);
+    }
+    m_size = static_cast<size_t>(size);
+    map();
+}
+
+void MappedFile::map()
+{
+    if (m_size == 0)
+    {
+        return;
+    }
+    void* data = mmap(nullptr, m_size, m_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close();
+        throw std::runtime_error("Error: Failed to map file: " + m_path);
+    }
+    m_data = static_cast<uint8_t*>(data);
+    if (m_access == Access::Sequential)
+    {
+        madvise(m_data, m_size, MADV_SEQUENTIAL);
+    }
+    else if (m_access == Access::Random)
+    {
+        madvise(m_data, m_size, MADV_RANDOM);
+    }
+}
+
+void MappedFile::unmap()
+{
+    if (m_data != nullptr)
+    {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+    }
+}
+
+void MappedFile::close()
+{
+    unmap();
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+void MappedFile::shrink(uint64_t size)
+{
+    unmap();
+    if (ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+    {
+        throw std::runtime_error("Error: Failed to resize file: " + m_path);
+    }
+    m_size = static_cast<size_t>(size);
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A file mapped into memory, so it can be read or written without copying through a stream.
+// Throws std::runtime_error if the file can't be opened, sized, or mapped.
+class MappedFile
+{
+public:
+    // How the mapping will be read, which tells the OS how far to read ahead: Sequential for one
+    // pass front to back, Random for a few scattered pieces, and Normal to leave it to the OS
+    enum class Access
+    {
+        Normal,
+        Sequential,
+        Random
+    };
+
+    // Maps an existing file read-only
+    explicit MappedFile(const std::string& path, Access access = Access::Sequential);
+    // Creates the file (or truncates an existing one), sizes it to 'size' bytes, and maps it
+    // read-write. Changes are written back to the file when it's unmapped.
+    MappedFile(const std::string& path, uint64_t size, Access access = Access::Normal);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // The mapped bytes. An empty file has no mapping, and data() returns nullptr.
+    const uint8_t* data() const { return m_data; }
+    uint8_t* data() { return m_data; }
+    size_t size() const { return m_size; }
+
+    // Unmaps a writable file and cuts it down to its first 'size' bytes, for when the final
+    // size wasn't known up front. data() is nullptr afterwards.
+    void shrink(uint64_t size);
+
+    // Whether 'path' is a regular file, which can be mapped, rather than a pipe or device
+    static bool isMappable(const std::string& path);
+
+private:
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_writable = false;
+    Access m_access;
+    std::string m_path;
+#ifdef _WIN32
+    void* m_file = nullptr;    // HANDLE
+    void* m_mapping = nullptr; // HANDLE
+#else
+    int m_fd = -1;
+#endif
+
+    void map();
+    void unmap();
+    void close();
+};
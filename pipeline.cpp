@@ -0,0 +1,270 @@
+#include "pipeline.h"
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+
+StreamPipeline::Ring::Ring(size_t numBuffers, size_t bufferSize)
+    : m_buffers(numBuffers)
+{
+    for (Buffer& buffer : m_buffers)
+    {
+        buffer.data.resize(bufferSize);
+        m_empty.push_back(&buffer);
+    }
+}
+
+StreamPipeline::Buffer* StreamPipeline::Ring::takeEmpty()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] { return m_stopped || !m_empty.empty(); });
+    if (m_stopped)
+    {
+        return nullptr;
+    }
+    Buffer* buffer = m_empty.front();
+    m_empty.pop_front();
+    return buffer;
+}
+
+StreamPipeline::Buffer* StreamPipeline::Ring::takeFull()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this] { return m_stopped || m_finished || !m_full.empty(); });
+    if (m_stopped || m_full.empty())
+    {
+        return nullptr;
+    }
+    Buffer* buffer = m_full.front();
+    m_full.pop_front();
+    return buffer;
+}
+
+void StreamPipeline::Ring::putFull(Buffer* buffer)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_full.push_back(buffer);
+    }
+    m_changed.notify_all();
+}
+
+void StreamPipeline::Ring::putEmpty(Buffer* buffer)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_empty.push_back(buffer);
+    }
+    m_changed.notify_all();
+}
+
+void StreamPipeline::Ring::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+    }
+    m_changed.notify_all();
+}
+
+void StreamPipeline::Ring::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_changed.notify_all();
+}
+
+// The cipher's input: reads straight out of the full buffers the reader thread hands over
+class StreamPipeline::RingReader : public std::streambuf
+{
+public:
+    explicit RingReader(Ring& ring) : m_ring(ring) {}
+
+    ~RingReader()
+    {
+        if (m_buffer) m_ring.putEmpty(m_buffer);
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (m_buffer)
+        {
+            m_ring.putEmpty(m_buffer);
+        }
+        m_buffer = m_ring.takeFull();
+        if (!m_buffer)
+        {
+            setg(nullptr, nullptr, nullptr);
+            return traits_type::eof();
+        }
+        char* data = reinterpret_cast<char*>(m_buffer->data.data());
+        setg(data, data, data + m_buffer->size);
+        return traits_type::to_int_type(*data);
+    }
+
+private:
+    Ring& m_ring;
+    Buffer* m_buffer = nullptr;
+};
+
+// The cipher's output: fills empty buffers and hands them to the writer thread as they fill up
+class StreamPipeline::RingWriter : public std::streambuf
+{
+public:
+    explicit RingWriter(Ring& ring) : m_ring(ring) {}
+
+    ~RingWriter()
+    {
+        if (m_buffer) m_ring.putEmpty(m_buffer);
+    }
+
+    // Hands over the last buffer, however full it is, and tells the writer that's everything
+    void finish()
+    {
+        handOver();
+        m_ring.finish();
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        handOver();
+        m_buffer = m_ring.takeEmpty();
+        if (!m_buffer)
+        {
+            // The writer has stopped, so the ostream goes bad
+            return traits_type::eof();
+        }
+        char* data = reinterpret_cast<char*>(m_buffer->data.data());
+        setp(data, data + m_buffer->data.size());
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    Ring& m_ring;
+    Buffer* m_buffer = nullptr;
+
+    void handOver()
+    {
+        if (!m_buffer)
+        {
+            return;
+        }
+        m_buffer->size = pptr() - pbase();
+        if (m_buffer->size != 0)
+        {
+            m_ring.putFull(m_buffer);
+        }
+        else
+        {
+            m_ring.putEmpty(m_buffer);
+        }
+        m_buffer = nullptr;
+        setp(nullptr, nullptr);
+    }
+};
+
+StreamPipeline::StreamPipeline(size_t bufferSize, size_t numBuffers)
+    : m_bufferSize(std::max<size_t>(bufferSize, 1)), m_numBuffers(std::max<size_t>(numBuffers, 2))
+{
+}
+
+void StreamPipeline::run(std::istream& in, std::ostream& out,
+                         const std::function<void(std::istream& pipedIn, std::ostream& pipedOut)>& cipher) const
+{
+    Ring inRing(m_numBuffers, m_bufferSize);
+    Ring outRing(m_numBuffers, m_bufferSize);
+    // Each is only written by its own thread, and only read after that thread is joined
+    bool readFailed = false;
+    bool writeFailed = false;
+
+    std::thread reader([&]
+    {
+        while (Buffer* buffer = inRing.takeEmpty())
+        {
+            in.read(reinterpret_cast<char*>(buffer->data.data()), buffer->data.size());
+            buffer->size = in.gcount();
+            if (buffer->size != 0)
+            {
+                inRing.putFull(buffer);
+            }
+            else
+            {
+                inRing.putEmpty(buffer);
+            }
+            if (!in)
+            {
+                // A short read sets failbit at the end of the input too; only badbit is an error
+                readFailed = in.bad();
+                break;
+            }
+        }
+        inRing.finish();
+    });
+    std::thread writer([&]
+    {
+        while (Buffer* buffer = outRing.takeFull())
+        {
+            out.write(reinterpret_cast<char*>(buffer->data.data()), buffer->size);
+            outRing.putEmpty(buffer);
+            if (!out)
+            {
+                break;
+            }
+        }
+        writeFailed = !out.flush();
+        // Nothing more can be written, so stop the cipher and the reader early
+        if (writeFailed)
+        {
+            outRing.stop();
+            inRing.stop();
+        }
+    });
+
+    std::exception_ptr error;
+    {
+        RingReader readerBuf(inRing);
+        RingWriter writerBuf(outRing);
+        std::istream pipedIn(&readerBuf);
+        std::ostream pipedOut(&writerBuf);
+        try
+        {
+            cipher(pipedIn, pipedOut);
+            writerBuf.finish();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+    }
+    // Whatever the cipher didn't read is left unread. After an error, nothing more is written.
+    inRing.stop();
+    if (error)
+    {
+        outRing.stop();
+    }
+    reader.join();
+    writer.join();
+
+    if (readFailed)
+    {
+        throw std::runtime_error("Error: Failed to read the input.");
+    }
+    if (writeFailed)
+    {
+        throw std::runtime_error("Error: Failed to write the output.");
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
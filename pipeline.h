@@ -0,0 +1,68 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Streams data through a cipher in three stages, each on its own thread: one reads the input
+// into a ring of buffers, the calling thread encrypts or decrypts, and another writes the output
+// from a second ring. Reading the next chunk and writing the last one overlap with the cipher,
+// which matters for pipes like stdin and stdout, where every read and write can block.
+class StreamPipeline
+{
+public:
+    // Each ring has 'numBuffers' buffers (at least 2) of 'bufferSize' bytes
+    explicit StreamPipeline(size_t bufferSize, size_t numBuffers = 4);
+
+    // Runs cipher(pipedIn, pipedOut) on this thread, where pipedIn gives what's read from 'in'
+    // and whatever's written to pipedOut is written to 'out'. Returns once all of it is written.
+    // Rethrows what 'cipher' throws, and throws std::runtime_error if reading or writing fails.
+    void run(std::istream& in, std::ostream& out,
+             const std::function<void(std::istream& pipedIn, std::ostream& pipedOut)>& cipher) const;
+
+private:
+    size_t m_bufferSize;
+    size_t m_numBuffers;
+
+    struct Buffer
+    {
+        std::vector<uint8_t> data;
+        size_t size = 0;
+    };
+
+    // Buffers passed from one stage to the next. The producer takes empty buffers and hands them
+    // back full, in order; the consumer takes the full ones and hands them back empty.
+    class Ring
+    {
+    public:
+        Ring(size_t numBuffers, size_t bufferSize);
+
+        // Block until a buffer is available. Return nullptr once the ring is stopped, or for
+        // takeFull, once the producer is finished and every full buffer has been taken.
+        Buffer* takeEmpty();
+        Buffer* takeFull();
+        void putFull(Buffer* buffer);
+        void putEmpty(Buffer* buffer);
+        // The producer has no more to give
+        void finish();
+        // Wakes both sides and turns them away, for when either one fails
+        void stop();
+
+    private:
+        std::vector<Buffer> m_buffers;
+        std::deque<Buffer*> m_empty;
+        std::deque<Buffer*> m_full;
+        bool m_finished = false;
+        bool m_stopped = false;
+        std::mutex m_mutex;
+        std::condition_variable m_changed;
+    };
+
+    class RingReader;
+    class RingWriter;
+};
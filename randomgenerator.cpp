@@ -0,0 +1,162 @@
+#include "randomgenerator.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <bcrypt.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/random.h>
+#endif
+
+// Bumped in the child process after fork. A generator whose generation doesn't match has been
+// copied from the parent, along with its key and counter, so it reseeds.
+static std::atomic<uint64_t> s_forkGeneration{0};
+
+static void registerForkHandler()
+{
+#ifndef _WIN32
+    static std::once_flag registered;
+    std::call_once(registered, [] { pthread_atfork(nullptr, nullptr, [] { s_forkGeneration++; }); });
+#endif
+}
+
+// A constant-time backend, so that the generator's key, and so every IV to come, doesn't leak
+// through cache timing
+static AES::Backend generatorBackend()
+{
+    return AES::cpuSupportsAESNI() ? AES::Backend::AESNI : AES::Backend::Bitsliced;
+}
+
+RandomGenerator::RandomGenerator(uint64_t rekeyBytes)
+    : m_rekeyBytes(std::max<uint64_t>(rekeyBytes, 1))
+{
+    registerForkHandler();
+    reseed();
+}
+
+RandomGenerator::~RandomGenerator()
+{
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+    std::fill(m_counter.begin(), m_counter.end(), 0);
+}
+
+void RandomGenerator::generate(uint8_t* out, size_t size)
+{
+    if (m_forkGeneration != s_forkGeneration.load(std::memory_order_relaxed))
+    {
+        reseed();
+    }
+    while (size > 0)
+    {
+        if (m_position == m_buffer.size())
+        {
+            refill();
+        }
+        size_t length = std::min(size, m_buffer.size() - m_position);
+        std::copy(m_buffer.begin() + m_position, m_buffer.begin() + m_position + length, out);
+        std::fill(m_buffer.begin() + m_position, m_buffer.begin() + m_position + length, 0);
+        m_position += length;
+        out += length;
+        size -= length;
+    }
+}
+
+void RandomGenerator::reseed()
+{
+    m_forkGeneration = s_forkGeneration.load(std::memory_order_relaxed);
+    // Always an AES-256 key
+    std::array<uint8_t, 32> key;
+    systemRandom(key.data(), key.size());
+    rekey(key);
+    std::fill(key.begin(), key.end(), 0);
+}
+
+void RandomGenerator::rekey(const std::array<uint8_t, 32>& key)
+{
+    std::vector<uint8_t> keyCopy(key.begin(), key.end());
+    m_aes = std::make_unique<AES>(keyCopy, generatorBackend());
+    std::fill(keyCopy.begin(), keyCopy.end(), 0);
+    m_counter.fill(0);
+    m_bytesSinceRekey = 0;
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+    m_position = m_buffer.size();
+}
+
+void RandomGenerator::refill()
+{
+    if (m_bytesSinceRekey >= m_rekeyBytes)
+    {
+        // The next key is the next two keystream blocks, which are never handed out
+        std::array<uint8_t, 32> key = {};
+        m_aes->cryptCTR(key.data(), key.data(), key.size(), m_counter);
+        rekey(key);
+        std::fill(key.begin(), key.end(), 0);
+    }
+    // Encrypting zeroes in CTR mode gives the keystream itself
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+    m_aes->cryptCTR(m_buffer.data(), m_buffer.data(), m_buffer.size(), m_counter);
+    AES::addToCounter(m_counter, BUFFER_BLOCKS);
+    m_bytesSinceRekey += m_buffer.size();
+    m_position = 0;
+}
+
+RandomGenerator& RandomGenerator::threadLocal()
+{
+    thread_local RandomGenerator generator;
+    return generator;
+}
+
+#ifdef _WIN32
+
+void RandomGenerator::systemRandom(uint8_t* out, size_t size)
+{
+    while (size > 0)
+    {
+        ULONG length = static_cast<ULONG>(std::min<size_t>(size, 1 << 20));
+        if (!BCRYPT_SUCCESS(BCryptGenRandom(nullptr, out, length, BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        {
+            throw std::runtime_error("Error: Failed to get random bytes from the system.");
+        }
+        out += length;
+        size -= length;
+    }
+}
+
+#else // POSIX
+
+void RandomGenerator::systemRandom(uint8_t* out, size_t size)
+{
+    while (size > 0)
+    {
+#ifdef __linux__
+        ssize_t length = getrandom(out, size, 0);
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+#else
+        // getentropy gives at most 256 bytes at once
+        ssize_t length = std::min<size_t>(size, 256);
+        if (getentropy(out, length) != 0)
+        {
+            length = -1;
+        }
+#endif
+        if (length < 0)
+        {
+            throw std::runtime_error("Error: Failed to get random bytes from the system.");
+        }
+        out += length;
+        size -= length;
+    }
+}
+
+#endif
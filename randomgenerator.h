@@ -0,0 +1,56 @@
+#pragma once
+#include "aes.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// A cryptographically secure random number generator for IVs and nonces: AES-256 in CTR mode,
+// keyed from the operating system's generator. Output comes from a buffer of keystream, so
+// most calls are a copy, and only seeding makes a system call. Every rekeyBytes of output, the
+// generator takes its next key from its own keystream and forgets the old one, so a later
+// state doesn't reveal earlier output. Not safe to share between threads; use threadLocal().
+class RandomGenerator
+{
+public:
+    // Seeds from the operating system. Throws std::runtime_error if that fails.
+    explicit RandomGenerator(uint64_t rekeyBytes = DEFAULT_REKEY_BYTES);
+    ~RandomGenerator();
+
+    RandomGenerator(const RandomGenerator&) = delete;
+    RandomGenerator& operator=(const RandomGenerator&) = delete;
+
+    // Fills 'out' with 'size' random bytes
+    void generate(uint8_t* out, size_t size);
+
+    // Throws away the key and everything buffered, and seeds again from the operating system
+    void reseed();
+
+    // The calling thread's generator, created on first use. On POSIX, a child process reseeds
+    // its generators after fork, so it never hands out the same IVs as its parent.
+    static RandomGenerator& threadLocal();
+
+    // Fills 'out' from the operating system's generator (getrandom, getentropy, or
+    // BCryptGenRandom). Throws std::runtime_error if that fails.
+    static void systemRandom(uint8_t* out, size_t size);
+
+    static constexpr uint64_t DEFAULT_REKEY_BYTES = 1 << 20;
+
+private:
+    static constexpr size_t BUFFER_BLOCKS = 32;
+
+    std::unique_ptr<AES> m_aes;
+    std::array<uint8_t, 16> m_counter;
+    // Keystream, of which bytes from m_position on haven't been handed out yet. Bytes are
+    // zeroed as they're handed out.
+    std::array<uint8_t, 16 * BUFFER_BLOCKS> m_buffer;
+    size_t m_position;
+    const uint64_t m_rekeyBytes;
+    uint64_t m_bytesSinceRekey = 0;
+    uint64_t m_forkGeneration;
+
+    // Replaces the cipher with one keyed with 'key', and restarts the counter
+    void rekey(const std::array<uint8_t, 32>& key);
+    // Refills m_buffer with the next keystream blocks, rekeying first if it's time
+    void refill();
+};
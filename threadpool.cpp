@@ -0,0 +1,171 @@
+#include "threadpool.h"
+#include <exception>
+
+// The pool and queue that the calling thread works for, if it's a worker
+static thread_local const ThreadPool* t_pool = nullptr;
+static thread_local size_t t_queue = 0;
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+    for (unsigned int i = 0; i < std::max(numThreads, 1u); i++)
+    {
+        m_queues.push_back(std::make_unique<TaskQueue>());
+    }
+    for (unsigned int i = 1; i < numThreads; i++)
+    {
+        m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_taskAvailable.notify_all();
+    for (std::thread& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool(std::thread::hardware_concurrency());
+    return pool;
+}
+
+size_t ThreadPool::ownQueue() const
+{
+    return t_pool == this ? t_queue : 0;
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+    t_pool = this;
+    t_queue = index;
+    for (;;)
+    {
+        if (runOneTask(index))
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_taskAvailable.wait(lock, [this] { return m_stopping || m_queuedTasks.load() > 0; });
+        if (m_stopping && m_queuedTasks.load() <= 0)
+        {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::popTask(size_t queue, bool newest, std::function<void()>& task)
+{
+    TaskQueue& q = *m_queues[queue];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty())
+    {
+        return false;
+    }
+    if (newest)
+    {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+    }
+    else
+    {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+    }
+    m_queuedTasks--;
+    return true;
+}
+
+bool ThreadPool::runOneTask(size_t self)
+{
+    std::function<void()> task;
+    bool found = popTask(self, true, task);
+    // Steal from the other queues in turn, starting with the next one, so thieves spread out
+    for (size_t i = 1; !found && i < m_queues.size(); i++)
+    {
+        found = popTask((self + i) % m_queues.size(), false, task);
+    }
+    if (found)
+    {
+        task();
+    }
+    return found;
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (count == 1 || m_workers.empty())
+    {
+        for (size_t i = 0; i < count; i++) task(i);
+        return;
+    }
+
+    // Everything the tasks share lives on this stack frame, which is fine because we don't
+    // return until 'remaining' hits 0. The last task notifies while holding doneMutex, so it's
+    // finished with the frame by the time we can see remaining == 0.
+    std::mutex doneMutex;
+    std::condition_variable allDone;
+    size_t remaining = count;
+    std::exception_ptr error;
+
+    // Pushed in reverse, so that the owner, which runs its newest tasks first, starts at task 0
+    // like the thieves, which take the oldest
+    size_t self = ownQueue();
+    {
+        TaskQueue& queue = *m_queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for (size_t i = count; i-- > 0; )
+        {
+            queue.tasks.push_back([&, i]
+            {
+                std::exception_ptr taskError;
+                try
+                {
+                    task(i);
+                }
+                catch (...)
+                {
+                    taskError = std::current_exception();
+                }
+                std::lock_guard<std::mutex> doneLock(doneMutex);
+                if (taskError && !error) error = taskError;
+                if (--remaining == 0) allDone.notify_all();
+            });
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queuedTasks += static_cast<int64_t>(count);
+    }
+    m_taskAvailable.notify_all();
+
+    // Help with queued tasks rather than sitting idle, our own first. This also keeps a
+    // parallelFor called from inside a task from deadlocking when every worker is busy waiting.
+    while (runOneTask(self))
+    {
+        std::lock_guard<std::mutex> doneLock(doneMutex);
+        if (remaining == 0)
+        {
+            break;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> doneLock(doneMutex);
+        allDone.wait(doneLock, [&] { return remaining == 0; });
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
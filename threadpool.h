@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, for splitting work like encrypting a large buffer across cores.
+// Every thread has its own queue of tasks. A thread pushes the tasks it creates onto its own
+// queue and runs them newest first, so nested work (like the chunks of a file that one task is
+// encrypting) stays with the thread that made it. A thread that runs out of tasks steals the
+// oldest task from another thread's queue, which is usually the biggest piece of work left.
+class ThreadPool
+{
+public:
+    // numThreads counts the thread that calls parallelFor, which helps run tasks while it waits,
+    // so numThreads - 1 worker threads are started. With numThreads <= 1, everything runs inline.
+    explicit ThreadPool(unsigned int numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // The number of threads that run tasks, including the caller of parallelFor
+    unsigned int size() const { return static_cast<unsigned int>(m_workers.size()) + 1; }
+
+    // Runs task(i) for every i in [0, count), spread over the pool's threads, and returns once
+    // they've all finished. If any of them throw, the first exception is rethrown here.
+    // Safe to call from inside a task, in which case the new tasks go on that thread's queue.
+    void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+    // The process-wide pool, created on first use with one thread per core
+    static ThreadPool& shared();
+
+private:
+    // One thread's tasks. Its owner pushes and pops at the back, and thieves take from the front.
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // m_queues[i] belongs to worker i; m_queues[0] takes tasks from threads outside the pool
+    std::vector<std::unique_ptr<TaskQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+    // The number of queued tasks, which idle workers sleep on. It's raised under m_mutex, so a
+    // worker can't miss the notification, but may dip below 0 while a push is under way.
+    std::atomic<int64_t> m_queuedTasks{0};
+    std::mutex m_mutex;
+    std::condition_variable m_taskAvailable;
+    bool m_stopping = false;
+
+    void workerLoop(size_t index);
+    // The index of the calling thread's queue
+    size_t ownQueue() const;
+    // Runs one task: the newest from queue 'self', or else the oldest from another queue.
+    // Returns false if every queue was empty.
+    bool runOneTask(size_t self);
+    bool popTask(size_t queue, bool newest, std::function<void()>& task);
+};